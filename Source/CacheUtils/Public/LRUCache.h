@@ -55,6 +55,30 @@ struct TLRUQueue
         return GetIndex(Node);
     }
 
+    // moves the node to the tail, so that it is reused first
+    int Demote(Node* Node)
+    {
+        if (Node == Tail)
+            return GetIndex(Node);
+
+        if (Node == Head)
+        {
+            Head = Node->Next;
+            Head->Prev = nullptr;
+        }
+        else
+        {
+            Node->Prev->Next = Node->Next;
+            Node->Next->Prev = Node->Prev;
+        }
+
+        Node->Prev = Tail;
+        Node->Next = nullptr;
+        Tail->Next = Node;
+        Tail = Node;
+        return GetIndex(Node);
+    }
+
 
     void Reset()
     {
@@ -88,7 +112,9 @@ public:
 
         Index = Queue.Refresh(Queue.Tail);
 
-        NodeMap.Remove(Keys[Index]);
+        // slots which were never used or have been removed do not own their key
+        if (NodeMap.FindRef(Keys[Index]) == Queue.Nodes + Index)
+            NodeMap.Remove(Keys[Index]);
         NodeMap.Add(Key, Queue.Nodes + Index);
         Keys[Index] = MoveTemp(Key);
         return &Values[Index];
@@ -133,6 +159,39 @@ public:
         return &Values[Queue.Refresh(Node)];
     }
 
+    bool Remove(const KeyType& Key)
+    {
+        auto Node = NodeMap.FindRef(Key);
+        if (Node == nullptr)
+            return false;
+
+        NodeMap.Remove(Key);
+        auto Index = Queue.Demote(Node);
+        Keys[Index] = {};
+        Values[Index] = {};
+        return true;
+    }
+
+    // the entry the next Push of a new key replaces, null when that slot is unused
+    ValueType* GetLeastRecent(KeyType& OutKey)
+    {
+        auto Index = Queue.GetIndex(Queue.Tail);
+        if (NodeMap.FindRef(Keys[Index]) != Queue.Tail)
+            return nullptr;
+
+        OutKey = Keys[Index];
+        return &Values[Index];
+    }
+
+    template<class FuncType>
+    void ForEach(FuncType&& Func)
+    {
+        for (auto& Item : NodeMap)
+        {
+            Func(Item.Key, Values[Queue.GetIndex(Item.Value)]);
+        }
+    }
+
 
     void Reset()
     {
@@ -194,7 +253,9 @@ public:
 
         Index = Queue.Refresh(Queue.Tail);
 
-        NodeMap.Remove(Keys[Index]);
+        // slots which were never used or have been removed do not own their key
+        if (NodeMap.FindRef(Keys[Index]) == Queue.Nodes + Index)
+            NodeMap.Remove(Keys[Index]);
         NodeMap.Add(Key, Queue.Nodes + Index);
         Keys[Index] = MoveTemp(Key);
         return &Values[Index];
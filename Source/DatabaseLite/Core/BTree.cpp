@@ -1,20 +1,17 @@
 #include "BTree.h"
-
-
-struct FData
-{
-	uint32 Data;
-	uint32 Next;
-};
+#include "Range.h"
 
 constexpr int KEY_SIZE = sizeof(int64);
 constexpr int DATA_SIZE = sizeof(FData);
+static_assert(DATA_SIZE == sizeof(uint32) + sizeof(FDataPos), "data is stored without padding");
 constexpr int CHILD_SIZE = sizeof(uint32);
 
 constexpr int M = FILE_PAGE_SIZE / (KEY_SIZE + DATA_SIZE + CHILD_SIZE) - 1;
 constexpr int MAX_NUM_KEYS = M - 1;
 constexpr int MAX_NUM_DATAS = M - 1;
 constexpr int MAX_NUM_CHILDREN = M;
+// a node split from a full one has this many keys, removal keeps every node but the root at least as full
+constexpr int MIN_NUM_KEYS = (MAX_NUM_KEYS - 1) / 2;
 
 
 
@@ -41,13 +38,20 @@ constexpr int CHILD_BEGIN = DATA_BEGIN + MAX_NUM_DATAS * DATA_SIZE;
 */
 
 
-inline uint32 GetNodeOffset(uint32 Node)
+inline uint64 GetNodeOffset(uint32 Node)
 {
-	return Node * FILE_PAGE_SIZE;
+	return (uint64)Node * FILE_PAGE_SIZE;
 }
 
-#define CHECK_NODE_END_READ(Node) check(File->TellRead() <= Node * FILE_PAGE_SIZE + MAX_NUM_SPACE_USAGE);
-#define CHECK_NODE_END_WRITE(Node) check(File->TellWrite() <= Node * FILE_PAGE_SIZE + MAX_NUM_SPACE_USAGE);
+// header and key count are adjacent, so they can be fetched with a single read
+struct FNodePrefix
+{
+	FNodeHeader Header;
+	int Num;
+};
+static_assert(sizeof(FNodePrefix) == KEY_BEGIN, "node prefix must match the node layout");
+
+#define CHECK_NODE_END(Node, End) check((End) <= GetNodeOffset(Node) + MAX_NUM_SPACE_USAGE);
 
 FBTree::FBTree(FFile::Ptr InFile):File(InFile)
 {
@@ -74,35 +78,45 @@ static int LowerBound(int64 Key, const TArray<int64>& Array)
 	return Begin ;
 }
 
-bool FBTree::Find(int64 Key, uint32& Node, int& Index)
+static int UpperBound(int64 Key, const TArray<int64>& Array)
 {
-	static TArray<int64> Keys;
-	Keys = RootKeys;
-	Node = Header.RootNode;
-	while (true)
+	int Begin = 0;
+	int End = Array.Num();
+	while (End != Begin)
 	{
-		auto Num = Keys.Num();
-		Index = LowerBound(Key, Keys);
-		if (Num == 0)
-			return {};
-		else if (Index < Num && Keys[Index] == Key)
+		auto Mid = (Begin + End) / 2;
+		if (Array[Mid] <= Key)
 		{
-			return true;
+			Begin = Mid + 1;
 		}
 		else
 		{
-			Node = GetNextNode(Node, Index);
-			if (Node == INVALID)
-				return false;
-
-			GetKeys(Node,Keys);
+			End = Mid;
 		}
 	}
+	return Begin;
+}
+
+bool FBTree::Find(int64 Key, FNodeRef& Node, int& Index)
+{
+	Node = GetNode(Header.RootNode);
+	while (true)
+	{
+		auto Num = Node->Keys.Num();
+		Index = LowerBound(Key, Node->Keys);
+		if (Index < Num && Node->Keys[Index] == Key)
+			return true;
+
+		if (Node->bLeaf || Num == 0)
+			return false;
+
+		Node = GetNode(Node->Children[Index]);
+	}
 }
 
 TArray<uint32> FBTree::Find(int64 Key)
 {
-	uint32 Node;
+	FNodeRef Node;
 	int Index;
 	if (Find(Key, Node, Index))
 	{
@@ -122,7 +136,7 @@ TArray<uint32> FBTree::Find(int64 Key)
 
 bool FBTree::FindOne(int64 Key, const TFunction<bool(uint32)>& Callback)
 {
-	uint32 Node;
+	FNodeRef Node;
 	int Index;
 	if (Find(Key, Node, Index))
 	{
@@ -134,34 +148,160 @@ bool FBTree::FindOne(int64 Key, const TFunction<bool(uint32)>& Callback)
 	}
 }
 
+bool FBTree::FindMany(TArrayView<const int64> Keys, const TFunction<bool(int32, uint32)>& Callback)
+{
+	if (Keys.Num() == 0)
+		return false;
+	return FindMany(GetNode(Header.RootNode), Keys, 0, Callback);
+}
+
+bool FBTree::FindMany(const FNodeRef& Node, TArrayView<const int64> Keys, int32 FirstKey, const TFunction<bool(int32, uint32)>& Callback)
+{
+	auto Num = Node->Keys.Num();
+	int32 Begin = 0;
+	while (Begin < Keys.Num())
+	{
+		auto Index = LowerBound(Keys[Begin], Node->Keys);
+		if (Index < Num && Node->Keys[Index] == Keys[Begin])
+		{
+			auto KeyIndex = FirstKey + Begin;
+			if (GetData(Node, Index, [&](uint32 Data) { return Callback(KeyIndex, Data); }))
+				return true;
+			++Begin;
+			continue;
+		}
+
+		// the keys below the next key of the node are all in the same child
+		auto End = Begin + 1;
+		while (End < Keys.Num() && (Index == Num || Keys[End] < Node->Keys[Index]))
+			++End;
+
+		if (!Node->bLeaf && Num > 0)
+		{
+			if (FindMany(GetNode(Node->Children[Index]), Keys.Slice(Begin, End - Begin), FirstKey + Begin, Callback))
+				return true;
+		}
+		Begin = End;
+	}
+	return false;
+}
+
+FBTreeCursor FBTree::FindRange(int64 Lo, int64 Hi, bool bAscending)
+{
+	FBTreeCursor Cursor;
+	Cursor.Tree = this;
+	Cursor.Lo = Lo;
+	Cursor.Hi = Hi;
+	Cursor.bAscending = bAscending;
+	auto Node = GetNode(Header.RootNode);
+	if (Lo > Hi || Node->Keys.Num() == 0)
+		return Cursor;
+
+	// descend to the first key in range, every level remembers where to go on
+	while (true)
+	{
+		auto Bound = bAscending ? LowerBound(Lo, Node->Keys) : UpperBound(Hi, Node->Keys);
+		Cursor.Stack.Add({Node, bAscending ? Bound : Bound - 1});
+		if (Node->bLeaf || Node->Keys.Num() == 0)
+			break;
+		Node = GetNode(Node->Children[Bound]);
+	}
+
+	Cursor.Settle();
+	return Cursor;
+}
+
+int64 FBTreeCursor::GetKey() const
+{
+	auto& Top = Stack.Last();
+	return Top.Node->Keys[Top.Pos];
+}
+
+uint32 FBTreeCursor::GetData() const
+{
+	return Current.Data;
+}
+
+void FBTreeCursor::Next()
+{
+	check(IsValid());
+	if (Current.Next != INVALID_DATA_POS)
+	{
+		Current = Tree->ReadData(Current.Next);
+		return;
+	}
+
+	auto Node = Stack.Last().Node;
+	auto Pos = Stack.Last().Pos;
+	Stack.Last().Pos = bAscending ? Pos + 1 : Pos - 1;
+
+	// the keys between this one and the next of the node are in the child in between
+	if (!Node->bLeaf)
+	{
+		auto Child = Tree->GetNode(Node->Children[bAscending ? Pos + 1 : Pos]);
+		while (true)
+		{
+			auto Num = Child->Keys.Num();
+			Stack.Add({Child, bAscending ? 0 : Num - 1});
+			if (Child->bLeaf || Num == 0)
+				break;
+			Child = Tree->GetNode(Child->Children[bAscending ? 0 : Num]);
+		}
+	}
+
+	Settle();
+}
+
+void FBTreeCursor::Settle()
+{
+	while (Stack.Num() > 0)
+	{
+		auto& Top = Stack.Last();
+		if (Top.Pos >= 0 && Top.Pos < Top.Node->Keys.Num())
+			break;
+		Stack.Pop(false);
+	}
+
+	if (Stack.Num() == 0)
+		return;
+
+	auto Key = GetKey();
+	if (bAscending ? Key > Hi : Key < Lo)
+	{
+		Stack.Reset();
+		return;
+	}
+
+	auto& Top = Stack.Last();
+	Current = Top.Node->Datas[Top.Pos];
+}
+
 
 void FBTree::Insert(int64 Key, uint32 Data)
 {
-	auto Keys = RootKeys;
-	uint32 Node = Header.RootNode;
+	auto Node = GetNode(Header.RootNode);
 	while (true)
 	{
-		auto Num = Keys.Num();
-		auto Bound = LowerBound(Key, Keys);
-		if (Bound < Num && Keys[Bound] == Key)
+		auto Num = Node->Keys.Num();
+		auto Bound = LowerBound(Key, Node->Keys);
+		if (Bound < Num && Node->Keys[Bound] == Key)
 		{
-			InsertData(Node, Bound, Data);
+			InsertData(Node->Id, Bound, Data);
 			return;
 		}
 		else
 		{
 			auto Index = Bound;
 
-			auto NextNode = GetNextNode(Node, Index);
-			if (NextNode == INVALID)
+			if (Node->bLeaf || Num == 0)
 			{
 				// leaf
 				if (Num + 1 >= M)
 				{
 					auto Mid = Num / 2;
-					auto bLess = Key < Keys[Mid];
+					auto bLess = Key < Node->Keys[Mid];
 					uint32 Left, Right;
-					Split(Node, Left, Right);
+					Split(Node->Id, Left, Right);
 
 					if (bLess)
 						InsertToNode(Left, Index, Key, Data);
@@ -170,35 +310,333 @@ void FBTree::Insert(int64 Key, uint32 Data)
 				}
 				else
 				{
-					InsertToNode(Node, Index, Key, Data);
+					InsertToNode(Node->Id, Index, Key, Data);
 				}
 				return;
 			}
 			else
 			{
-				Node = NextNode;
-				GetKeys(Node,Keys);
+				Node = GetNode(Node->Children[Index]);
 			}
 		}
 	}
 }
 
+bool FBTree::Remove(int64 Key, uint32 Data)
+{
+	FNodeRef Found;
+	int Pos;
+	if (!Find(Key, Found, Pos))
+		return false;
+
+	// the data is unlinked from the list of the key, its slot is given back
+	auto Head = Found->Datas[Pos];
+	if (Head.Data != Data)
+	{
+		auto Prev = GetNodeOffset(Found->Id) + DATA_BEGIN + Pos * DATA_SIZE;
+		auto PrevData = Head;
+		while (PrevData.Next != INVALID_DATA_POS)
+		{
+			auto Cur = PrevData.Next;
+			auto CurData = ReadData(Cur);
+			if (CurData.Data == Data)
+			{
+				InvalidateNode(Found->Id);
+				PrevData.Next = CurData.Next;
+				File->WriteAt(Prev, PrevData);
+				ReleaseData(Cur);
+				FlushHeader();
+				return true;
+			}
+			Prev = Cur;
+			PrevData = CurData;
+		}
+		return false;
+	}
+
+	if (Head.Next != INVALID_DATA_POS)
+	{
+		WriteHead(Found->Id, Pos, ReadData(Head.Next));
+		ReleaseData(Head.Next);
+		FlushHeader();
+		return true;
+	}
+
+	// it was the last data, the key goes as well
+	RemoveKey(MakeShared<FBTreeNode>(*Found), Pos);
+	FlushHeader();
+	return true;
+}
+
+void FBTree::RemoveKey(const TSharedRef<FBTreeNode>& Node, int Pos)
+{
+	if (Node->bLeaf)
+	{
+		Node->Keys.RemoveAt(Pos);
+		Node->Datas.RemoveAt(Pos);
+		Rebalance(Node);
+		return;
+	}
+
+	// a key of an inner node is replaced by the greatest key below it, which is the last of a leaf
+	auto Child = GetNode(Node->Children[Pos]);
+	while (!Child->bLeaf)
+		Child = GetNode(Child->Children.Last());
+
+	auto Leaf = MakeShared<FBTreeNode>(*Child);
+	Node->Keys[Pos] = Leaf->Keys.Pop(false);
+	Node->Datas[Pos] = Leaf->Datas.Pop(false);
+	WriteNode(*Node);
+	Rebalance(Leaf);
+}
+
+void FBTree::Rebalance(const TSharedRef<FBTreeNode>& Node)
+{
+	if (Node->Parent == INVALID)
+	{
+		check(Node->Id == Header.RootNode);
+		if (Node->Keys.Num() > 0 || Node->bLeaf)
+		{
+			WriteNode(*Node);
+			return;
+		}
+
+		// an empty root hands over to its only child, the tree gets one level shallower
+		auto Child = Node->Children[0];
+		FNodeHeader ChildHeader;
+		CHECK_RESULT(File->ReadAt(GetNodeOffset(Child), ChildHeader));
+		ChildHeader.Node = INVALID;
+		ChildHeader.Index = 0;
+		File->WriteAt(GetNodeOffset(Child), ChildHeader);
+		InvalidateNode(Child);
+
+		Header.RootNode = Child;
+		ReleasePage(Node->Id);
+		return;
+	}
+
+	if (Node->Keys.Num() >= MIN_NUM_KEYS)
+	{
+		WriteNode(*Node);
+		return;
+	}
+
+	auto Parent = MakeShared<FBTreeNode>(*GetNode(Node->Parent));
+	check(Parent->Children[Node->Index] == Node->Id);
+
+	// the left sibling is taken if there is one, Sep is the key of the parent between the two
+	const bool bHasLeft = Node->Index > 0;
+	const int Sep = bHasLeft ? Node->Index - 1 : 0;
+	auto Sibling = MakeShared<FBTreeNode>(*GetNode(Parent->Children[bHasLeft ? Sep : 1]));
+	auto& Left = bHasLeft ? *Sibling : *Node;
+	auto& Right = bHasLeft ? *Node : *Sibling;
+
+	if (Sibling->Keys.Num() > MIN_NUM_KEYS)
+	{
+		// borrow one key through the parent
+		if (bHasLeft)
+		{
+			Right.Keys.Insert(Parent->Keys[Sep], 0);
+			Right.Datas.Insert(Parent->Datas[Sep], 0);
+			Parent->Keys[Sep] = Left.Keys.Pop(false);
+			Parent->Datas[Sep] = Left.Datas.Pop(false);
+			if (!Right.bLeaf)
+				Right.Children.Insert(Left.Children.Pop(false), 0);
+		}
+		else
+		{
+			Left.Keys.Add(Parent->Keys[Sep]);
+			Left.Datas.Add(Parent->Datas[Sep]);
+			Parent->Keys[Sep] = Right.Keys[0];
+			Parent->Datas[Sep] = Right.Datas[0];
+			Right.Keys.RemoveAt(0);
+			Right.Datas.RemoveAt(0);
+			if (!Left.bLeaf)
+			{
+				Left.Children.Add(Right.Children[0]);
+				Right.Children.RemoveAt(0);
+			}
+		}
+
+		WriteNode(Left);
+		WriteNode(Right);
+		WriteNode(*Parent);
+		if (!Left.bLeaf)
+		{
+			// the child that moved and every child of the right node changed their position
+			AdoptChildren(Left, Left.Children.Num() - 1);
+			AdoptChildren(Right, 0);
+		}
+		return;
+	}
+
+	// the sibling is at the minimum, both fit into the left node together with the key between them
+	check(Left.Keys.Num() + 1 + Right.Keys.Num() <= MAX_NUM_KEYS);
+	auto FirstMoved = Left.Children.Num();
+	Left.Keys.Add(Parent->Keys[Sep]);
+	Left.Datas.Add(Parent->Datas[Sep]);
+	Left.Keys.Append(Right.Keys);
+	Left.Datas.Append(Right.Datas);
+	Left.Children.Append(Right.Children);
+	WriteNode(Left);
+	if (!Left.bLeaf)
+		AdoptChildren(Left, FirstMoved);
+	ReleasePage(Right.Id);
+
+	Parent->Keys.RemoveAt(Sep);
+	Parent->Datas.RemoveAt(Sep);
+	Parent->Children.RemoveAt(Sep + 1);
+	AdoptChildren(*Parent, Sep + 1);
+	Rebalance(Parent);
+}
+
+void FBTree::BulkLoad(const TArray<TPair<int64, uint32>>& Entries, float FillFactor)
+{
+	check(GetNode(Header.RootNode)->Keys.Num() == 0);
+	if (Entries.Num() == 0)
+		return;
+
+	struct FBulkNode
+	{
+		int KeyBegin;
+		int Num;
+		int ChildBegin;
+		int Parent;
+		int Index;
+		uint32 Id;
+	};
+
+	struct FBulkLevel
+	{
+		TArray<int64> Keys;
+		TArray<FData> Datas;
+		TArray<FBulkNode> Nodes;
+	};
+
+	TArray<FBulkLevel> Levels;
+	auto& Leaves = Levels.AddDefaulted_GetRef();
+	Leaves.Keys.Reserve(Entries.Num());
+	Leaves.Datas.Reserve(Entries.Num());
+
+	// equal keys share one slot, the remaining datas are chained like Insert does
+	for (int Begin = 0; Begin < Entries.Num();)
+	{
+		auto End = Begin + 1;
+		while (End < Entries.Num() && Entries[End].Key == Entries[Begin].Key)
+			++End;
+		check(End == Entries.Num() || Entries[Begin].Key < Entries[End].Key);
+
+		FDataPos Next = INVALID_DATA_POS;
+		for (auto Index = End - 1; Index > Begin; --Index)
+			Next = AppendData(Entries[Index].Value, Next);
+
+		Leaves.Keys.Add(Entries[Begin].Key);
+		Leaves.Datas.Add({Entries[Begin].Value, Next});
+		Begin = End;
+	}
+
+	// every node of a level gets the same number of keys, the key between two nodes moves up
+	const int Capacity = FMath::Clamp((int)(MAX_NUM_KEYS * FillFactor), 2, MAX_NUM_KEYS);
+	while (true)
+	{
+		auto& Level = Levels.Last();
+		auto Num = Level.Keys.Num();
+		auto NodeCount = Num <= Capacity ? 1 : (Num + 1 + Capacity) / (Capacity + 1);
+		auto NodeKeys = Num - (NodeCount - 1);
+
+		FBulkLevel Upper;
+		int KeyBegin = 0;
+		int ChildBegin = 0;
+		for (auto NodeIndex : XRange(NodeCount))
+		{
+			auto NodeNum = NodeKeys / NodeCount + (NodeIndex < NodeKeys % NodeCount ? 1 : 0);
+			check(NodeNum > 0 && NodeNum <= MAX_NUM_KEYS);
+			Level.Nodes.Add({KeyBegin, NodeNum, ChildBegin, INDEX_NONE, 0, INVALID});
+			KeyBegin += NodeNum;
+			ChildBegin += NodeNum + 1;
+
+			if (NodeIndex + 1 < NodeCount)
+			{
+				Upper.Keys.Add(Level.Keys[KeyBegin]);
+				Upper.Datas.Add(Level.Datas[KeyBegin]);
+				++KeyBegin;
+			}
+		}
+
+		if (NodeCount == 1)
+			break;
+		Levels.Add(MoveTemp(Upper));
+	}
+
+	for (auto LevelIndex : XRange(1, Levels.Num()))
+	{
+		auto& Children = Levels[LevelIndex - 1].Nodes;
+		for (auto NodeIndex : XRange(Levels[LevelIndex].Nodes.Num()))
+		{
+			auto& Node = Levels[LevelIndex].Nodes[NodeIndex];
+			for (auto Child : XRange(Node.Num + 1))
+			{
+				Children[Node.ChildBegin + Child].Parent = NodeIndex;
+				Children[Node.ChildBegin + Child].Index = Child;
+			}
+		}
+	}
+
+	// the root keeps its page, the other nodes are laid out level by level
+	Levels.Last().Nodes[0].Id = Header.RootNode;
+	for (auto LevelIndex : XRange(Levels.Num() - 1))
+	{
+		for (auto& Node : Levels[LevelIndex].Nodes)
+			Node.Id = CreatePage();
+	}
+
+	TArray<uint8> Page;
+	Page.SetNumZeroed(MAX_NUM_SPACE_USAGE);
+	for (auto LevelIndex : XRange(Levels.Num()))
+	{
+		auto& Level = Levels[LevelIndex];
+		const bool bLeaf = LevelIndex == 0;
+		const bool bRoot = LevelIndex == Levels.Num() - 1;
+		for (auto& Node : Level.Nodes)
+		{
+			auto Parent = bRoot ? INVALID : Levels[LevelIndex + 1].Nodes[Node.Parent].Id;
+			FNodePrefix Prefix = {{Parent, Node.Index, bLeaf}, Node.Num};
+			FMemory::Memcpy(Page.GetData(), &Prefix, sizeof(Prefix));
+			FMemory::Memcpy(Page.GetData() + KEY_BEGIN, Level.Keys.GetData() + Node.KeyBegin, Node.Num * KEY_SIZE);
+			FMemory::Memcpy(Page.GetData() + DATA_BEGIN, Level.Datas.GetData() + Node.KeyBegin, Node.Num * DATA_SIZE);
+			if (!bLeaf)
+			{
+				auto Children = (uint32*)(Page.GetData() + CHILD_BEGIN);
+				for (auto Child : XRange(Node.Num + 1))
+					Children[Child] = Levels[LevelIndex - 1].Nodes[Node.ChildBegin + Child].Id;
+			}
+			File->WriteAt(GetNodeOffset(Node.Id), Page.GetData(), Page.Num());
+		}
+	}
+
+	FlushHeader();
+	InvalidateNode(Header.RootNode);
+}
+
 FString FBTree::GetTypeName()const
 {
 	return TEXT("BTreeSeacher");
 }
 
 
-constexpr int32 BTREE_MAGIC_NUM = 0xFB7cee;
+constexpr int32 BTREE_MAGIC_NUM = 0xFB7cf0;
 void FBTree::Init()
 {
 	Header.MagicNum = BTREE_MAGIC_NUM;
 	Header.RootDataPage = 0;
 	Header.RootNode = 0;
 	Header.PageCount = 0;
+	Header.FreePage = INVALID;
+	Header.FreeData = INVALID_DATA_POS;
 
 	Header.RootDataPage = CreatePage();
 	Header.DataEnd = GetNodeOffset(Header.RootDataPage);
+	NodeCache.Reset();
 	Header.RootNode = CreateNode(INVALID, 0,true);
 
 	FlushHeader();
@@ -207,94 +645,98 @@ void FBTree::Init()
 
 void FBTree::Open()
 {
-	File->Read(Header);
+	File->ReadAt(0, Header);
 	check(Header.MagicNum == BTREE_MAGIC_NUM);
-
-	
-	GetKeys(Header.RootNode, RootKeys);
+	NodeCache.Reset();
 }
 
 
-bool FBTree::GetData(uint32 Node, int Index, const TFunction<bool(uint32)>& Callback)
+bool FBTree::GetData(const FNodeRef& Node, int Index, const TFunction<bool(uint32)>& Callback)
 {
-	File->SeekRead(GetNodeOffset(Node) + sizeof(FNodeHeader));
-	int Num;
-	CHECK_RESULT(File->Read(Num));
-	if (Index >= Num)
+	if (Index >= Node->Datas.Num())
 		return false;
 
-	auto DataBegin = GetNodeOffset(Node) + sizeof(FNodeHeader) + sizeof(int) + MAX_NUM_KEYS * KEY_SIZE + Index * DATA_SIZE;
-	File->SeekRead(DataBegin);
-	CHECK_NODE_END_READ(Node);
-
+	// the head of the list lives in the node, the rest in the data pages
+	auto Data = Node->Datas[Index];
 	while(true)
 	{
-		FData Data;
-		File->Read(Data);
 		if (Callback(Data.Data))
 			return true;
 
-		if (Data.Next == INVALID)
+		if (Data.Next == INVALID_DATA_POS)
 			break;
 
-		File->SeekRead(Data.Next);
+		Data = ReadData(Data.Next);
 	}
 	return false;
 }
 
 
-void FBTree::GetKeys(uint32 Node, TArray<int64>& Keys)
+
+FBTree::FNodeRef FBTree::GetNode(uint32 Node)
 {
-	auto KeyBegin = GetNodeOffset(Node) + sizeof(FNodeHeader);
-	File->SeekRead(KeyBegin);
-	int Num;
-	CHECK_RESULT(File->Read(Num));
-	Keys.SetNumUninitialized(Num, false);
-	File->Read(Keys.GetData(), Num * KEY_SIZE);
-	CHECK_NODE_END_READ(Node);
+	if (auto Cached = NodeCache.GetAndRefer(Node))
+		return *Cached;
+
+	auto Result = ReadNode(Node);
+	NodeCache.Push(Node, Result);
+	return Result;
 }
 
-uint32 FBTree::GetNextNode(uint32 Node, int Index)
+void FBTree::InvalidateNode(uint32 Node)
 {
+	NodeCache.Remove(Node);
+}
 
-	File->SeekRead(GetNodeOffset(Node));
-	FNodeHeader NodeHeader;
-	int KeyNum;
-	CHECK_RESULT(File->Read(NodeHeader));
-	CHECK_RESULT(File->Read(KeyNum));
-	if (NodeHeader.IsLeaf || KeyNum == 0 ||  (KeyNum + 1) < Index)
-		return INVALID;
+FBTree::FNodeRef FBTree::ReadNode(uint32 Node)
+{
+	TArray<uint8> Page;
+	Page.SetNumUninitialized(MAX_NUM_SPACE_USAGE);
+	CHECK_RESULT(File->ReadAt(GetNodeOffset(Node), Page.GetData(), Page.Num()));
+
+	FNodePrefix Prefix;
+	FMemory::Memcpy(&Prefix, Page.GetData(), sizeof(Prefix));
+	check(Prefix.Num >= 0 && Prefix.Num <= MAX_NUM_KEYS);
+
+	auto Result = MakeShared<FBTreeNode>();
+	Result->Id = Node;
+	Result->Parent = Prefix.Header.Node;
+	Result->Index = Prefix.Header.Index;
+	Result->bLeaf = Prefix.Header.IsLeaf;
+	Result->Keys.Append((const int64*)(Page.GetData() + KEY_BEGIN), Prefix.Num);
+	Result->Datas.Append((const FData*)(Page.GetData() + DATA_BEGIN), Prefix.Num);
+	if (!Result->bLeaf && Prefix.Num > 0)
+		Result->Children.Append((const uint32*)(Page.GetData() + CHILD_BEGIN), Prefix.Num + 1);
+	return Result;
+}
 
-	auto Skip = Index * CHILD_SIZE;
-	auto ChildBegin = GetNodeOffset(Node) + CHILD_BEGIN;
-	File->SeekRead(ChildBegin + Skip);
-	uint32 Child;
-	CHECK_RESULT(File->Read(Child));
-	return Child;
+FData FBTree::ReadData(FDataPos DataPos)
+{
+	FData Data;
+	CHECK_RESULT(File->ReadAt(DataPos, Data));
+	return Data;
 }
 
 template<class T>
-static void InsertElement(const T& Value, int Count, uint32 Begin, FFile::Ptr File)
+static void InsertElement(const T& Value, int Count, uint64 Begin, FFile::Ptr File)
 {
 	TArray<T> Elements;
-	Elements.SetNumUninitialized(Count);
-	File->SeekRead(Begin);
-	CHECK_RESULT(File->Read(Elements.GetData(), Count * sizeof(T)));
-	File->SeekWrite(Begin);
-	File->Write(Value);
-	File->Write(Elements.GetData(), Count * sizeof(T));
+	Elements.SetNumUninitialized(Count + 1);
+	Elements[0] = Value;
+	CHECK_RESULT(File->ReadAt(Begin, Elements.GetData() + 1, Count * sizeof(T)));
+	File->WriteAt(Begin, Elements.GetData(), Elements.Num() * sizeof(T));
 }
 
 
-void FBTree::InsertToNode(uint32 Node, int Pos, int64 Key, uint32 Data, uint32 Next, uint32 RightNode)
+void FBTree::InsertToNode(uint32 Node, int Pos, int64 Key, uint32 Data, FDataPos Next, uint32 RightNode)
 {
+	InvalidateNode(Node);
+
 	int Num;
-	int NodeOffset = GetNodeOffset(Node);
+	auto NodeOffset = GetNodeOffset(Node);
 	auto NumBegin = NodeOffset + sizeof(FNodeHeader);
-	File->SeekRead(NumBegin);
-	CHECK_RESULT(File->Read(Num));
-	File->SeekWrite(NumBegin);
-	File->Write(Num + 1);
+	CHECK_RESULT(File->ReadAt(NumBegin, Num));
+	File->WriteAt(NumBegin, Num + 1);
 
 	int KeyCount = Num - Pos;
 	auto KeyBegin = NodeOffset + KEY_BEGIN + Pos * KEY_SIZE;
@@ -304,12 +746,7 @@ void FBTree::InsertToNode(uint32 Node, int Pos, int64 Key, uint32 Data, uint32 N
 	auto DataBegin = NodeOffset + DATA_BEGIN + Pos * DATA_SIZE;
 	FData DataList = { Data ,Next };
 	InsertElement(DataList, KeyCount, DataBegin, File);
-	CHECK_NODE_END_WRITE(Node);
-
-	if (Node == Header.RootNode)
-	{
-		GetKeys(Node, RootKeys);
-	}
+	CHECK_NODE_END(Node, DataBegin + (DataCount + 1) * DATA_SIZE);
 
 	if (RightNode == INVALID) 
 		return;// insert into leaf
@@ -319,28 +756,24 @@ void FBTree::InsertToNode(uint32 Node, int Pos, int64 Key, uint32 Data, uint32 N
 	int ChildrenCount = Num - Pos;
 	auto ChildBegin = NodeOffset + CHILD_BEGIN + (Pos + 1) * CHILD_SIZE;
 	TArray<uint32> Children;
-	Children.SetNumUninitialized(ChildrenCount);
-	File->SeekRead(ChildBegin);
-	CHECK_RESULT(File->Read(Children.GetData(), ChildrenCount * sizeof(uint32)));
-	CHECK_NODE_END_READ(Node);
+	Children.SetNumUninitialized(ChildrenCount + 1);
+	Children[0] = RightNode;
+	CHECK_RESULT(File->ReadAt(ChildBegin, Children.GetData() + 1, ChildrenCount * sizeof(uint32)));
+	CHECK_NODE_END(Node, ChildBegin + Children.Num() * CHILD_SIZE);
 
-	if (Children.Num() != 0)
+	if (ChildrenCount != 0)
 	{
 		FNodeHeader NodeHeader;
-		File->SeekRead(GetNodeOffset(Children[0]));
-		File->Read(NodeHeader);
-		for (auto Child : Children)
+		File->ReadAt(GetNodeOffset(Children[1]), NodeHeader);
+		for (auto Child : XRange(1, Children.Num()))
 		{
-			auto Offset = GetNodeOffset(Child);
-			File->SeekWrite(Offset);
 			NodeHeader.Index += 1;
-			File->Write(NodeHeader);
+			File->WriteAt(GetNodeOffset(Children[Child]), NodeHeader);
+			InvalidateNode(Children[Child]);
 		}
 	}
 
-	File->SeekWrite(ChildBegin);
-	File->Write(RightNode);
-	File->Write(Children.GetData(), ChildrenCount * sizeof(uint32));
+	File->WriteAt(ChildBegin, Children.GetData(), Children.Num() * sizeof(uint32));
 
 
 	//InsertElement(RightNode, ChildrenCount, ChildBegin, File);
@@ -348,23 +781,21 @@ void FBTree::InsertToNode(uint32 Node, int Pos, int64 Key, uint32 Data, uint32 N
 
 void FBTree::InsertData(uint32 Node, int Pos, uint32 Data)
 {
-	auto DataBegin = GetNodeOffset(Node) + DATA_BEGIN;
-	auto Skip = Pos * DATA_SIZE;
-	File->SeekRead(DataBegin + Skip);
+	// the head of the list is part of the cached node
+	InvalidateNode(Node);
+	auto Cur = GetNodeOffset(Node) + DATA_BEGIN + Pos * DATA_SIZE;
 	while(true)
 	{
-		auto Cur = File->TellRead();
 		FData DataList;
-		File->Read(DataList);
-		if (DataList.Next != INVALID)
+		CHECK_RESULT(File->ReadAt(Cur, DataList));
+		if (DataList.Next != INVALID_DATA_POS)
 		{
-			File->SeekRead(DataList.Next);
+			Cur = DataList.Next;
 		}
 		else
 		{
 			DataList.Next = AddData(Data);
-			File->SeekWrite(Cur);
-			File->Write(DataList);
+			File->WriteAt(Cur, DataList);
 			break;
 		}
 	}
@@ -372,46 +803,41 @@ void FBTree::InsertData(uint32 Node, int Pos, uint32 Data)
 }
 
 template<class T>
-static TArray<T> GetRight(int Count, uint32 Begin, FFile::Ptr File)
+static TArray<T> GetRight(int Count, uint64 Begin, FFile::Ptr File)
 {
 	TArray<T> Right;
 	Right.SetNumUninitialized(Count);
-	File->SeekRead(Begin);
-	CHECK_RESULT(File->Read(Right.GetData(), Count * sizeof(T)));
+	CHECK_RESULT(File->ReadAt(Begin, Right.GetData(), Count * sizeof(T)));
 	return Right;
 }
 
 template<class T>
-static void FillElements(const TArray<T>& Elements, uint32 Begin, FFile::Ptr File)
+static void FillElements(const TArray<T>& Elements, uint64 Begin, FFile::Ptr File)
 {
-	File->SeekWrite(Begin);
-	File->Write(Elements.GetData(), sizeof(T) * Elements.Num());
+	File->WriteAt(Begin, Elements.GetData(), sizeof(T) * Elements.Num());
 }
 
 void FBTree::Split(uint32 Node, uint32& Left, uint32& Right)
 {
 	auto ParentBegin = GetNodeOffset(Node);
-	File->SeekRead(ParentBegin);
-	FNodeHeader NodeHeader;
-	CHECK_RESULT(File->Read(NodeHeader));
-	auto NumBegin = File->TellRead();
-	int Num;
-	CHECK_RESULT(File->Read(Num));
+	FNodePrefix Prefix;
+	CHECK_RESULT(File->ReadAt(ParentBegin, Prefix));
+	FNodeHeader NodeHeader = Prefix.Header;
+	auto NumBegin = ParentBegin + sizeof(FNodeHeader);
+	int Num = Prefix.Num;
 	check(Num == MAX_NUM_KEYS);
+	InvalidateNode(Node);
 	auto Mid = MAX_NUM_KEYS / 2;
-	auto Cur = File->TellRead();
+	auto Cur = ParentBegin + KEY_BEGIN;
 	
 	// Read Mid
 	int64 MidKey;
 	FData MidDataList;
-	File->SeekRead(Cur + Mid * KEY_SIZE);
-	CHECK_RESULT(File->Read(MidKey));
-	File->SeekRead(Cur + MAX_NUM_KEYS * KEY_SIZE + Mid * DATA_SIZE);
-	CHECK_RESULT(File->Read(MidDataList));
+	CHECK_RESULT(File->ReadAt(Cur + Mid * KEY_SIZE, MidKey));
+	CHECK_RESULT(File->ReadAt(Cur + MAX_NUM_KEYS * KEY_SIZE + Mid * DATA_SIZE, MidDataList));
 
 	// Modify Count
-	File->SeekWrite(NumBegin);
-	File->Write(Mid);
+	File->WriteAt(NumBegin, Mid);
 	Left = Node;
 
 	// Read Right Node
@@ -434,28 +860,26 @@ void FBTree::Split(uint32 Node, uint32& Left, uint32& Right)
 		auto NewDataBegin = NewKeyBegin + MAX_NUM_KEYS * KEY_SIZE;
 		auto NewChildBegin = NewDataBegin + MAX_NUM_DATAS * DATA_SIZE;
 
-		File->SeekWrite(NewNumBegin);
-		File->Write(int(RightKeys.Num()));
+		File->WriteAt(NewNumBegin, int(RightKeys.Num()));
 
 		FillElements(RightKeys, NewKeyBegin, File);
 		FillElements(RightDatas, NewDataBegin, File);
 		if (bLeaf)
 			return Right;
 		FillElements(RightChildren, NewChildBegin, File);
-		CHECK_NODE_END_WRITE(Right);
+		CHECK_NODE_END(Right, NewChildBegin + RightChildren.Num() * CHILD_SIZE);
 
 		if (RightChildren.Num() == 0)
 			return Right;
 
 		FNodeHeader NodeHeader;
-		File->SeekRead(GetNodeOffset(RightChildren[0]));
-		File->Read(NodeHeader);
+		File->ReadAt(GetNodeOffset(RightChildren[0]), NodeHeader);
+		NodeHeader.Node = Right;
 		NodeHeader.Index = 0;
 		for (auto Child : RightChildren)
 		{
-			auto Offset = GetNodeOffset(Child);
-			File->SeekWrite(Offset);
-			File->Write(NodeHeader);
+			File->WriteAt(GetNodeOffset(Child), NodeHeader);
+			InvalidateNode(Child);
 			NodeHeader.Index += 1;
 		}
 
@@ -474,32 +898,28 @@ void FBTree::Split(uint32 Node, uint32& Left, uint32& Right)
 		auto NewDataBegin = NewKeyBegin + MAX_NUM_KEYS * KEY_SIZE;
 		auto NewChildBegin = NewDataBegin + MAX_NUM_DATAS * DATA_SIZE;
 
-		File->SeekWrite(NewNumBegin);
-		File->Write(int(1));
+		File->WriteAt(NewNumBegin, int(1));
 
 		FillElements(TArray<int64>{MidKey}, NewKeyBegin, File);
 		FillElements(TArray<FData>{MidDataList}, NewDataBegin, File);
 		FillElements(TArray<uint32>{Node, CreateRight(RootNode, 1, NodeHeader.IsLeaf)}, NewChildBegin, File);
-		CHECK_NODE_END_WRITE(RootNode);
+		CHECK_NODE_END(RootNode, NewChildBegin + 2 * CHILD_SIZE);
 
 
 		Header.RootNode = RootNode;
 		FlushHeader();
-		GetKeys(RootNode, RootKeys);
 
-		File->SeekWrite(GetNodeOffset(Node));
-		File->Write(FNodeHeader{RootNode, 0, NodeHeader.IsLeaf});
+		File->WriteAt(GetNodeOffset(Node), FNodeHeader{RootNode, 0, NodeHeader.IsLeaf});
 	}
 	else
 	{
 		// insert into parent
-		TArray<int64> ParentKeys;
-		GetKeys(NodeHeader.Node, ParentKeys);
-		if (ParentKeys.Num() == MAX_NUM_KEYS)
+		auto Parent = GetNode(NodeHeader.Node);
+		if (Parent->Keys.Num() == MAX_NUM_KEYS)
 		{
 			// split parent
 			auto ParentMid = MAX_NUM_KEYS / 2;
-			bool bLess = MidKey < ParentKeys[ParentMid];
+			bool bLess = MidKey < Parent->Keys[ParentMid];
 
 			uint32 ParentLeft, ParentRight;
 			Split(NodeHeader.Node, ParentLeft, ParentRight);
@@ -522,6 +942,14 @@ void FBTree::Split(uint32 Node, uint32& Left, uint32& Right)
 
 uint32 FBTree::CreatePage()
 {
+	if (Header.FreePage != INVALID)
+	{
+		auto Page = Header.FreePage;
+		CHECK_RESULT(File->ReadAt(GetNodeOffset(Page), Header.FreePage));
+		FlushHeader();
+		return Page;
+	}
+
 	File->AppendPage();
 	auto NewPage = ++Header.PageCount;
 	FlushHeader();
@@ -533,34 +961,97 @@ uint32 FBTree::CreateNode(uint32 Parent, int Index, bool bLeaf)
 {
 	auto NewNode = CreatePage();
 
-	FNodeHeader ParentNode = {Parent, Index,bLeaf};
-	File->SeekWrite(GetNodeOffset(NewNode));
-	File->Write(ParentNode);
-	const int Num = 0;
-	File->Write(Num);
+	FNodePrefix Prefix = {{Parent, Index, bLeaf}, 0};
+	File->WriteAt(GetNodeOffset(NewNode), Prefix);
+	InvalidateNode(NewNode);
 
 	return NewNode;
 }
 
-uint32 FBTree::AddData(uint32 Data)
+FDataPos FBTree::AddData(uint32 Data)
+{
+	auto DataIndex = AppendData(Data, INVALID_DATA_POS);
+	FlushHeader();
+	return DataIndex;
+}
+
+FDataPos FBTree::AppendData(uint32 Data, FDataPos Next)
 {
+	if (Header.FreeData != INVALID_DATA_POS)
+	{
+		auto DataIndex = Header.FreeData;
+		Header.FreeData = ReadData(DataIndex).Next;
+		File->WriteAt(DataIndex, FData{Data, Next});
+		return DataIndex;
+	}
+
 	auto DataIndex = Header.DataEnd;
 	Header.DataEnd += sizeof(FData);
-	File->SeekWrite(DataIndex);
-	FData DataList = {Data, INVALID};
-	File->Write(DataList);
-	if ((Header.DataEnd % FILE_PAGE_SIZE) == 0)
+	FData DataList = {Data, Next};
+	File->WriteAt(DataIndex, DataList);
+	// the page behind may be a node, a data never crosses into it
+	if (FILE_PAGE_SIZE - Header.DataEnd % FILE_PAGE_SIZE < sizeof(FData))
 	{
 		auto NewDataPage = CreatePage();
 		Header.DataEnd = GetNodeOffset(NewDataPage);
 	}
-
-	FlushHeader();
 	return DataIndex;
 }
 
+void FBTree::WriteHead(uint32 Node, int Pos, const FData& Data)
+{
+	InvalidateNode(Node);
+	File->WriteAt(GetNodeOffset(Node) + DATA_BEGIN + Pos * DATA_SIZE, Data);
+}
+
+void FBTree::WriteNode(const FBTreeNode& Node)
+{
+	check(Node.Keys.Num() <= MAX_NUM_KEYS && Node.Datas.Num() == Node.Keys.Num());
+	check(Node.bLeaf || Node.Children.Num() == Node.Keys.Num() + 1);
+
+	TArray<uint8> Page;
+	Page.SetNumZeroed(MAX_NUM_SPACE_USAGE);
+	FNodePrefix Prefix = {{Node.Parent, Node.Index, Node.bLeaf}, Node.Keys.Num()};
+	FMemory::Memcpy(Page.GetData(), &Prefix, sizeof(Prefix));
+	FMemory::Memcpy(Page.GetData() + KEY_BEGIN, Node.Keys.GetData(), Node.Keys.Num() * KEY_SIZE);
+	FMemory::Memcpy(Page.GetData() + DATA_BEGIN, Node.Datas.GetData(), Node.Datas.Num() * DATA_SIZE);
+	if (!Node.bLeaf)
+		FMemory::Memcpy(Page.GetData() + CHILD_BEGIN, Node.Children.GetData(), Node.Children.Num() * CHILD_SIZE);
+	File->WriteAt(GetNodeOffset(Node.Id), Page.GetData(), Page.Num());
+	InvalidateNode(Node.Id);
+}
+
+void FBTree::AdoptChildren(const FBTreeNode& Node, int Begin)
+{
+	if (Node.bLeaf || Begin >= Node.Children.Num())
+		return;
+
+	// siblings are all leaves or all inner nodes
+	FNodeHeader NodeHeader;
+	CHECK_RESULT(File->ReadAt(GetNodeOffset(Node.Children[Begin]), NodeHeader));
+	NodeHeader.Node = Node.Id;
+	for (auto Index : XRange(Begin, Node.Children.Num()))
+	{
+		NodeHeader.Index = Index;
+		File->WriteAt(GetNodeOffset(Node.Children[Index]), NodeHeader);
+		InvalidateNode(Node.Children[Index]);
+	}
+}
+
+void FBTree::ReleasePage(uint32 Page)
+{
+	InvalidateNode(Page);
+	File->WriteAt(GetNodeOffset(Page), Header.FreePage);
+	Header.FreePage = Page;
+}
+
+void FBTree::ReleaseData(FDataPos DataPos)
+{
+	File->WriteAt(DataPos, FData{INVALID, Header.FreeData});
+	Header.FreeData = DataPos;
+}
+
 void FBTree::FlushHeader()
 {
-	File->SeekWrite(0);
-	File->Write(Header);
+	File->WriteAt(0, Header);
 }
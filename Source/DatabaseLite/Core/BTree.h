@@ -1,53 +1,142 @@
 #pragma once 
 
 #include "File.h"
+#include "LRUCache.h"
 
 
+// byte position of a data in the file, the data of a key after the first are chained through the data pages
+using FDataPos = uint64;
+constexpr static FDataPos INVALID_DATA_POS = ~(FDataPos)0;
+
+#pragma pack(push, 4)
+struct FData
+{
+	uint32 Data;
+	FDataPos Next;
+};
+#pragma pack(pop)
+
+// a node read into memory
+struct FBTreeNode
+{
+	uint32 Id;
+	uint32 Parent;
+	int Index;
+	bool bLeaf;
+	TArray<int64> Keys;
+	TArray<FData> Datas;
+	TArray<uint32> Children;
+};
+
+/*
+	walks the keys in [Lo, Hi] in order and yields every data of a key,
+	the tree must not be modified while a cursor is in use
+*/
+class FBTreeCursor
+{
+public:
+	bool IsValid() const { return Stack.Num() > 0; }
+	int64 GetKey() const;
+	uint32 GetData() const;
+	void Next();
+
+private:
+	friend class FBTree;
+	void Settle();
+
+	struct FFrame
+	{
+		TSharedPtr<const FBTreeNode> Node;
+		// key to visit after the child in front of it
+		int Pos;
+	};
+
+	class FBTree* Tree = nullptr;
+	TArray<FFrame> Stack;
+	FData Current;
+	int64 Lo = 0;
+	int64 Hi = 0;
+	bool bAscending = true;
+};
 
 
 class FBTree
 {
+	friend class FBTreeCursor;
 
 public:
 	FBTree(FFile::Ptr File);
 
 	TArray<uint32> Find(int64 Key);
 	bool FindOne(int64 Key, const TFunction<bool(uint32)>& Callback);
+	FBTreeCursor FindRange(int64 Lo, int64 Hi, bool bAscending = true);
+	// Keys sorted and unique, they are searched in one walk down the tree which reads every node once.
+	// Callback gets the position of a key and one of its datas and returns true to stop, the result is whether it did
+	bool FindMany(TArrayView<const int64> Keys, const TFunction<bool(int32, uint32)>& Callback);
 
 	void Insert(int64 Key, uint32 Data);
+	// removes one data of the key, the key goes with its last data. underfull nodes borrow from or merge with
+	// a sibling, so the tree stays as shallow and dense as inserting alone keeps it. false if nothing was found
+	bool Remove(int64 Key, uint32 Data);
+	// builds the tree bottom-up from entries sorted by key, the tree must be empty
+	void BulkLoad(const TArray<TPair<int64, uint32>>& Entries, float FillFactor = 1.0f);
 	FString GetTypeName()const;
+	static constexpr bool bRangeSupported = true;
 
 
 	void Init();
 	void Open();
 
 private:
-	bool Find(int64 Key, uint32& Node, int& Index);
-	bool GetData(uint32 Node, int Index, const TFunction<bool(uint32)>& Callback);
-	void GetKeys(uint32 Node, TArray<int64>& Keys);
-	uint32 GetNextNode(uint32 Node, int Index);
-
-	void InsertToNode(uint32 Node, int Pos, int64 Key, uint32 Data, uint32 Next = -1, uint32 RightNode = -1);
+	using FNodeRef = TSharedPtr<const FBTreeNode>;
+
+	bool Find(int64 Key, FNodeRef& Node, int& Index);
+	// FirstKey is the position of Keys[0] in all keys searched
+	bool FindMany(const FNodeRef& Node, TArrayView<const int64> Keys, int32 FirstKey, const TFunction<bool(int32, uint32)>& Callback);
+	bool GetData(const FNodeRef& Node, int Index, const TFunction<bool(uint32)>& Callback);
+	FNodeRef GetNode(uint32 Node);
+	FNodeRef ReadNode(uint32 Node);
+	void InvalidateNode(uint32 Node);
+	FData ReadData(FDataPos DataPos);
+
+	void InsertToNode(uint32 Node, int Pos, int64 Key, uint32 Data, FDataPos Next = INVALID_DATA_POS, uint32 RightNode = -1);
 	void InsertData(uint32 Node, int Pos, uint32 Data);
-	uint32 AddData(uint32 Data);
+	FDataPos AddData(uint32 Data);
+	FDataPos AppendData(uint32 Data, FDataPos Next);
+	void WriteHead(uint32 Node, int Pos, const FData& Data);
+
+	// Node has lost a key, it is written after being refilled from its siblings
+	void RemoveKey(const TSharedRef<FBTreeNode>& Node, int Pos);
+	void Rebalance(const TSharedRef<FBTreeNode>& Node);
+	// writes the whole node, the node in memory may be changed afterwards
+	void WriteNode(const FBTreeNode& Node);
+	// points the children of Node from Begin on to it and their positions in it
+	void AdoptChildren(const FBTreeNode& Node, int Begin);
 
 	void Split(uint32 Node, uint32& Left, uint32& Right);
 	uint32 CreateNode(uint32 Parent, int Index, bool bLeaf);
 	uint32 CreatePage();
+	// freed pages are listed through their first word and handed out by CreatePage again
+	void ReleasePage(uint32 Page);
+	void ReleaseData(FDataPos DataPos);
 
 	void FlushHeader();
 
 private:
 	FFile::Ptr File;
 
-	TArray<int64> RootKeys;
+	// decoded nodes, every write to a node drops its entry
+	static constexpr int NODE_CACHE_SIZE = 128;
+	TFlatLRUCache<uint32, FNodeRef, NODE_CACHE_SIZE> NodeCache;
 
 	struct
 	{
 		int MagicNum;
 		uint32 RootDataPage;
-		uint32 DataEnd;
 		uint32 RootNode;
 		uint32 PageCount;
+		uint32 FreePage;
+		FDataPos DataEnd;
+		FDataPos FreeData;
 	}Header;
 };
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include "BloomFilter.h"
+#include "Hash/CityHash.h"
+#include "Range.h"
+
+constexpr int32 BLOOM_FILTER_MAGIC_NUM = 0xFB7cb1;
+// about one false positive in a hundred at full capacity
+constexpr uint32 BITS_PER_KEY = 10;
+constexpr uint32 NUM_HASHES = 7;
+constexpr uint32 MIN_CAPACITY = 1024;
+constexpr int32 WORDS_PER_BLOCK = 512;
+constexpr int32 WORDS_BEGIN = 64;
+
+FBloomFilter::FBloomFilter(FFile::Ptr InFile, bool bInReadOnly) :File(InFile), bReadOnly(bInReadOnly)
+{
+}
+
+uint64 FBloomFilter::Hash(int64 Key)
+{
+	return CityHash64((const char*)&Key, sizeof(Key));
+}
+
+uint64 FBloomFilter::Hash(TArrayView<const uint8> Key)
+{
+	return CityHash64((const char*)Key.GetData(), Key.Num());
+}
+
+void FBloomFilter::Add(uint64 KeyHash)
+{
+	MarkChanged();
+
+	// the bits of a key come from two halves of its hash
+	const uint64 NumBits = (uint64)Words.Num() * 64;
+	const uint64 Step = (KeyHash >> 32) | 1;
+	uint64 Bit = (uint32)KeyHash;
+	for (auto Index : XRange(NUM_HASHES))
+	{
+		auto Pos = Bit % NumBits;
+		Words[Pos / 64] |= 1ull << (Pos % 64);
+		DirtyBlocks[Pos / 64 / WORDS_PER_BLOCK] = true;
+		Bit += Step;
+	}
+	Header.NumKeys++;
+}
+
+bool FBloomFilter::MayContain(uint64 KeyHash) const
+{
+	const uint64 NumBits = (uint64)Words.Num() * 64;
+	const uint64 Step = (KeyHash >> 32) | 1;
+	uint64 Bit = (uint32)KeyHash;
+	for (auto Index : XRange(NUM_HASHES))
+	{
+		auto Pos = Bit % NumBits;
+		if (!(Words[Pos / 64] & (1ull << (Pos % 64))))
+			return false;
+		Bit += Step;
+	}
+	return true;
+}
+
+void FBloomFilter::Reset(uint32 Capacity)
+{
+	MarkChanged();
+
+	Header.Capacity = FMath::Max(Capacity, MIN_CAPACITY);
+	Header.NumKeys = 0;
+	auto NumBlocks = FMath::DivideAndRoundUp<uint64>((uint64)Header.Capacity * BITS_PER_KEY, WORDS_PER_BLOCK * 64);
+	Header.NumWords = (uint32)(NumBlocks * WORDS_PER_BLOCK);
+
+	Words.Reset();
+	Words.SetNumZeroed(Header.NumWords);
+	DirtyBlocks.Reset();
+	DirtyBlocks.Init(true, NumBlocks);
+}
+
+void FBloomFilter::Flush()
+{
+	if (!bChanged || bReadOnly)
+		return;
+
+	// blocks in order, the file only grows at its end
+	for (auto Block : XRange(DirtyBlocks.Num()))
+	{
+		if (!DirtyBlocks[Block])
+			continue;
+		auto Offset = WORDS_BEGIN + (uint64)Block * WORDS_PER_BLOCK * sizeof(uint64);
+		CHECK_RESULT(File->WriteAt(Offset, Words.GetData() + Block * WORDS_PER_BLOCK, WORDS_PER_BLOCK * sizeof(uint64)));
+		DirtyBlocks[Block] = false;
+	}
+
+	Header.bStale = 0;
+	CHECK_RESULT(File->WriteAt(0, Header));
+	bChanged = false;
+}
+
+void FBloomFilter::Init()
+{
+	Header.MagicNum = BLOOM_FILTER_MAGIC_NUM;
+	Header.bStale = 1;
+	Reset(MIN_CAPACITY);
+	Flush();
+}
+
+bool FBloomFilter::Open()
+{
+	FMemory::Memzero(Header);
+	Header.MagicNum = BLOOM_FILTER_MAGIC_NUM;
+	Header.bStale = 1;
+	bChanged = false;
+
+	decltype(Header) FileHeader;
+	if (!File || !File->ReadAt(0, FileHeader) || FileHeader.MagicNum != BLOOM_FILTER_MAGIC_NUM || FileHeader.bStale)
+		return false;
+
+	TArray<uint64> FileWords;
+	FileWords.SetNumUninitialized(FileHeader.NumWords);
+	if (!File->ReadAt(WORDS_BEGIN, FileWords.GetData(), FileWords.Num() * sizeof(uint64)))
+		return false;
+
+	Header = FileHeader;
+	Words = MoveTemp(FileWords);
+	DirtyBlocks.Init(false, Words.Num() / WORDS_PER_BLOCK);
+	return true;
+}
+
+void FBloomFilter::MarkChanged()
+{
+	if (bChanged)
+		return;
+	bChanged = true;
+
+	// rows may change before the next flush, a crash in between leaves the filter stale
+	if (!bReadOnly && File)
+	{
+		Header.bStale = 1;
+		CHECK_RESULT(File->WriteAt(0, Header));
+	}
+}
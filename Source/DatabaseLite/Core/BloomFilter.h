@@ -0,0 +1,57 @@
+#pragma once
+
+#include "File.h"
+
+/*
+	bits set by the keys of an index, a key whose bits are not all set is not in the index.
+	the bits live in memory and are written back by Flush, the file is marked as stale on the first change after it,
+	a stale or missing filter has to be rebuilt from the rows.
+	removing keys is not supported, the bits of removed keys stay until the next rebuild
+*/
+class FBloomFilter
+{
+public:
+	using Ptr = TSharedPtr<FBloomFilter>;
+public:
+	// a read-only filter is never written
+	FBloomFilter(FFile::Ptr File, bool bReadOnly);
+
+	static uint64 Hash(int64 Key);
+	static uint64 Hash(TArrayView<const uint8> Key);
+
+	void Add(uint64 KeyHash);
+	bool MayContain(uint64 KeyHash) const;
+	// more keys were added than it was sized for, false positives get frequent
+	bool IsFull() const { return Header.NumKeys > Header.Capacity; }
+	uint32 GetCapacity() const { return Header.Capacity; }
+
+	// empty filter sized for Capacity keys
+	void Reset(uint32 Capacity);
+	// writes the changed bits and marks the file as up to date
+	void Flush();
+
+	void Init();
+	// false when the file is stale, the filter has to be reset and filled again
+	bool Open();
+
+private:
+	void MarkChanged();
+
+private:
+	FFile::Ptr File;
+	bool bReadOnly;
+	bool bChanged = false;
+
+	TArray<uint64> Words;
+	// one flag per block of words changed since the last flush
+	TArray<bool> DirtyBlocks;
+
+	struct
+	{
+		int MagicNum;
+		uint32 bStale;
+		uint32 Capacity;
+		uint32 NumKeys;
+		uint32 NumWords;
+	}Header;
+};
@@ -0,0 +1,539 @@
+#include "BufferPool.h"
+#include "HAL/PlatformFilemanager.h"
+#include "GenericPlatform/GenericPlatformFile.h"
+#include "Misc/ScopeLock.h"
+#include "Async/Async.h"
+
+// the first in first out part keeps a quarter of the frames
+constexpr int32 IN_QUEUE_SHARE = 4;
+constexpr int32 MIN_FRAME_COUNT = 4;
+
+FBufferPool::Ptr FBufferPool::OpenRead(const FString& InFileName, uint64 InCapacity)
+{
+	auto& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	auto Pool = MakeShared<FBufferPool>(MakeShareable(PlatformFile.OpenRead(*InFileName)), InCapacity);
+	Pool->FileName = InFileName;
+	return Pool;
+}
+
+FBufferPool::Ptr FBufferPool::OpenWrite(const FString& InFileName, bool bAppend, bool bAllowRead, uint64 InCapacity)
+{
+	auto& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	auto Pool = MakeShared<FBufferPool>(MakeShareable(PlatformFile.OpenWrite(*InFileName, bAppend, bAllowRead)), InCapacity);
+	Pool->FileName = InFileName;
+	return Pool;
+}
+
+FBufferPool::FBufferPool(TSharedPtr<IFileHandle> InFileHandle, uint64 InCapacity):
+	FileHandle(InFileHandle), Capacity(InCapacity)
+{
+	if (FileHandle)
+		FileSize = FileHandle->Size();
+}
+
+FBufferPool::~FBufferPool()
+{
+	if (PrefetchTask.IsValid())
+		PrefetchTask.Wait();
+
+	FScopeLock Lock(&Mutex);
+	if (FileHandle)
+		WriteDirtyFrames();
+}
+
+bool FBufferPool::Write(const uint8* Buffer, uint32 Size)
+{
+	if (!WriteAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+bool FBufferPool::Read(uint8* Buffer, uint32 Size)
+{
+	if (!ReadAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+uint64 FBufferPool::Tell()
+{
+	return Pos;
+}
+
+bool FBufferPool::Seek(uint64 InPos)
+{
+	Pos = InPos;
+	return true;
+}
+
+bool FBufferPool::ReadAt(uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	FScopeLock Lock(&Mutex);
+	if (Offset + Size > FileSize)
+		return false;
+
+	while (Size > 0)
+	{
+		auto PageIndex = (uint32)(Offset / PAGE_SIZE);
+		auto PageOffset = (uint32)(Offset % PAGE_SIZE);
+		auto Count = FMath::Min(PAGE_SIZE - PageOffset, Size);
+
+		auto FrameIndex = GetFrame(PageIndex, false);
+		if (FrameIndex == INDEX_NONE)
+			return false;
+		FMemory::Memcpy(Buffer, Frames[FrameIndex].Data.GetData() + PageOffset, Count);
+
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
+	}
+	return true;
+}
+
+bool FBufferPool::WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size)
+{
+	FScopeLock Lock(&Mutex);
+	while (Size > 0)
+	{
+		auto PageIndex = (uint32)(Offset / PAGE_SIZE);
+		auto PageOffset = (uint32)(Offset % PAGE_SIZE);
+		auto Count = FMath::Min(PAGE_SIZE - PageOffset, Size);
+
+		auto FrameIndex = GetFrame(PageIndex, Count == PAGE_SIZE);
+		if (FrameIndex == INDEX_NONE)
+			return false;
+		auto& Frame = Frames[FrameIndex];
+		FMemory::Memcpy(Frame.Data.GetData() + PageOffset, Buffer, Count);
+		Frame.bDirty = true;
+
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
+		FileSize = FMath::Max(FileSize, Offset);
+	}
+	return true;
+}
+
+bool FBufferPool::Flush()
+{
+	FScopeLock Lock(&Mutex);
+	return WriteDirtyFrames() && FileHandle->Flush(true);
+}
+
+void FBufferPool::Prefetch(uint64 Offset, uint64 Size)
+{
+	FScopeLock Lock(&Mutex);
+	// one batch at a time, the hint is dropped while the last one is running
+	if (FileName.IsEmpty() || (PrefetchTask.IsValid() && !PrefetchTask.IsReady()))
+		return;
+
+	TArray<uint32> Missing;
+	const uint64 End = FMath::Min(Offset + Size, FileSize);
+	const int32 MaxCount = GetMaxFrames() / IN_QUEUE_SHARE;
+	for (auto PageIndex = (uint32)(Offset / PAGE_SIZE); (uint64)PageIndex * PAGE_SIZE < End && Missing.Num() < MaxCount; ++PageIndex)
+	{
+		if (!PageTable.Contains(PageIndex))
+			Missing.Add(PageIndex);
+	}
+	if (Missing.Num() == 0)
+		return;
+
+	Prefetching.Append(Missing);
+	PrefetchTask = Async(EAsyncExecution::ThreadPool, [this, Missing = MoveTemp(Missing)]() {
+		LoadPrefetched(Missing);
+	});
+}
+
+void FBufferPool::LoadPrefetched(const TArray<uint32>& PageIndices)
+{
+	// the handle is only used by one task at a time
+	if (!PrefetchHandle)
+		PrefetchHandle.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*FileName, true));
+
+	TArray<uint8> Buffer;
+	for (int Begin = 0; Begin < PageIndices.Num();)
+	{
+		auto End = Begin + 1;
+		while (End < PageIndices.Num() && PageIndices[End] == PageIndices[End - 1] + 1)
+			++End;
+
+		// read outside of the lock, readers of cached pages go on meanwhile
+		const int64 Offset = (int64)PageIndices[Begin] * PAGE_SIZE;
+		Buffer.SetNumUninitialized((End - Begin) * PAGE_SIZE, false);
+		auto Count = PrefetchHandle ? FMath::Clamp<int64>(PrefetchHandle->Size() - Offset, 0, Buffer.Num()) : 0;
+		bool bRead = Count > 0 && PrefetchHandle->Seek(Offset) && PrefetchHandle->Read(Buffer.GetData(), Count);
+		FMemory::Memzero(Buffer.GetData() + Count, Buffer.Num() - Count);
+
+		FScopeLock Lock(&Mutex);
+		for (auto Index = Begin; Index < End; ++Index)
+		{
+			auto PageIndex = PageIndices[Index];
+			if (Prefetching.Remove(PageIndex) == 0 || !bRead || PageTable.Contains(PageIndex))
+				continue;
+
+			// only a free frame or the oldest page of the FIFO is given up for a page nobody asked for yet
+			int32 FrameIndex = INDEX_NONE;
+			if (PageTable.Num() < GetMaxFrames())
+			{
+				FrameIndex = AllocateFrame();
+			}
+			else
+			{
+				auto Victim = FindVictim(InQueue);
+				if (Victim != INDEX_NONE && EvictFrame(Victim))
+					FrameIndex = Victim;
+			}
+			if (FrameIndex == INDEX_NONE)
+				continue;
+
+			auto& Frame = Frames[FrameIndex];
+			Frame.PageIndex = PageIndex;
+			Frame.PinCount = 0;
+			Frame.bDirty = false;
+			FMemory::Memcpy(Frame.Data.GetData(), Buffer.GetData() + (Index - Begin) * PAGE_SIZE, PAGE_SIZE);
+			PageTable.Add(PageIndex, FrameIndex);
+			LinkFrame(FrameIndex, EQueue::In);
+			Stats.Prefetches++;
+		}
+		Begin = End;
+	}
+}
+
+bool FBufferPool::CopyCached(uint32 PageIndex, uint32 PageOffset, uint8* Buffer, uint32 Size)
+{
+	FScopeLock Lock(&Mutex);
+	auto FrameIndex = PageTable.Find(PageIndex);
+	if (!FrameIndex)
+	{
+		Stats.Misses++;
+		return false;
+	}
+
+	Stats.Hits++;
+	FMemory::Memcpy(Buffer, Frames[*FrameIndex].Data.GetData() + PageOffset, Size);
+	return true;
+}
+
+uint64 FBufferPool::GetFileSize()
+{
+	FScopeLock Lock(&Mutex);
+	return FileSize;
+}
+
+const uint8* FBufferPool::Pin(uint64 Offset, uint32 Size)
+{
+	auto PageOffset = (uint32)(Offset % PAGE_SIZE);
+	if (PageOffset + Size > PAGE_SIZE)
+		return nullptr;
+
+	auto Page = PinPage((uint32)(Offset / PAGE_SIZE));
+	return Page ? Page + PageOffset : nullptr;
+}
+
+void FBufferPool::Unpin(uint64 Offset)
+{
+	UnpinPage((uint32)(Offset / PAGE_SIZE));
+}
+
+const uint8* FBufferPool::PinPage(uint32 PageIndex)
+{
+	FScopeLock Lock(&Mutex);
+	if ((uint64)PageIndex * PAGE_SIZE >= FileSize)
+		return nullptr;
+
+	auto FrameIndex = GetFrame(PageIndex, false);
+	if (FrameIndex == INDEX_NONE)
+		return nullptr;
+
+	auto& Frame = Frames[FrameIndex];
+	Frame.PinCount++;
+	return Frame.Data.GetData();
+}
+
+void FBufferPool::UnpinPage(uint32 PageIndex)
+{
+	FScopeLock Lock(&Mutex);
+	auto FrameIndex = PageTable.Find(PageIndex);
+	check(FrameIndex && Frames[*FrameIndex].PinCount > 0);
+	Frames[*FrameIndex].PinCount--;
+}
+
+void FBufferPool::SetCapacity(uint64 InCapacity)
+{
+	FScopeLock Lock(&Mutex);
+	Capacity = InCapacity;
+
+	while (PageTable.Num() > GetMaxFrames())
+	{
+		auto Victim = FindVictim(InQueue);
+		if (Victim == INDEX_NONE)
+			Victim = FindVictim(MainQueue);
+		if (Victim == INDEX_NONE || !EvictFrame(Victim))
+			break;
+
+		Frames[Victim].Data.Empty();
+		FreeFrames.Add(Victim);
+	}
+
+	Ghosts.Reset();
+	GhostSet.Reset();
+	GhostHead = 0;
+}
+
+FBufferPool::FStats FBufferPool::GetStats()
+{
+	FScopeLock Lock(&Mutex);
+	return Stats;
+}
+
+void FBufferPool::ResetStats()
+{
+	FScopeLock Lock(&Mutex);
+	Stats = {};
+}
+
+int32 FBufferPool::GetFrame(uint32 PageIndex, bool bOverwrite)
+{
+	if (auto Found = PageTable.Find(PageIndex))
+	{
+		Stats.Hits++;
+		// pages in the FIFO keep their place, a hit there does not prove the page is hot
+		if (Frames[*Found].Queue == EQueue::Main)
+		{
+			UnlinkFrame(*Found);
+			LinkFrame(*Found, EQueue::Main);
+		}
+		return *Found;
+	}
+
+	Stats.Misses++;
+	auto FrameIndex = AllocateFrame();
+	if (FrameIndex == INDEX_NONE)
+		return INDEX_NONE;
+
+	auto& Frame = Frames[FrameIndex];
+	Frame.PageIndex = PageIndex;
+	Frame.PinCount = 0;
+	Frame.bDirty = false;
+
+	// the part behind the end of the file on disk may only exist in dirty pages which were evicted, it reads as zero
+	const int64 Begin = (int64)PageIndex * PAGE_SIZE;
+	auto Count = bOverwrite ? 0 : (uint32)FMath::Clamp<int64>(FileHandle->Size() - Begin, 0, PAGE_SIZE);
+	if (Count > 0 && (!FileHandle->Seek(Begin) || !FileHandle->Read(Frame.Data.GetData(), Count)))
+	{
+		FreeFrames.Add(FrameIndex);
+		return INDEX_NONE;
+	}
+	FMemory::Memzero(Frame.Data.GetData() + Count, PAGE_SIZE - Count);
+
+	PageTable.Add(PageIndex, FrameIndex);
+	LinkFrame(FrameIndex, GhostSet.Remove(PageIndex) > 0 ? EQueue::Main : EQueue::In);
+	return FrameIndex;
+}
+
+int32 FBufferPool::AllocateFrame()
+{
+	if (PageTable.Num() < GetMaxFrames())
+	{
+		auto FrameIndex = FreeFrames.Num() > 0 ? FreeFrames.Pop(false) : Frames.AddDefaulted();
+		Frames[FrameIndex].Data.SetNumUninitialized(PAGE_SIZE, false);
+		return FrameIndex;
+	}
+
+	int32 Victim = INDEX_NONE;
+	if (InQueue.Num > GetMaxFrames() / IN_QUEUE_SHARE)
+		Victim = FindVictim(InQueue);
+	if (Victim == INDEX_NONE)
+		Victim = FindVictim(MainQueue);
+	if (Victim == INDEX_NONE)
+		Victim = FindVictim(InQueue);
+
+	checkf(Victim != INDEX_NONE, TEXT("every page of the buffer pool is pinned"));
+	if (Victim == INDEX_NONE || !EvictFrame(Victim))
+		return INDEX_NONE;
+	return Victim;
+}
+
+int32 FBufferPool::FindVictim(const FQueue& Queue) const
+{
+	for (auto FrameIndex = Queue.Tail; FrameIndex != INDEX_NONE; FrameIndex = Frames[FrameIndex].Prev)
+	{
+		if (Frames[FrameIndex].PinCount == 0)
+			return FrameIndex;
+	}
+	return INDEX_NONE;
+}
+
+bool FBufferPool::EvictFrame(int32 FrameIndex)
+{
+	auto& Frame = Frames[FrameIndex];
+	if (Frame.bDirty && !WriteFrame(Frame))
+		return false;
+
+	if (Frame.Queue == EQueue::In)
+		RememberEvicted(Frame.PageIndex);
+
+	UnlinkFrame(FrameIndex);
+	PageTable.Remove(Frame.PageIndex);
+	Stats.Evictions++;
+	return true;
+}
+
+void FBufferPool::LinkFrame(int32 FrameIndex, EQueue InQueueType)
+{
+	auto& Queue = GetQueue(InQueueType);
+	auto& Frame = Frames[FrameIndex];
+	Frame.Queue = InQueueType;
+	Frame.Prev = INDEX_NONE;
+	Frame.Next = Queue.Head;
+	if (Queue.Head != INDEX_NONE)
+		Frames[Queue.Head].Prev = FrameIndex;
+	else
+		Queue.Tail = FrameIndex;
+	Queue.Head = FrameIndex;
+	Queue.Num++;
+}
+
+void FBufferPool::UnlinkFrame(int32 FrameIndex)
+{
+	auto& Frame = Frames[FrameIndex];
+	auto& Queue = GetQueue(Frame.Queue);
+	if (Frame.Prev != INDEX_NONE)
+		Frames[Frame.Prev].Next = Frame.Next;
+	else
+		Queue.Head = Frame.Next;
+
+	if (Frame.Next != INDEX_NONE)
+		Frames[Frame.Next].Prev = Frame.Prev;
+	else
+		Queue.Tail = Frame.Prev;
+
+	Queue.Num--;
+	Frame.Queue = EQueue::None;
+	Frame.Prev = Frame.Next = INDEX_NONE;
+}
+
+FBufferPool::FQueue& FBufferPool::GetQueue(EQueue Queue)
+{
+	check(Queue != EQueue::None);
+	return Queue == EQueue::In ? InQueue : MainQueue;
+}
+
+void FBufferPool::RememberEvicted(uint32 PageIndex)
+{
+	// remember as many pages as half of the pool holds
+	auto GhostCapacity = FMath::Max(GetMaxFrames() / 2, 1);
+	if (Ghosts.Num() < GhostCapacity)
+	{
+		Ghosts.Add(PageIndex);
+	}
+	else
+	{
+		GhostSet.Remove(Ghosts[GhostHead]);
+		Ghosts[GhostHead] = PageIndex;
+		GhostHead = (GhostHead + 1) % Ghosts.Num();
+	}
+	GhostSet.Add(PageIndex);
+}
+
+bool FBufferPool::WriteFrame(FFrame& Frame)
+{
+	const uint64 Begin = (uint64)Frame.PageIndex * PAGE_SIZE;
+	auto Count = (uint32)FMath::Min<uint64>(FileSize - Begin, PAGE_SIZE);
+	if (!FileHandle->Seek(Begin) || !FileHandle->Write(Frame.Data.GetData(), Count))
+		return false;
+
+	// a copy read from disk before this write is outdated
+	Prefetching.Remove(Frame.PageIndex);
+	Frame.bDirty = false;
+	Stats.WriteBacks++;
+	return true;
+}
+
+bool FBufferPool::WriteDirtyFrames()
+{
+	TArray<uint32> Dirty;
+	for (auto& Item : PageTable)
+	{
+		if (Frames[Item.Value].bDirty)
+			Dirty.Add(Item.Key);
+	}
+	Dirty.Sort();
+
+	TArray<uint8> Buffer;
+	for (int Begin = 0; Begin < Dirty.Num();)
+	{
+		auto End = Begin + 1;
+		while (End < Dirty.Num() && Dirty[End] == Dirty[End - 1] + 1)
+			++End;
+
+		Buffer.Reset();
+		for (auto Index = Begin; Index < End; ++Index)
+		{
+			Buffer.Append(Frames[PageTable[Dirty[Index]]].Data);
+		}
+
+		const uint64 Offset = (uint64)Dirty[Begin] * PAGE_SIZE;
+		auto Count = (uint32)FMath::Min<uint64>(FileSize - Offset, Buffer.Num());
+		if (!FileHandle->Seek(Offset) || !FileHandle->Write(Buffer.GetData(), Count))
+			return false;
+
+		for (auto Index = Begin; Index < End; ++Index)
+		{
+			Frames[PageTable[Dirty[Index]]].bDirty = false;
+			Prefetching.Remove(Dirty[Index]);
+		}
+		Stats.WriteBacks += End - Begin;
+		Begin = End;
+	}
+	return true;
+}
+
+int32 FBufferPool::GetMaxFrames() const
+{
+	return (int32)FMath::Clamp<uint64>(Capacity / PAGE_SIZE, MIN_FRAME_COUNT, MAX_int32);
+}
+
+FBufferPoolReader::FBufferPoolReader(FBufferPool::Ptr InPool):
+	Pool(InPool)
+{
+	if (!Pool->FileName.IsEmpty())
+		FileHandle.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*Pool->FileName, true));
+}
+
+bool FBufferPoolReader::Read(uint8* Buffer, uint32 Size)
+{
+	if (!ReadAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+bool FBufferPoolReader::ReadAt(uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	if (Offset + Size > Pool->GetFileSize())
+		return false;
+
+	while (Size > 0)
+	{
+		auto PageIndex = (uint32)(Offset / FBufferPool::PAGE_SIZE);
+		auto PageOffset = (uint32)(Offset % FBufferPool::PAGE_SIZE);
+		auto Count = FMath::Min(FBufferPool::PAGE_SIZE - PageOffset, Size);
+
+		if (!Pool->CopyCached(PageIndex, PageOffset, Buffer, Count))
+		{
+			// preallocated pages behind the end of the file on disk read as zero
+			auto OnDisk = (uint32)FMath::Clamp<int64>(FileHandle->Size() - (int64)Offset, 0, Count);
+			if (OnDisk > 0 && !(FileHandle->Seek(Offset) && FileHandle->Read(Buffer, OnDisk)))
+				return false;
+			FMemory::Memzero(Buffer + OnDisk, Count - OnDisk);
+		}
+
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
+	}
+	return true;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LowLevelFile.h"
+#include "HAL/CriticalSection.h"
+#include "Async/Future.h"
+
+/*
+	Page cache in front of the database file, every table of a FFileSystem shares it.
+	Eviction follows 2Q: a page read for the first time goes into a FIFO, when it is evicted from there
+	its id is remembered for a while, and only a page which is read again in that time enters the LRU part.
+	A long scan only cycles through the FIFO and never pushes the hot pages out.
+	Written pages stay dirty in memory until they are evicted or flushed.
+	Prefetched pages are read by a background task through a handle of its own and enter the FIFO.
+*/
+class FBufferPool : public ILowLevelFile
+{
+	friend class FBufferPoolReader;
+public:
+	static constexpr uint32 PAGE_SIZE = 16 * 1024;
+	using Ptr = TSharedPtr<FBufferPool>;
+
+	struct FStats
+	{
+		uint64 Hits = 0;
+		uint64 Misses = 0;
+		uint64 Evictions = 0;
+		uint64 WriteBacks = 0;
+		uint64 Prefetches = 0;
+	};
+public:
+	static Ptr OpenRead(const FString& InFileName, uint64 InCapacity);
+	static Ptr OpenWrite(const FString& InFileName, bool bAppend, bool bAllowRead, uint64 InCapacity);
+public:
+	FBufferPool(TSharedPtr<IFileHandle> InFileHandle, uint64 InCapacity);
+	~FBufferPool();
+
+	virtual bool Write(const uint8* Buffer, uint32 Size) override;
+	virtual bool Read(uint8* Buffer, uint32 Size) override;
+	virtual uint64 Tell() override;
+	virtual bool Seek(uint64 Pos) override;
+	virtual bool IsValid() override { return FileHandle.IsValid(); }
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) override;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override;
+	virtual bool Flush() override;
+	// loads the missing pages of the range in the background, at most as many as the FIFO holds
+	virtual void Prefetch(uint64 Offset, uint64 Size) override;
+
+	virtual const uint8* Pin(uint64 Offset, uint32 Size) override;
+	virtual void Unpin(uint64 Offset) override;
+
+	// keeps the page in memory, its PAGE_SIZE bytes may be read until the page is unpinned
+	const uint8* PinPage(uint32 PageIndex);
+	void UnpinPage(uint32 PageIndex);
+
+	// shrinking evicts unpinned pages right away
+	void SetCapacity(uint64 InCapacity);
+	uint64 GetCapacity() const { return Capacity; }
+	FStats GetStats();
+	void ResetStats();
+
+private:
+	enum class EQueue : uint8
+	{
+		None,
+		In,
+		Main,
+	};
+
+	struct FFrame
+	{
+		TArray<uint8> Data;
+		uint32 PageIndex = 0;
+		int32 PinCount = 0;
+		bool bDirty = false;
+		EQueue Queue = EQueue::None;
+		int32 Prev = INDEX_NONE;
+		int32 Next = INDEX_NONE;
+	};
+
+	// intrusive list of frames, the head is the most recent one
+	struct FQueue
+	{
+		int32 Head = INDEX_NONE;
+		int32 Tail = INDEX_NONE;
+		int32 Num = 0;
+	};
+
+	// frame of the page, it is loaded when missing, the content is not read when the caller overwrites all of it
+	int32 GetFrame(uint32 PageIndex, bool bOverwrite);
+	int32 AllocateFrame();
+	int32 FindVictim(const FQueue& Queue) const;
+	bool EvictFrame(int32 FrameIndex);
+	void LinkFrame(int32 FrameIndex, EQueue Queue);
+	void UnlinkFrame(int32 FrameIndex);
+	FQueue& GetQueue(EQueue Queue);
+	void RememberEvicted(uint32 PageIndex);
+	bool WriteFrame(FFrame& Frame);
+	// writes all dirty pages, neighbouring pages with one write
+	bool WriteDirtyFrames();
+	int32 GetMaxFrames() const;
+	void LoadPrefetched(const TArray<uint32>& PageIndices);
+	// copies from the page when it is in memory, a missing page is not loaded
+	bool CopyCached(uint32 PageIndex, uint32 PageOffset, uint8* Buffer, uint32 Size);
+	uint64 GetFileSize();
+private:
+	FString FileName;
+	TSharedPtr<IFileHandle> FileHandle;
+	uint64 Capacity;
+	// size of the file including the dirty pages
+	uint64 FileSize = 0;
+	uint64 Pos = 0;
+
+	TArray<FFrame> Frames;
+	TArray<int32> FreeFrames;
+	TMap<uint32, int32> PageTable;
+	FQueue InQueue;
+	FQueue MainQueue;
+
+	// ring of the pages evicted from InQueue
+	TArray<uint32> Ghosts;
+	int32 GhostHead = 0;
+	TSet<uint32> GhostSet;
+
+	// pages the prefetch task is reading, a page written back meanwhile is dropped from it
+	TSet<uint32> Prefetching;
+	TUniquePtr<IFileHandle> PrefetchHandle;
+	TFuture<void> PrefetchTask;
+
+	FStats Stats;
+	FCriticalSection Mutex;
+};
+
+/*
+	reads the pages of a FBufferPool from memory and the missing ones through a file handle of its own,
+	outside of the lock of the pool, so that readers on several threads wait for the disk at the same time.
+	the pages read from disk are not added to the pool. a reader is used by one thread at a time and only
+	while nothing writes, evicted pages are written back before they leave the pool, so the disk is up to date
+*/
+class FBufferPoolReader : public ILowLevelFile
+{
+public:
+	FBufferPoolReader(FBufferPool::Ptr InPool);
+
+	virtual bool Write(const uint8* Buffer, uint32 Size) override { return false; }
+	virtual bool Read(uint8* Buffer, uint32 Size) override;
+	virtual uint64 Tell() override { return Pos; }
+	virtual bool Seek(uint64 InPos) override { Pos = InPos; return true; }
+	virtual bool IsValid() override { return FileHandle.IsValid(); }
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) override;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override { return false; }
+	virtual bool Flush() override { return true; }
+	virtual void Prefetch(uint64 Offset, uint64 Size) override { Pool->Prefetch(Offset, Size); }
+private:
+	FBufferPool::Ptr Pool;
+	TUniquePtr<IFileHandle> FileHandle;
+	uint64 Pos = 0;
+};
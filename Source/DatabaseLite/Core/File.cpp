@@ -1,13 +1,16 @@
 #include "File.h"
 #include "StaticText.h"
+#include "WriteAheadLog.h"
+#include "BufferPool.h"
 #include "Range.h"
 #include "HAL/PlatformFilemanager.h"
 #include "GenericPlatform/GenericPlatformFile.h"
 
 
+// catches re-entrant writes, snapshot readers on other threads never write
 struct FGuardWrite
 {
-	static bool Locked;
+	static thread_local bool Locked;
 	FGuardWrite()
 	{
 		check(!Locked);
@@ -18,14 +21,34 @@ struct FGuardWrite
 		Locked = false;
 	}
 };
-bool FGuardWrite::Locked = false;
+thread_local bool FGuardWrite::Locked = false;
 #define GUARD_WRITE() FGuardWrite __GuardWrite;
 
 
 
-inline uint32 GetPageOffset(PageId Id)
+static_assert(FBufferPool::PAGE_SIZE == FILE_PAGE_SIZE, "buffer pool frames hold one page");
+
+inline uint64 GetPageOffset(PageId Id)
 {
-	return Id * FILE_PAGE_SIZE;
+	return (uint64)Id * FILE_PAGE_SIZE;
+}
+
+constexpr int32 FILE_SYSTEM_MAGIC_NUM = 0xF5b17a;
+constexpr int32 FILE_MAGIC_NUM = 0xF11e65;
+// headers of earlier versions of the format, their databases are not read any more and have to be recreated
+constexpr int32 OLDER_FILE_MAGIC_NUMS[] = { 0xF11e, 0xF11e64 };
+constexpr uint32 PAGES_PER_BITMAP = FILE_PAGE_SIZE * 8;
+constexpr int32 WORDS_PER_BITMAP = FILE_PAGE_SIZE / sizeof(uint64);
+// a file takes a quarter of its data pages ahead at once, at most this many
+constexpr uint32 MAX_EXTENT_PAGES = 256;
+// the database file grows by an eighth of its size at once, within these bounds
+constexpr uint32 MIN_PREALLOCATE_PAGES = 64;
+constexpr uint32 MAX_PREALLOCATE_PAGES = 4096;
+
+// the bitmap of a range of pages lives on its second page, the first page of the file holds the head file
+inline PageId GetBitmapPage(uint32 Bitmap)
+{
+	return Bitmap * PAGES_PER_BITMAP + 1;
 }
 
 
@@ -34,23 +57,16 @@ struct FFileHandleHelper
 {
 	static bool Read(void* Buffer, uint32 Size, TSharedPtr<ILowLevelFile> InHandle, PageId Id, uint32 Offset = 0)
 	{
-		auto Begin = GetPageOffset(Id) + Offset;
-		auto End = Begin + FILE_PAGE_SIZE;
-		check(Offset < FILE_PAGE_SIZE && Size < FILE_PAGE_SIZE);
-		check(Begin + Size < End);
-		InHandle->Seek(Begin + Offset);
-		return InHandle->Read((uint8*)Buffer, Size);
+		check(Offset + Size <= FILE_PAGE_SIZE);
+		return InHandle->ReadAt(GetPageOffset(Id) + Offset, (uint8*)Buffer, Size);
 	}
 
 	static bool Write(const void* Buffer, uint32 Size, TSharedPtr<ILowLevelFile> InHandle, PageId Id, uint32 Offset = 0)
 	{
 		GUARD_WRITE();
 
-		auto Begin = GetPageOffset(Id);
-		auto End = Begin + FILE_PAGE_SIZE;
-		check(Begin + Offset + Size < End);
-		InHandle->Seek(Begin + Offset);
-		return InHandle->Write((const uint8*)Buffer, Size);
+		check(Offset + Size <= FILE_PAGE_SIZE);
+		return InHandle->WriteAt(GetPageOffset(Id) + Offset, (const uint8*)Buffer, Size);
 	}
 
 
@@ -74,6 +90,11 @@ FFileSystem::FFileSystem()
 }
 
 FFileSystem::~FFileSystem()
+{
+	Close();
+}
+
+bool FFileSystem::Close()
 {
 	StaticText.Reset();
 	if (WriteHandle)
@@ -83,6 +104,15 @@ FFileSystem::~FFileSystem()
 	{
 		checkf(!File.Value.IsValid(), TEXT("File is not closed before closing filesystem."));
 	}
+	// the headers of the files are written when they close, so the log and a database in memory are written back after them
+	bool bResult = true;
+	if (Log)
+		bResult = Log->Close();
+	Log.Reset();
+	if (WriteHandle)
+		bResult &= WriteHandle->Persist();
+	CloseHandles();
+	return bResult;
 }
 
 struct LowLevelFileFactory
@@ -135,61 +165,270 @@ static LowLevelFileFactory GetFactory(ELowLevelFileType Type)
 	{
 	case ELowLevelFileType::Normal:	return LowLevelFileFactory::GetFactory<FGenericPlatformFile>();
 	case ELowLevelFileType::Memory:	return LowLevelFileFactory::GetFactory<FMemoryFile>();
-	case ELowLevelFileType::Cached: return LowLevelFileFactory::GetFactory<FCachedFile>();
+	case ELowLevelFileType::Mapped: return LowLevelFileFactory::GetFactory<FMappedFile>();
+	case ELowLevelFileType::Loaded: return LowLevelFileFactory::GetFactory<FLoadedFile>();
+	// a FBufferPool, OpenHandles creates it with the options
+	case ELowLevelFileType::Cached: break;
 	}
 
 	return {};
 }
 
 
-bool FFileSystem::Init(const FString& FileName, bool bReadOnly, ELowLevelFileType Type)
+bool FFileSystem::Init(const FString& FileName, bool bReadOnly, ELowLevelFileType Type, const FFileSystemOptions& InOptions)
 {
-	bool bIsNewFile = !FPaths::FileExists(FileName);
-	auto Factory = GetFactory(Type);
-	if (!bReadOnly)
-		ReadHandle = WriteHandle = (Factory.OpenWrite(*FileName, true, true));
-	else if (bIsNewFile)
+	Options = InOptions;
+	// the log only pays off when pages reach a disk
+	Options.bWriteAheadLog &= Type != ELowLevelFileType::Memory && Type != ELowLevelFileType::Loaded;
+
+	// only a missing or empty file is created, any other file which can not be opened is left as it is.
+	// the first commits of a new file may only be in its log. a memory database never reads the file, it always starts empty
+	auto& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	bool bIsNewFile = Type == ELowLevelFileType::Memory
+		|| (PlatformFile.FileSize(*FileName) <= 0 && !(Options.bWriteAheadLog && PlatformFile.FileSize(*(FileName + TEXT(".wal"))) > 0));
+	if (bReadOnly && bIsNewFile)
 		return false;
-	else
-		ReadHandle = (Factory.OpenRead(*FileName));
 
-	if (!ReadHandle || !ReadHandle->IsValid())
+	if (!bIsNewFile && !OpenHandles(FileName, bReadOnly, false, Type))
 		return false;
 
-	if (bIsNewFile || !(HeadFile = OpenFile(0)))
+	if (!bIsNewFile && !(HeadFile = OpenFile(0)))
 	{
-		if (bReadOnly)
-			return false;
+		// written by another version or not a database at all
+		if (IsOlderFormat())
+			UE_LOG(LogDatabaseLite, Error, TEXT("%s was written by an older version of the database format, which is not read any more"), *FileName);
+		CloseHandles();
+		return false;
+	}
 
-		ReadHandle.Reset();
-		WriteHandle.Reset();
-		ReadHandle = WriteHandle = Factory.OpenWrite(*FileName, false, true);
+	if (bIsNewFile)
+	{
+		if (!OpenHandles(FileName, false, true, Type))
+			return false;
+		Header.MagicNum = FILE_SYSTEM_MAGIC_NUM;
 		HeadFile = MakeShared<FFile>(this);
 		HeadFile->Init(NewPage());
+		Files.Add(0, HeadFile);
 		//FFileHandleHelper::Write(Header,WriteHandle, 0);
 
 		FlushHeader();
 
 	}
+	else if (!LoadHeader())
+	{
+		HeadFile.Reset();
+		CloseHandles();
+		return false;
+	}
+
+	StaticText = MakeShared<FStaticText>(this);
+
+	return true;
+}
+
+bool FFileSystem::InitSnapshot(FFileSystem& Source)
+{
+	check(Source.MutationDepth == 0);
+	if (Source.WriteHandle)
+	{
+		// without a log the pages are overwritten in place while they are read
+		if (!Source.Log)
+			return false;
+
+		if (!Source.Commit())
+			return false;
+		ReadHandle = MakeShared<FLogSnapshotFile>(Source.Log.Get());
+	}
+	else
+	{
+		ReadHandle = Source.ReadHandle;
+	}
+	BufferPool = Source.BufferPool;
+
+	if (!(HeadFile = OpenFile(0)) || !LoadHeader())
+		return false;
+
+	StaticText = MakeShared<FStaticText>(this);
+	return true;
+}
+
+bool FFileSystem::IsOlderFormat() const
+{
+	int32 MagicNum = 0;
+	if (!ReadHandle->ReadAt(0, (uint8*)&MagicNum, sizeof(MagicNum)))
+		return false;
+	for (auto OlderMagicNum : OLDER_FILE_MAGIC_NUMS)
+	{
+		if (MagicNum == OlderMagicNum)
+			return true;
+	}
+	return false;
+}
+
+bool FFileSystem::LoadHeader()
+{
+	HeadFile->SeekRead(0);
+	if (!HeadFile->Read(Header) || Header.MagicNum != FILE_SYSTEM_MAGIC_NUM)
+		return false;
+
+	for (auto Index : XRange(Header.NamedFileCount))
+	{
+		FString Name;
+		PageId Id;
+		HeadFile->Read(Name);
+		HeadFile->Read(Id);
+		NamedFiles.Add(Name, Id);
+	}
+
+	// only pages are allocated from the bitmaps
+	if (WriteHandle)
+		LoadBitmaps();
+	return true;
+}
+
+void FFileSystem::LoadBitmaps()
+{
+	auto NumBitmaps = (Header.PageCount + PAGES_PER_BITMAP - 1) / PAGES_PER_BITMAP;
+	UsedPages.SetNumUninitialized(NumBitmaps * WORDS_PER_BITMAP);
+	DirtyBitmaps.Init(false, NumBitmaps);
+	for (auto Bitmap : XRange(NumBitmaps))
+	{
+		CHECK_RESULT(FFileHandleHelper::Read(UsedPages.GetData() + Bitmap * WORDS_PER_BITMAP, FILE_PAGE_SIZE, ReadHandle, GetBitmapPage(Bitmap)));
+	}
+	FirstFree = 0;
+}
+
+void FFileSystem::FlushBitmaps()
+{
+	for (auto Bitmap : XRange(DirtyBitmaps.Num()))
+	{
+		if (!DirtyBitmaps[Bitmap])
+			continue;
+		FFileHandleHelper::Write(UsedPages.GetData() + Bitmap * WORDS_PER_BITMAP, FILE_PAGE_SIZE, WriteHandle, GetBitmapPage(Bitmap));
+		DirtyBitmaps[Bitmap] = false;
+	}
+}
+
+bool FFileSystem::OpenHandles(const FString& FileName, bool bReadOnly, bool bTruncate, ELowLevelFileType Type)
+{
+	ILowLevelFile::Ptr Handle;
+	if (Type == ELowLevelFileType::Cached)
+	{
+		BufferPool = bReadOnly ? FBufferPool::OpenRead(FileName, Options.BufferPoolSize) : FBufferPool::OpenWrite(FileName, !bTruncate, true, Options.BufferPoolSize);
+		Handle = BufferPool;
+	}
 	else
 	{
-		HeadFile->Read(Header);
+		auto Factory = GetFactory(Type);
+		Handle = bReadOnly ? Factory.OpenRead(*FileName) : Factory.OpenWrite(*FileName, !bTruncate, true);
+	}
+	if (!Handle || !Handle->IsValid())
+	{
+		BufferPool.Reset();
+		return false;
+	}
 
-		for (auto Index : XRange(Header.NamedFileCount))
+	if (Options.bWriteAheadLog)
+	{
+		Log = MakeShared<FWriteAheadLog>(Handle, FileName + TEXT(".wal"), Options.CheckpointSize);
+		if (!Log->Open(bReadOnly, bTruncate))
 		{
-			FString Name;
-			PageId Id;
-			HeadFile->Read(Name);
-			HeadFile->Read(Id);
-			NamedFiles.Add(Name, Id);
+			Log.Reset();
+			return false;
 		}
+		Handle = Log;
 	}
 
-	StaticText = MakeShared<FStaticText>(this);
+	ReadHandle = Handle;
+	if (!bReadOnly)
+		WriteHandle = Handle;
+	DatabaseFileName = FileName;
+	DatabaseFileType = Type;
+	return true;
+}
+
+TSharedPtr<ILowLevelFile> FFileSystem::OpenReadHandle()
+{
+	// pages of the log are only found through the log itself
+	if (Log || DatabaseFileName.IsEmpty())
+		return ReadHandle;
+
+	ILowLevelFile::Ptr Handle;
+	if (BufferPool)
+	{
+		Handle = MakeShared<FBufferPoolReader>(BufferPool);
+	}
+	else if (DatabaseFileType == ELowLevelFileType::Normal)
+	{
+		auto& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+		Handle = MakeShared<FGenericPlatformFile>(MakeShareable(PlatformFile.OpenRead(*DatabaseFileName, true)));
+	}
+	return Handle && Handle->IsValid() ? Handle : ReadHandle;
+}
 
+void FFileSystem::CloseHandles()
+{
+	if (Log)
+		Log->Close();
+	Log.Reset();
+	ReadHandle.Reset();
+	WriteHandle.Reset();
+	BufferPool.Reset();
+	DatabaseFileName.Reset();
+}
+
+bool FFileSystem::Commit()
+{
+	if (!WriteHandle)
+		return true;
+
+	FlushHeaders();
+	if (!WriteHandle->Flush())
+		return false;
+	PendingMutations = 0;
 	return true;
 }
 
+bool FFileSystem::Checkpoint()
+{
+	check(MutationDepth == 0);
+	if (!WriteHandle)
+		return true;
+
+	if (!Commit() || (Log && !Log->Checkpoint(true)))
+		return false;
+	return WriteHandle->Persist();
+}
+
+void FFileSystem::BeginMutation()
+{
+	MutationDepth++;
+}
+
+void FFileSystem::EndMutation()
+{
+	check(MutationDepth > 0);
+	if (--MutationDepth > 0 || !Log)
+		return;
+
+	// a failed group commit keeps its pages dirty, they are written again by the next commit
+	if (++PendingMutations >= Options.GroupCommitSize)
+		Commit();
+}
+
+void FFileSystem::FlushHeaders()
+{
+	// headers of files are only kept in memory between page allocations
+	for (auto It = Files.CreateIterator(); It; ++It)
+	{
+		if (auto File = It.Value().Pin())
+			File->FlushHeader();
+		else
+			It.RemoveCurrent();
+	}
+	FlushHeader();
+}
+
 FFile::Ptr FFileSystem::OpenFile(PageId Id)
 {
 	auto File = Files.FindRef(Id);
@@ -203,7 +442,7 @@ FFile::Ptr FFileSystem::OpenFile(PageId Id)
 	if (!SharedFile->Open(Id))
 		return {};
 
-	Files.Add(Id, File);
+	Files.Add(Id, SharedFile);
 	return SharedFile;
 }
 
@@ -248,43 +487,134 @@ void FFileSystem::FlushHeader()
 {
 	HeadFile->SeekWrite(0);
 	HeadFile->Write(Header);
+	FlushBitmaps();
 }
 
 PageId FFileSystem::NewPage()
 {
-	PageId NewId;
-	if (Header.FreeList != PAGE_ID_INVALID)
+	uint32 Count = 1;
+	return NewExtent(PAGE_ID_INVALID, Count);
+}
+
+PageId FFileSystem::NewExtent(PageId Hint, uint32& Count)
+{
+	check(Count > 0);
+	PageId Begin = Hint;
+	if (Hint == PAGE_ID_INVALID || Hint > Header.PageCount || (Hint < Header.PageCount && IsPageUsed(Hint)))
+		Begin = FindFreePages(Count);
+	if (Begin == PAGE_ID_INVALID || Begin >= Header.PageCount)
+		Begin = GrowPages();
+
+	// pages are not filled, a new page holds whatever was there before
+	uint32 Taken = 0;
+	for (PageId Id = Begin; Taken < Count; ++Id)
 	{
-		PageId Next;
-		FFileHandleHelper::Read(Next, ReadHandle, Header.FreeList);
-		NewId = Header.FreeList;
-		Header.FreeList = Next;
+		// the pages behind are grown one by one, a bitmap page ends the extent
+		if (Id == Header.PageCount && GrowPages() != Id)
+			break;
+		if (IsPageUsed(Id))
+			break;
+		SetPageUsed(Id, true);
+		++Taken;
+	}
+	Count = Taken;
+	return Begin;
+}
+
+void FFileSystem::RecyclePage(PageId Id)
+{
+	if (Id == PAGE_ID_INVALID)
+		return ;
+
+	check(IsPageUsed(Id));
+	SetPageUsed(Id, false);
+}
+
+bool FFileSystem::IsPageUsed(PageId Id) const
+{
+	auto Word = (int32)(Id / 64);
+	return Word < UsedPages.Num() && (UsedPages[Word] & (1ull << (Id % 64))) != 0;
+}
+
+void FFileSystem::SetPageUsed(PageId Id, bool bUsed)
+{
+	auto Word = (int32)(Id / 64);
+	check(Word < UsedPages.Num());
+	if (bUsed)
+	{
+		UsedPages[Word] |= 1ull << (Id % 64);
+		if (Id == FirstFree)
+			++FirstFree;
 	}
 	else
 	{
-		NewId = Header.PageCount++;
+		UsedPages[Word] &= ~(1ull << (Id % 64));
+		FirstFree = FMath::Min(FirstFree, Id);
 	}
-	
-
-	GUARD_WRITE();
+	DirtyBitmaps[Id / PAGES_PER_BITMAP] = true;
+}
 
-	WriteHandle->Seek(GetPageOffset(NewId));
-	uint32 Zero[1024] = {};
-	FMemory::Memset(Zero, 0xcd, sizeof(Zero));
-	for (uint32 i = 0; i < FILE_PAGE_SIZE / sizeof(Zero); ++i)
+PageId FFileSystem::FindFreePages(uint32 Count) const
+{
+	PageId RunBegin = PAGE_ID_INVALID;
+	uint32 RunLength = 0;
+	for (PageId Id = FirstFree; Id < Header.PageCount;)
 	{
-		WriteHandle->Write((const uint8*)Zero, sizeof(Zero));
+		auto Word = UsedPages[Id / 64];
+		if (Id % 64 == 0 && Word == ~0ull)
+		{
+			// whole words in use are passed over
+			RunLength = 0;
+			Id += 64;
+			continue;
+		}
+
+		if (Word & (1ull << (Id % 64)))
+		{
+			RunLength = 0;
+		}
+		else
+		{
+			if (RunLength++ == 0)
+				RunBegin = Id;
+			if (RunLength == Count)
+				return RunBegin;
+		}
+		++Id;
 	}
-	return NewId;
+	return RunLength > 0 ? RunBegin : PAGE_ID_INVALID;
 }
 
-void FFileSystem::RecyclePage(PageId Id)
+PageId FFileSystem::GrowPages()
 {
-	if (Id == PAGE_ID_INVALID)
-		return ;
+	PageId NewId = Header.PageCount;
+	while (true)
+	{
+		// a new range of pages starts with a bitmap of its own
+		auto Bitmap = (int32)(NewId / PAGES_PER_BITMAP);
+		if (Bitmap == DirtyBitmaps.Num())
+		{
+			UsedPages.AddZeroed(WORDS_PER_BITMAP);
+			DirtyBitmaps.Add(true);
+			SetPageUsed(GetBitmapPage(Bitmap), true);
+		}
+		if (!IsPageUsed(NewId))
+			break;
+		++NewId;
+	}
+	checkf(NewId < MAX_PAGE_COUNT, TEXT("database file is limited to %u pages"), MAX_PAGE_COUNT);
+	Header.PageCount = NewId + 1;
 
-	FFileHandleHelper::Write(Header.FreeList, ReadHandle, Id);
-	Header.FreeList = Id;
+	// the file grows in extents, so that appending pages neither writes nor fragments it page by page
+	auto End = FMath::Max(Header.PageCount, GetBitmapPage(DirtyBitmaps.Num() - 1) + 1);
+	if (End > Header.FileEnd)
+	{
+		auto Extent = FMath::Clamp(Header.FileEnd / 8, MIN_PREALLOCATE_PAGES, MAX_PREALLOCATE_PAGES);
+		auto NewEnd = (PageId)FMath::Min<uint64>(FMath::Max<uint64>(End, (uint64)Header.FileEnd + Extent), MAX_PAGE_COUNT);
+		CHECK_RESULT(WriteHandle->Preallocate(GetPageOffset(Header.FileEnd), GetPageOffset(NewEnd) - GetPageOffset(Header.FileEnd)));
+		Header.FileEnd = NewEnd;
+	}
+	return NewId;
 }
 
 
@@ -299,8 +629,6 @@ FFile::~FFile()
 	FlushHeader();
 }
 
-constexpr int32 FILE_MAGIC_NUM = 0xF11e;
-
 bool FFile::Open(PageId BeginId)
 {
 	FFileHandleHelper::Read(FileHeader, System->ReadHandle, BeginId);
@@ -311,28 +639,22 @@ bool FFile::Open(PageId BeginId)
 	}
 
 	check(FileHeader.IndexPages[0] == BeginId);
-	Pages.Reserve(FileHeader.DataPageCount);
+	Pages.SetNumUninitialized(FileHeader.DataPageCount);
 
-	int Index = 0;
-	auto IndexPage = FileHeader.IndexPages[Index];
-	auto Beg = GetPageOffset(IndexPage) + sizeof(FileHeader);
-	auto End = GetPageOffset(IndexPage + 1);
-	for(auto DataIndex: XRange(FileHeader.DataPageCount))
+	// read the page ids of every index page in one go
+	uint32 Loaded = 0;
+	for (uint32 Index = 0; Loaded < FileHeader.DataPageCount; ++Index)
 	{
-		PageId Id;
-		System->ReadHandle->Read((uint8*) & Id, sizeof(Id));
-		Pages.Add(Id);
-		Beg += sizeof(Id);
-
-		if (Beg >= End)
-		{
-			check(Index < SINGLE_FILE_INDEX_PAGE_COUNT)
-			IndexPage = FileHeader.IndexPages[++Index];
-			check( IndexPage != PAGE_ID_INVALID )
-			Beg = GetPageOffset(IndexPage);
-			End = GetPageOffset(IndexPage + 1);
-			System->ReadHandle->Seek(Beg);
-		}
+		check(Index < FileHeader.IndexPageCount);
+		auto IndexPage = GetIndexPage(Index);
+		check(IndexPage != PAGE_ID_INVALID);
+
+		auto Beg = GetPageOffset(IndexPage) + (Index == 0 ? sizeof(FileHeader) : 0);
+		auto End = GetPageOffset(IndexPage + 1);
+		auto Count = FMath::Min<uint32>((End - Beg) / sizeof(PageId), FileHeader.DataPageCount - Loaded);
+		if (!System->ReadHandle->ReadAt(Beg, (uint8*)(Pages.GetData() + Loaded), Count * sizeof(PageId)))
+			return false;
+		Loaded += Count;
 	}
 	return true;
 }
@@ -342,11 +664,15 @@ void FFile::Init(PageId BeginId)
 	FileHeader.MagicNum = FILE_MAGIC_NUM;
 	FileHeader.DataPageCount = 0;
 	FMemory::Memset(FileHeader.IndexPages, 0xff, sizeof(FileHeader.IndexPages));
+	FMemory::Memset(FileHeader.IndirectPages, 0xff, sizeof(FileHeader.IndirectPages));
 	FileHeader.IndexPages[0] = BeginId;
+	FileHeader.IndexPageCount = 1;
 	FileHeader.DataEnd = 0;
 	FileHeader.IndexEnd = GetPageOffset(BeginId) + sizeof(FileHeader) ;
+	FileHeader.ExtentBegin = PAGE_ID_INVALID;
+	FileHeader.ExtentPages = 0;
 	FFileHandleHelper::Write(FileHeader,System->WriteHandle, BeginId);
-	System->WriteHandle->Write((const uint8*)&PAGE_ID_INVALID, sizeof(PAGE_ID_INVALID));
+	FFileHandleHelper::Write(PAGE_ID_INVALID, System->WriteHandle, BeginId, sizeof(FileHeader));
 
 	AppendPage();
 }
@@ -356,12 +682,11 @@ void FFile::Delete()
 	FileHeader.MagicNum = 0xdeaddead;
 	FlushHeader();
 
-	for (auto Id : FileHeader.IndexPages)
+	// the indirect pages list the index pages, collect them before any is recycled
+	TArray<PageId> IndexPages;
+	for (auto Index : XRange(FileHeader.IndexPageCount))
 	{
-		if (Id != PAGE_ID_INVALID)
-			System->RecyclePage(Id);
-
-		break;
+		IndexPages.Add(GetIndexPage(Index));
 	}
 
 	for (auto Id : Pages)
@@ -369,6 +694,21 @@ void FFile::Delete()
 		System->RecyclePage(Id);
 	}
 
+	for (auto Id : IndexPages)
+	{
+		System->RecyclePage(Id);
+	}
+
+	for (auto Id : FileHeader.IndirectPages)
+	{
+		System->RecyclePage(Id);
+	}
+
+	for (auto Index : XRange(FileHeader.ExtentPages))
+	{
+		System->RecyclePage(FileHeader.ExtentBegin + Index);
+	}
+
 	System = nullptr;
 
 }
@@ -377,14 +717,12 @@ void FFile::SeekRead(VirtualPos Pos)
 {
 	check(Pos <= GetDataEnd())
 	ReadPos = Pos;
-	System->ReadHandle->Seek(GetRealPos(Pos));
 }
 
 void FFile::SeekWrite(VirtualPos Pos)
 {
 	check(Pos <= GetDataEnd())
 	WritePos = Pos;
-	System->WriteHandle->Seek(GetRealPos(Pos));
 }
 
 FFile::VirtualPos FFile::TellRead() const
@@ -414,60 +752,72 @@ void FFile::SkipWrite(VirtualPos Size)
 
 bool FFile::Write(const void* Data, uint32 Size)
 {
-	auto Index = (WritePos / FILE_PAGE_SIZE);
-	auto Offset = WritePos % FILE_PAGE_SIZE;
-	auto Space = FILE_PAGE_SIZE - Offset;
-	if (Space < Size)
+	if (!WriteAt(WritePos, Data, Size))
+		return false;
+	WritePos += Size;
+	return true;
+}
+
+bool FFile::Read(void* Data, uint32 Size)
+{
+	if (!ReadAt(ReadPos, Data, Size))
+		return false;
+	ReadPos += Size;
+	return true;
+}
+
+bool FFile::WriteAt(VirtualPos Pos, const void* Data, uint32 Size)
+{
+	check(!bReader);
+	auto Buffer = (const uint8*)Data;
+	while (Size > 0)
 	{
-		auto Diff = Size - Space;
-		if (!Write(Data, Space))
+		auto Index = (int32)(Pos / FILE_PAGE_SIZE);
+		auto Offset = (uint32)(Pos % FILE_PAGE_SIZE);
+		auto Count = FMath::Min(FILE_PAGE_SIZE - Offset, Size);
+		if (Index == Pages.Num())
+		{
+			check(Offset == 0);
+			AppendPage();
+		}
+		check(Index < Pages.Num())
+
+		if (!System->WriteHandle->WriteAt(GetPageOffset(Pages[Index]) + Offset, Buffer, Count))
 			return false;
 
-		return Write((const uint8*)Data + Space, Diff);
-	}
-	else if (Space == Size && Index == Pages.Num() - 1)
-	{
-		AppendPage();
-	}
-	else if (Index == Pages.Num() )
-	{
-		check(Offset == 0);
-		AppendPage();
-	}
-	else 
-	{
-		check(Index < (uint32)Pages.Num())
-	}
-	WritePos += Size;
+		Pos += Count;
+		Buffer += Count;
+		Size -= Count;
+		FileHeader.DataEnd = FMath::Max(Pos, FileHeader.DataEnd);
 
-	FileHeader.DataEnd = FMath::Max(WritePos, FileHeader.DataEnd);
-	System->WriteHandle->Seek(GetPageOffset(Pages[Index]) + Offset);
-	return System->WriteHandle->Write((const uint8*)Data, Size);
+		// always keep a page behind the data so that seeking to the end is valid
+		if (Offset + Count == FILE_PAGE_SIZE && Index == Pages.Num() - 1)
+			AppendPage();
+	}
+	return true;
 }
 
-bool FFile::Read(void* Data, uint32 Size)
+bool FFile::ReadAt(VirtualPos Pos, void* Data, uint32 Size) const
 {
-	auto Index = (ReadPos / FILE_PAGE_SIZE);
-	if (Index >= (uint32)Pages.Num())
-		return false;
-	auto Offset = ReadPos % FILE_PAGE_SIZE;
-	auto Space = FILE_PAGE_SIZE - Offset;
-	if (Space < Size)
+	DetectSequential(Pos, Size);
+
+	auto Buffer = (uint8*)Data;
+	while (Size > 0)
 	{
-		//Index += 1;
-		//Offset = 0;
-		//check(Index < (uint32)Pages.Num());
-		//ReadPos = Index * FILE_PAGE_SIZE;
+		auto Index = Pos / FILE_PAGE_SIZE;
+		if (Index >= (uint64)Pages.Num())
+			return false;
+		auto Offset = (uint32)(Pos % FILE_PAGE_SIZE);
+		auto Count = FMath::Min(FILE_PAGE_SIZE - Offset, Size);
 
-		auto Diff = Size - Space;
-		if (!Read(Data, Space))
+		if (!GetReadHandle().ReadAt(GetPageOffset(Pages[Index]) + Offset, Buffer, Count))
 			return false;
 
-		return Read((uint8*) Data + Space, Diff);
+		Pos += Count;
+		Buffer += Count;
+		Size -= Count;
 	}
-	ReadPos += Size;
-	System->ReadHandle->Seek(GetPageOffset(Pages[Index]) + Offset);
-	return System->ReadHandle->Read((uint8*)Data, Size);
+	return true;
 }
 
 bool FFile::Write(const FString& String)
@@ -506,27 +856,25 @@ bool FFile::ReadStaticString(FString& String)
 
 PageId FFile::AppendPage()
 {
-	auto Id = System->NewPage();
+	// the data pages of a file are taken in extents, which keeps them in a row even while other files grow
+	if (FileHeader.ExtentPages == 0)
+	{
+		FileHeader.ExtentPages = FMath::Clamp<uint32>(Pages.Num() / 4, 1, MAX_EXTENT_PAGES);
+		FileHeader.ExtentBegin = System->NewExtent((Pages.Num() > 0 ? Pages.Last() : FileHeader.IndexPages[0]) + 1, FileHeader.ExtentPages);
+	}
+	auto Id = FileHeader.ExtentBegin++;
+	FileHeader.ExtentPages--;
 	Pages.Add(Id);
 	FileHeader.DataPageCount++;
 	
 
-	System->WriteHandle->Seek(FileHeader.IndexEnd);
-	System->WriteHandle->Write((const uint8*)&Id, sizeof(Id));
+	System->WriteHandle->WriteAt(FileHeader.IndexEnd, (const uint8*)&Id, sizeof(Id));
 
 	if ((FileHeader.IndexEnd + sizeof(Id)) / FILE_PAGE_SIZE != FileHeader.IndexEnd / FILE_PAGE_SIZE)
 	{
 		check((FileHeader.IndexEnd + sizeof(Id)) % FILE_PAGE_SIZE == 0);
-		auto Index = 0;
-		for (; Index < SINGLE_FILE_INDEX_PAGE_COUNT; Index++)
-		{
-			if (FileHeader.IndexPages[Index] == PAGE_ID_INVALID)
-				break;
-		}
-
-		checkf(Index > 0 && Index < SINGLE_FILE_INDEX_PAGE_COUNT, TEXT("single table is limit to %d bytes"), FILE_PAGE_SIZE / sizeof(PageId) * SINGLE_FILE_INDEX_PAGE_COUNT * FILE_PAGE_SIZE);
 		auto IndexPage = System->NewPage();
-		FileHeader.IndexPages[Index] = IndexPage;
+		AddIndexPage(IndexPage);
 		FileHeader.IndexEnd = GetPageOffset(IndexPage);
 	}
 	else
@@ -534,8 +882,7 @@ PageId FFile::AppendPage()
 		FileHeader.IndexEnd += sizeof(Id);
 	}
 
-	System->WriteHandle->Seek(FileHeader.IndexEnd);
-	System->WriteHandle->Write((const uint8*)&PAGE_ID_INVALID, sizeof(PAGE_ID_INVALID));
+	System->WriteHandle->WriteAt(FileHeader.IndexEnd, (const uint8*)&PAGE_ID_INVALID, sizeof(PAGE_ID_INVALID));
 
 
 	FlushHeader();
@@ -543,24 +890,206 @@ PageId FFile::AppendPage()
 	return Id;
 }
 
+void FFile::Reserve(VirtualPos Size)
+{
+	while (GetDataEnd() < Size)
+	{
+		AppendPage();
+	}
+}
+
+void FFile::Truncate(VirtualPos Size)
+{
+	FileHeader.DataEnd = FMath::Min(FileHeader.DataEnd, Size);
+	ReadPos = FMath::Min(ReadPos, Size);
+	WritePos = FMath::Min(WritePos, Size);
+
+	// like writing, keep a page behind the data
+	auto KeepPages = (int32)(Size / FILE_PAGE_SIZE) + 1;
+	if (KeepPages >= Pages.Num())
+	{
+		FlushHeader();
+		return;
+	}
+
+	for (auto Index : XRange(KeepPages, Pages.Num()))
+	{
+		System->RecyclePage(Pages[Index]);
+	}
+	Pages.SetNum(KeepPages, false);
+	FileHeader.DataPageCount = KeepPages;
+
+	// find the slot of the next page id the same way AppendPage fills them
+	const uint32 Slot = FileHeader.DataPageCount;
+	const uint32 FirstIndexCapacity = (FILE_PAGE_SIZE - sizeof(FileHeader)) / PAGE_ID_STRIDE;
+	uint32 IndexPageCount;
+	if (Slot < FirstIndexCapacity)
+	{
+		IndexPageCount = 1;
+		FileHeader.IndexEnd = GetPageOffset(FileHeader.IndexPages[0]) + sizeof(FileHeader) + Slot * PAGE_ID_STRIDE;
+	}
+	else
+	{
+		auto Rest = Slot - FirstIndexCapacity;
+		IndexPageCount = 2 + Rest / PAGE_IDS_PER_PAGE;
+		FileHeader.IndexEnd = GetPageOffset(GetIndexPage(IndexPageCount - 1)) + (Rest % PAGE_IDS_PER_PAGE) * PAGE_ID_STRIDE;
+	}
+
+	// the indirect pages list the index pages, collect them before any is recycled
+	TArray<PageId> IndexPages;
+	for (auto Index : XRange(IndexPageCount, FileHeader.IndexPageCount))
+	{
+		IndexPages.Add(GetIndexPage(Index));
+		if (Index < SINGLE_FILE_INDEX_PAGE_COUNT)
+			FileHeader.IndexPages[Index] = PAGE_ID_INVALID;
+	}
+
+	const uint32 IndirectCount = IndexPageCount > SINGLE_FILE_INDEX_PAGE_COUNT ? (IndexPageCount - SINGLE_FILE_INDEX_PAGE_COUNT + PAGE_IDS_PER_PAGE - 1) / PAGE_IDS_PER_PAGE : 0;
+	for (auto Index : XRange(IndirectCount, SINGLE_FILE_INDIRECT_PAGE_COUNT))
+	{
+		IndexPages.Add(FileHeader.IndirectPages[Index]);
+		FileHeader.IndirectPages[Index] = PAGE_ID_INVALID;
+	}
+
+	for (auto Id : IndexPages)
+	{
+		System->RecyclePage(Id);
+	}
+	FileHeader.IndexPageCount = IndexPageCount;
+
+	System->WriteHandle->WriteAt(FileHeader.IndexEnd, (const uint8*)&PAGE_ID_INVALID, sizeof(PAGE_ID_INVALID));
+	FlushHeader();
+}
+
+FFile::Ptr FFile::OpenReader(TSharedPtr<ILowLevelFile> Handle) const
+{
+	auto Reader = MakeShared<FFile>(System);
+	Reader->Pages = Pages;
+	Reader->FileHeader = FileHeader;
+	Reader->bReader = true;
+	Reader->ReaderHandle = Handle;
+	return Reader;
+}
+
+ILowLevelFile& FFile::GetReadHandle() const
+{
+	return ReaderHandle ? *ReaderHandle : *System->ReadHandle;
+}
+
+void FFile::Prefetch(VirtualPos Pos, VirtualPos Size) const
+{
+	auto Begin = (int32)FMath::Min<VirtualPos>(Pos / FILE_PAGE_SIZE, Pages.Num());
+	auto End = (int32)FMath::Min<VirtualPos>((Pos + Size + FILE_PAGE_SIZE - 1) / FILE_PAGE_SIZE, Pages.Num());
+	PrefetchPages(Begin, End);
+}
+
+const uint8* FFile::Pin(VirtualPos Pos, uint32 Size) const
+{
+	auto Index = Pos / FILE_PAGE_SIZE;
+	auto Offset = (uint32)(Pos % FILE_PAGE_SIZE);
+	if (Index >= (uint64)Pages.Num() || Offset + Size > FILE_PAGE_SIZE)
+		return nullptr;
+
+	return GetReadHandle().Pin(GetPageOffset(Pages[Index]) + Offset, Size);
+}
+
+void FFile::Unpin(VirtualPos Pos) const
+{
+	GetReadHandle().Unpin(GetPageOffset(Pages[Pos / FILE_PAGE_SIZE]) + Pos % FILE_PAGE_SIZE);
+}
+
+void FFile::DetectSequential(VirtualPos Pos, uint32 Size) const
+{
+	const int32 ReadAhead = System->Options.ReadAheadPages;
+	if (ReadAhead == 0)
+		return;
+
+	const VirtualPos ReadEnd = Pos + Size;
+	const auto LastEnd = (VirtualPos)LastReadEnd.Set((int64)ReadEnd);
+	// a couple of reads in a row before the first window
+	if (Pos < LastEnd || Pos - LastEnd >= FILE_PAGE_SIZE)
+	{
+		SequentialReads.Reset();
+		PrefetchEnd.Reset();
+		return;
+	}
+	if (SequentialReads.Increment() < 2)
+		return;
+
+	// the next window goes out when half of the last one has been read
+	auto Page = (int32)(ReadEnd / FILE_PAGE_SIZE);
+	auto LastPrefetchEnd = PrefetchEnd.GetValue();
+	if (Page + ReadAhead / 2 < LastPrefetchEnd)
+		return;
+
+	auto Begin = FMath::Max(Page + 1, LastPrefetchEnd);
+	auto End = FMath::Min(Page + 1 + ReadAhead, Pages.Num());
+	if (Begin >= End)
+		return;
+
+	PrefetchEnd.Set(End);
+	PrefetchPages(Begin, End);
+}
+
+void FFile::PrefetchPages(int32 Begin, int32 End) const
+{
+	while (Begin < End)
+	{
+		auto Run = Begin + 1;
+		while (Run < End && Pages[Run] == Pages[Run - 1] + 1)
+			++Run;
+
+		GetReadHandle().Prefetch(GetPageOffset(Pages[Begin]), (uint64)(Run - Begin) * FILE_PAGE_SIZE);
+		Begin = Run;
+	}
+}
 
 FFile::RealPos FFile::GetRealPos(VirtualPos Pos)
 {
-	auto Index = (Pos / FILE_PAGE_SIZE);
-	check(Index < (uint32)Pages.Num());
+	auto Index = Pos / FILE_PAGE_SIZE;
+	check(Index < (uint64)Pages.Num());
 	auto Offset = Pos % FILE_PAGE_SIZE;
-	return GetPageOffset(Pages[Index]) + Offset;
+	return GetPageOffset(Pages[(int32)Index]) + Offset;
 }
 
 FFile::VirtualPos FFile::GetDataEnd()
 {
-	return Pages.Num() * FILE_PAGE_SIZE;
+	return (VirtualPos)Pages.Num() * FILE_PAGE_SIZE;
+}
+
+PageId FFile::GetIndexPage(uint32 Index) const
+{
+	if (Index < SINGLE_FILE_INDEX_PAGE_COUNT)
+		return FileHeader.IndexPages[Index];
+
+	Index -= SINGLE_FILE_INDEX_PAGE_COUNT;
+	check(Index / PAGE_IDS_PER_PAGE < SINGLE_FILE_INDIRECT_PAGE_COUNT);
+	PageId Id = PAGE_ID_INVALID;
+	FFileHandleHelper::Read(Id, System->ReadHandle, FileHeader.IndirectPages[Index / PAGE_IDS_PER_PAGE], (Index % PAGE_IDS_PER_PAGE) * PAGE_ID_STRIDE);
+	return Id;
+}
+
+void FFile::AddIndexPage(PageId Id)
+{
+	auto Index = FileHeader.IndexPageCount++;
+	if (Index < SINGLE_FILE_INDEX_PAGE_COUNT)
+	{
+		FileHeader.IndexPages[Index] = Id;
+		return;
+	}
+
+	Index -= SINGLE_FILE_INDEX_PAGE_COUNT;
+	auto Indirect = Index / PAGE_IDS_PER_PAGE;
+	checkf(Indirect < SINGLE_FILE_INDIRECT_PAGE_COUNT, TEXT("single file is limited to %llu index pages"), (uint64)SINGLE_FILE_INDEX_PAGE_COUNT + SINGLE_FILE_INDIRECT_PAGE_COUNT * PAGE_IDS_PER_PAGE);
+	if (Index % PAGE_IDS_PER_PAGE == 0)
+		FileHeader.IndirectPages[Indirect] = System->NewPage();
+	FFileHandleHelper::Write(Id, System->WriteHandle, FileHeader.IndirectPages[Indirect], (Index % PAGE_IDS_PER_PAGE) * PAGE_ID_STRIDE);
 }
 
 
 void FFile::FlushHeader()
 {
-	if (System && System->WriteHandle)
+	if (System && System->WriteHandle && !bReader)
 		FFileHandleHelper::Write(FileHeader, System->WriteHandle, FileHeader.IndexPages[0]);
 }
 
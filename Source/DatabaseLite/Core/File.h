@@ -2,24 +2,50 @@
 
 #include "CoreMinimal.h"
 #include "LowLevelFile.h"
+#include "HAL/ThreadSafeCounter64.h"
 
 using PageId = uint32;
 constexpr static uint32 FILE_PAGE_SIZE = 16 * 1024;
 constexpr static uint32 PAGE_ID_STRIDE = sizeof(PageId);
 constexpr static uint32 MAX_PAGE_COUNT = ~((PageId)0);
-constexpr static uint32 MAX_DB_FILE_SIZE = FILE_PAGE_SIZE * MAX_PAGE_COUNT;
+constexpr static uint64 MAX_DB_FILE_SIZE = (uint64)FILE_PAGE_SIZE * MAX_PAGE_COUNT;
+constexpr static uint32 PAGE_IDS_PER_PAGE = FILE_PAGE_SIZE / PAGE_ID_STRIDE;
 constexpr static uint32 SINGLE_FILE_INDEX_PAGE_COUNT = 8;
+// every indirect page lists PAGE_IDS_PER_PAGE more index pages, about 256GB of data each
+constexpr static uint32 SINGLE_FILE_INDIRECT_PAGE_COUNT = 4;
 constexpr static PageId PAGE_ID_INVALID = ~((PageId)0);
 
+DECLARE_LOG_CATEGORY_EXTERN(LogDatabaseLite, Log, All);
+
+
+struct FFileSystemOptions
+{
+	// keep page changes in memory and append them to "<FileName>.wal" when committing
+	bool bWriteAheadLog = false;
+	// number of top level mutations grouped into one commit
+	uint32 GroupCommitSize = 1024;
+	// log size which starts a background checkpoint
+	uint64 CheckpointSize = 64 * 1024 * 1024;
+	// memory of the page pool shared by all tables of a ELowLevelFileType::Cached database,
+	// FBufferPool::SetCapacity changes it while the database is open
+	uint64 BufferPoolSize = 2 * 1024 * 1024;
+	// pages prefetched ahead of a file which is read front to back, 0 turns read-ahead off
+	uint32 ReadAheadPages = 32;
+};
+
 
 class FFileSystem;
+/*
+	a file is used by one thread at a time. only the const reads (ReadAt, Pin, Unpin, Prefetch) may come from
+	several threads at once while nothing writes, a thread which wants a read position of its own takes OpenReader
+*/
 class FFile
 {
 	friend class FFileSystem;
 public:
 	using Ptr = TSharedPtr<FFile>;
-	using VirtualPos = uint32;
-	using RealPos = uint32;
+	using VirtualPos = uint64;
+	using RealPos = uint64;
 	using PagePos = TPair<PageId, uint32>;
 public:
 	FFile(FFileSystem* FileSys);
@@ -41,6 +67,10 @@ public:
 	bool Write(const void* Data, uint32 Size);
 	bool Read(void* Buffer, uint32 Size);
 
+	// positional access, the read and write cursors are not touched
+	bool WriteAt(VirtualPos Pos, const void* Data, uint32 Size);
+	bool ReadAt(VirtualPos Pos, void* Buffer, uint32 Size) const;
+
 	bool Write(const FString& String);
 	bool Read(FString& String);
 
@@ -59,30 +89,80 @@ public:
 		return Read(&Value, sizeof(Value));
 	}
 
+	template<class T>
+	bool WriteAt(VirtualPos Pos, const T& Value)
+	{
+		return WriteAt(Pos, &Value, sizeof(Value));
+	}
+
+	template<class T>
+	bool ReadAt(VirtualPos Pos, T& Value) const
+	{
+		return ReadAt(Pos, &Value, sizeof(Value));
+	}
+
 	FFileSystem* GetFileSystem(){return System;}
 	PageId GetId(){return FileHeader.IndexPages[0];};
 	PageId AppendPage();
+	// makes sure pages exist up to Size, so that writes may start behind the end of the data
+	void Reserve(VirtualPos Size);
+	// gives the pages behind Size back to the file system
+	void Truncate(VirtualPos Size);
+	// hint that the range is read soon, sequential reads are detected without it
+	void Prefetch(VirtualPos Pos, VirtualPos Size) const;
+	// the bytes in place if they lie in one page and the handle supports it, see ILowLevelFile::Pin
+	const uint8* Pin(VirtualPos Pos, uint32 Size) const;
+	void Unpin(VirtualPos Pos) const;
+	// a copy of the file for reading on another thread, with read positions and read-ahead of its own.
+	// it reads through Handle when one is given, see FFileSystem::OpenReadHandle. it never writes and is only valid
+	// while the file is not changed
+	Ptr OpenReader(TSharedPtr<ILowLevelFile> Handle = nullptr) const;
 
 private:
 	RealPos GetRealPos(VirtualPos Pos);
 	VirtualPos GetDataEnd();
+	PageId GetIndexPage(uint32 Index) const;
+	void AddIndexPage(PageId Id);
 	void FlushHeader();
+	void DetectSequential(VirtualPos Pos, uint32 Size) const;
+	// prefetches the data pages [Begin, End), neighbouring page ids with one hint
+	void PrefetchPages(int32 Begin, int32 End) const;
+	// the handle of a reader or the one of the file system
+	ILowLevelFile& GetReadHandle() const;
 private:
 
 	FFileSystem* System;
 	TArray<PageId> Pages;
 
+	/*
+		the ids of the data pages are listed in index pages, the first index page is the page of the header.
+		the first SINGLE_FILE_INDEX_PAGE_COUNT index pages are kept in the header, the others in indirect pages
+	*/
 	struct FFileHeader
 	{
 		int32 MagicNum;
+		PageId DataPageCount;
 		VirtualPos DataEnd;
+		// where the id of the next data page goes
 		RealPos IndexEnd;
-		PageId DataPageCount;
+		uint32 IndexPageCount;
 		PageId IndexPages[SINGLE_FILE_INDEX_PAGE_COUNT];
+		PageId IndirectPages[SINGLE_FILE_INDIRECT_PAGE_COUNT];
+		// pages taken from the file system for the next data pages, they are given back when the file is deleted
+		PageId ExtentBegin;
+		uint32 ExtentPages;
 	}FileHeader;
 
 	VirtualPos ReadPos = {};
 	VirtualPos WritePos = {};
+	bool bReader = false;
+	TSharedPtr<ILowLevelFile> ReaderHandle;
+
+	// read-ahead state, reads starting at most a page behind the end of the last one count as sequential.
+	// threads reading at once only disturb the detection of each other
+	mutable FThreadSafeCounter64 LastReadEnd;
+	mutable FThreadSafeCounter SequentialReads;
+	mutable FThreadSafeCounter PrefetchEnd;
 
 };
 
@@ -91,38 +171,101 @@ class FFileSystem
 {
 public:
 	friend class FFile;
+
+	// mutations inside the outermost scope are never split by a commit
+	class FMutationScope
+	{
+	public:
+		FMutationScope(FFileSystem* InSystem) : System(InSystem) { System->BeginMutation(); }
+		~FMutationScope() { System->EndMutation(); }
+	private:
+		FFileSystem* System;
+	};
 public:
 	FFileSystem();
 	~FFileSystem();
 
-	bool Init(const FString& FileName, bool bReadOnly , ELowLevelFileType Type);
+	bool Init(const FString& FileName, bool bReadOnly , ELowLevelFileType Type, const FFileSystemOptions& InOptions = {});
+	// read-only view of the last commit of Source, it may be used on another thread while Source keeps writing,
+	// a writable Source needs the write-ahead log
+	bool InitSnapshot(FFileSystem& Source);
+	// write out all headers and make the changes durable, false when they could not be written
+	bool Commit();
+	// commits and writes everything back to the database file, the log is emptied and a ELowLevelFileType::Loaded
+	// database replaces its file
+	bool Checkpoint();
+	// write back everything and release the database, every file has to be closed first.
+	// false when the changes could not be written, the destructor closes as well but can not tell
+	bool Close();
 
 	FFile::Ptr OpenFile(PageId Id);
 	FFile::Ptr OpenFile(const FString& Name);
 	FFile::Ptr NewFile();
 	FFile::Ptr NewFile(const FString& Name);
 	class FStaticText& GetStaticText(){return *StaticText;}
+	// null unless the database is ELowLevelFileType::Cached
+	class FBufferPool* GetBufferPool(){return BufferPool.Get();}
 	bool IsReadOnly()const {return !WriteHandle;}
+	// a handle for reading on another thread, it does not wait for the readers on other handles.
+	// a database with the write-ahead log, one served from memory and a snapshot only have the one they share
+	TSharedPtr<ILowLevelFile> OpenReadHandle();
 
 private:
+	bool OpenHandles(const FString& FileName, bool bReadOnly, bool bTruncate, ELowLevelFileType Type);
+	void CloseHandles();
+	// the first file header is one of an earlier version of the format
+	bool IsOlderFormat() const;
+	bool LoadHeader();
 	void FlushHeader();
+	void FlushHeaders();
 	PageId NewPage();
+	// up to Count free pages in a row, beginning at Hint if it is free. Count is set to the number of pages taken
+	PageId NewExtent(PageId Hint, uint32& Count);
 	void RecyclePage(PageId Id);
+
+	bool IsPageUsed(PageId Id) const;
+	void SetPageUsed(PageId Id, bool bUsed);
+	// first of Count free pages in a row, a run reaching the end of the used pages may go on behind it
+	PageId FindFreePages(uint32 Count) const;
+	// the next page behind the used ones, the file is preallocated in extents ahead of it
+	PageId GrowPages();
+	void LoadBitmaps();
+	void FlushBitmaps();
+
+	void BeginMutation();
+	void EndMutation();
 private:
 
 	struct 
 	{
+		int32 MagicNum = 0;
 		uint32 NamedFileCount = 0;
+		// pages below it are in use or free in the bitmaps
 		uint32 PageCount = 0;
-		PageId FreeList = PAGE_ID_INVALID;
-		
+		// pages the database file has been grown to
+		uint32 FileEnd = 0;
 	}Header;
 
+	// one bit per page, set while it is in use. the bits of every PAGES_PER_BITMAP pages are kept on a page of their own
+	TArray<uint64> UsedPages;
+	TArray<bool> DirtyBitmaps;
+	// there is no free page below it, it moves with every page taken or given back
+	PageId FirstFree = 0;
+
 	FFile::Ptr HeadFile;
 	TMap<PageId, TWeakPtr<FFile>> Files;
 	TMap<FString, PageId> NamedFiles;
 	TSharedPtr<ILowLevelFile> ReadHandle;
 	TSharedPtr<ILowLevelFile> WriteHandle;
+	TSharedPtr<class FWriteAheadLog> Log;
+	TSharedPtr<class FBufferPool> BufferPool;
+
+	// of the open handles, OpenReadHandle opens others on it
+	FString DatabaseFileName;
+	ELowLevelFileType DatabaseFileType = ELowLevelFileType::Normal;
+	FFileSystemOptions Options;
+	int32 MutationDepth = 0;
+	uint32 PendingMutations = 0;
 
 	TSharedPtr<class FStaticText> StaticText;
 };
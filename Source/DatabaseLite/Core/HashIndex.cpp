@@ -0,0 +1,445 @@
+#include "HashIndex.h"
+#include "Range.h"
+
+constexpr int32 HASH_INDEX_MAGIC_NUM = 0xFB7c4a;
+constexpr uint32 INVALID_PAGE = ~0;
+
+/*
+	┌───────────────────────────────────────────────┐
+	│ FHashPageHeader │ Keys ... │ Datas ...        │
+	└───────────────────────────────────────────────┘
+	page 0 holds the header followed by the ids of the directory pages,
+	a directory page holds the first page of PAGE_IDS_PER_PAGE buckets
+*/
+struct FHashPageHeader
+{
+	uint32 Num;
+	uint32 Overflow;
+};
+
+constexpr int32 HASH_PAGE_CAPACITY = (FILE_PAGE_SIZE - sizeof(FHashPageHeader)) / (sizeof(int64) + sizeof(uint32));
+constexpr int32 HASH_KEYS_BEGIN = sizeof(FHashPageHeader);
+constexpr int32 HASH_DATAS_BEGIN = HASH_KEYS_BEGIN + HASH_PAGE_CAPACITY * sizeof(int64);
+// a bucket is split when the buckets are fuller than this on average
+constexpr float MAX_LOAD_FACTOR = 0.75f;
+
+inline uint64 GetHashPageOffset(uint32 Page)
+{
+	return (uint64)Page * FILE_PAGE_SIZE;
+}
+
+// row ids are mostly sequential, all bits of the key have to reach the low bits of the hash
+static uint32 HashKey(int64 Key)
+{
+	uint64 Hash = (uint64)Key;
+	Hash ^= Hash >> 33;
+	Hash *= 0xff51afd7ed558ccdull;
+	Hash ^= Hash >> 33;
+	Hash *= 0xc4ceb9fe1a85ec53ull;
+	Hash ^= Hash >> 33;
+	return (uint32)Hash;
+}
+
+// first position whose key is not below Key
+static int32 FindKeyPos(const TArray<int64>& Keys, int64 Key)
+{
+	int32 Begin = 0;
+	int32 End = Keys.Num();
+	while (Begin != End)
+	{
+		auto Mid = (Begin + End) / 2;
+		if (Keys[Mid] < Key)
+			Begin = Mid + 1;
+		else
+			End = Mid;
+	}
+	return Begin;
+}
+
+FHashIndex::FHashIndex(FFile::Ptr InFile) :File(InFile)
+{
+	static_assert(HASH_DATAS_BEGIN + HASH_PAGE_CAPACITY * sizeof(uint32) <= FILE_PAGE_SIZE, "page size is invalid");
+}
+
+uint32 FHashIndex::GetBucket(int64 Key) const
+{
+	auto Hash = HashKey(Key);
+	auto Bucket = Hash & (uint32)((1ull << Header.Level) - 1);
+	if (Bucket < Header.Split)
+		Bucket = Hash & (uint32)((1ull << (Header.Level + 1)) - 1);
+	return Bucket;
+}
+
+TArray<uint32> FHashIndex::Find(int64 Key)
+{
+	TArray<uint32> Datas;
+	FindOne(Key, [&](uint32 Data) {
+		Datas.Add(Data);
+		return false;
+	});
+	return Datas;
+}
+
+bool FHashIndex::FindOne(int64 Key, const TFunction<bool(uint32)>& Callback)
+{
+	auto Page = GetPage(Buckets[GetBucket(Key)]);
+	while (true)
+	{
+		for (auto Index = FindKeyPos(Page->Keys, Key); Index < Page->Keys.Num() && Page->Keys[Index] == Key; ++Index)
+		{
+			if (Callback(Page->Datas[Index]))
+				return true;
+		}
+
+		if (Page->Overflow == INVALID_PAGE)
+			return false;
+		Page = GetPage(Page->Overflow);
+	}
+}
+
+bool FHashIndex::FindMany(TArrayView<const int64> Keys, const TFunction<bool(int32, uint32)>& Callback)
+{
+	for (auto KeyIndex : XRange(Keys.Num()))
+	{
+		if (FindOne(Keys[KeyIndex], [&](uint32 Data) { return Callback(KeyIndex, Data); }))
+			return true;
+	}
+	return false;
+}
+
+FHashIndexCursor FHashIndex::FindRange(int64 Lo, int64 Hi, bool bAscending)
+{
+	return FHashIndexCursor();
+}
+
+void FHashIndex::Insert(int64 Key, uint32 Data)
+{
+	// new entries go to the last page, so equal keys are found in the order they were inserted
+	auto Page = GetPage(Buckets[GetBucket(Key)]);
+	while (Page->Overflow != INVALID_PAGE)
+		Page = GetPage(Page->Overflow);
+
+	auto Mutable = MakeShared<FHashPage>(*Page);
+	if (Mutable->Keys.Num() >= HASH_PAGE_CAPACITY)
+	{
+		auto NewPage = AllocatePage();
+		Mutable->Overflow = NewPage;
+		WritePage(Mutable);
+
+		Mutable = MakeShared<FHashPage>();
+		Mutable->Id = NewPage;
+		Mutable->Overflow = INVALID_PAGE;
+	}
+
+	auto Pos = FindKeyPos(Mutable->Keys, Key);
+	while (Pos < Mutable->Keys.Num() && Mutable->Keys[Pos] == Key)
+		++Pos;
+	Mutable->Keys.Insert(Key, Pos);
+	Mutable->Datas.Insert(Data, Pos);
+	WritePage(Mutable);
+
+	Header.NumEntries++;
+	if (Header.NumEntries > Buckets.Num() * HASH_PAGE_CAPACITY * MAX_LOAD_FACTOR)
+		SplitBucket();
+	FlushHeader();
+}
+
+bool FHashIndex::Remove(int64 Key, uint32 Data)
+{
+	FPageRef Prev;
+	auto Page = GetPage(Buckets[GetBucket(Key)]);
+	while (true)
+	{
+		for (auto Index = FindKeyPos(Page->Keys, Key); Index < Page->Keys.Num() && Page->Keys[Index] == Key; ++Index)
+		{
+			if (Page->Datas[Index] != Data)
+				continue;
+
+			// the first page of a bucket stays even when empty
+			if (Page->Keys.Num() == 1 && Prev.IsValid())
+			{
+				auto MutablePrev = MakeShared<FHashPage>(*Prev);
+				MutablePrev->Overflow = Page->Overflow;
+				WritePage(MutablePrev);
+				FreePage(Page->Id);
+			}
+			else
+			{
+				auto Mutable = MakeShared<FHashPage>(*Page);
+				Mutable->Keys.RemoveAt(Index);
+				Mutable->Datas.RemoveAt(Index);
+				WritePage(Mutable);
+			}
+
+			Header.NumEntries--;
+			FlushHeader();
+			return true;
+		}
+
+		if (Page->Overflow == INVALID_PAGE)
+			return false;
+		Prev = Page;
+		Page = GetPage(Page->Overflow);
+	}
+}
+
+void FHashIndex::BulkLoad(const TArray<TPair<int64, uint32>>& Entries, float FillFactor)
+{
+	check(Header.NumEntries == 0 && Buckets.Num() == 1);
+	if (Entries.Num() == 0)
+		return;
+
+	// the buckets are made at once, as many as the splits would have made
+	const float LoadFactor = FMath::Clamp(FillFactor, 0.1f, MAX_LOAD_FACTOR);
+	auto NumBuckets = FMath::Max(1, FMath::CeilToInt(Entries.Num() / (HASH_PAGE_CAPACITY * LoadFactor)));
+	Header.Level = FMath::FloorLog2(NumBuckets);
+	Header.Split = NumBuckets - (1 << Header.Level);
+	while (Buckets.Num() < NumBuckets)
+		AddBucket(AllocatePage());
+
+	// the entries are sorted by key, a stable distribution keeps every bucket sorted
+	TArray<int32> Begins;
+	Begins.SetNumZeroed(NumBuckets + 1);
+	TArray<uint32> EntryBuckets;
+	EntryBuckets.SetNumUninitialized(Entries.Num());
+	for (auto Index : XRange(Entries.Num()))
+	{
+		EntryBuckets[Index] = GetBucket(Entries[Index].Key);
+		Begins[EntryBuckets[Index] + 1]++;
+	}
+	for (auto Bucket : XRange(NumBuckets))
+		Begins[Bucket + 1] += Begins[Bucket];
+
+	TArray<TPair<int64, uint32>> Sorted;
+	Sorted.SetNumUninitialized(Entries.Num());
+	auto Ends = Begins;
+	for (auto Index : XRange(Entries.Num()))
+		Sorted[Ends[EntryBuckets[Index]]++] = Entries[Index];
+
+	TArray<uint32> NoPages;
+	for (auto Bucket : XRange(NumBuckets))
+	{
+		TArrayView<const TPair<int64, uint32>> BucketEntries(Sorted.GetData() + Begins[Bucket], Begins[Bucket + 1] - Begins[Bucket]);
+		WriteBucket(Buckets[Bucket], NoPages, BucketEntries);
+	}
+
+	Header.NumEntries = Entries.Num();
+	FlushHeader();
+}
+
+void FHashIndex::SplitBucket()
+{
+	auto Bucket = Header.Split;
+	auto NewBucket = Buckets.Num();
+
+	TArray<TPair<int64, uint32>> Entries;
+	TArray<uint32> Pages;
+	for (auto Page = GetPage(Buckets[Bucket]);; Page = GetPage(Page->Overflow))
+	{
+		Pages.Add(Page->Id);
+		for (auto Index : XRange(Page->Keys.Num()))
+			Entries.Emplace(Page->Keys[Index], Page->Datas[Index]);
+		if (Page->Overflow == INVALID_PAGE)
+			break;
+	}
+
+	if (++Header.Split == (1u << Header.Level))
+	{
+		Header.Level++;
+		Header.Split = 0;
+	}
+
+	TArray<TPair<int64, uint32>> Moved;
+	Entries.RemoveAll([&](const TPair<int64, uint32>& Entry) {
+		if (GetBucket(Entry.Key) == Bucket)
+			return false;
+		check(GetBucket(Entry.Key) == NewBucket);
+		Moved.Add(Entry);
+		return true;
+	});
+
+	// the overflow pages not needed any more are freed before the new bucket takes a page
+	auto FirstPage = Pages[0];
+	Pages.RemoveAt(0, 1, false);
+	WriteBucket(FirstPage, Pages, Entries);
+
+	auto NewPage = AllocatePage();
+	AddBucket(NewPage);
+	TArray<uint32> NoPages;
+	WriteBucket(NewPage, NoPages, Moved);
+}
+
+void FHashIndex::WriteBucket(uint32 FirstPage, TArray<uint32>& Pages, TArrayView<const TPair<int64, uint32>> Entries)
+{
+	auto NumPages = FMath::Max(1, (Entries.Num() + HASH_PAGE_CAPACITY - 1) / HASH_PAGE_CAPACITY);
+	TArray<uint32> Ids;
+	Ids.Add(FirstPage);
+	while (Ids.Num() < NumPages)
+		Ids.Add(Pages.Num() > 0 ? Pages.Pop(false) : AllocatePage());
+	for (auto Page : Pages)
+		FreePage(Page);
+	Pages.Reset();
+
+	for (auto PageIndex : XRange(NumPages))
+	{
+		auto Begin = PageIndex * HASH_PAGE_CAPACITY;
+		auto End = FMath::Min(Begin + HASH_PAGE_CAPACITY, Entries.Num());
+		TArray<TPair<int64, uint32>> PageEntries(Entries.GetData() + Begin, End - Begin);
+		PageEntries.StableSort([](const TPair<int64, uint32>& A, const TPair<int64, uint32>& B) { return A.Key < B.Key; });
+
+		auto Page = MakeShared<FHashPage>();
+		Page->Id = Ids[PageIndex];
+		Page->Overflow = PageIndex + 1 < NumPages ? Ids[PageIndex + 1] : INVALID_PAGE;
+		Page->Keys.Reserve(PageEntries.Num());
+		Page->Datas.Reserve(PageEntries.Num());
+		for (auto& Entry : PageEntries)
+		{
+			Page->Keys.Add(Entry.Key);
+			Page->Datas.Add(Entry.Value);
+		}
+		WritePage(Page);
+	}
+}
+
+FString FHashIndex::GetTypeName()const
+{
+	return TEXT("HashIndexSeacher");
+}
+
+void FHashIndex::Init()
+{
+	Header.MagicNum = HASH_INDEX_MAGIC_NUM;
+	Header.Level = 0;
+	Header.Split = 0;
+	Header.NumEntries = 0;
+	Header.PageCount = 0;
+	Header.FreePage = INVALID_PAGE;
+	Header.NumDirectoryPages = 0;
+	Buckets.Reset();
+	DirectoryPages.Reset();
+	PageCache.Reset();
+
+	auto Page = MakeShared<FHashPage>();
+	Page->Id = CreatePage();
+	Page->Overflow = INVALID_PAGE;
+	WritePage(Page);
+	AddBucket(Page->Id);
+	FlushHeader();
+}
+
+void FHashIndex::Open()
+{
+	File->ReadAt(0, Header);
+	check(Header.MagicNum == HASH_INDEX_MAGIC_NUM);
+	PageCache.Reset();
+
+	DirectoryPages.SetNumUninitialized(Header.NumDirectoryPages);
+	CHECK_RESULT(File->ReadAt(sizeof(Header), DirectoryPages.GetData(), DirectoryPages.Num() * sizeof(uint32)));
+
+	auto NumBuckets = (1u << Header.Level) + Header.Split;
+	Buckets.SetNumUninitialized(NumBuckets);
+	for (auto Index : XRange(DirectoryPages.Num()))
+	{
+		auto Begin = Index * PAGE_IDS_PER_PAGE;
+		auto Num = FMath::Min(PAGE_IDS_PER_PAGE, NumBuckets - Begin);
+		CHECK_RESULT(File->ReadAt(GetHashPageOffset(DirectoryPages[Index]), Buckets.GetData() + Begin, Num * sizeof(uint32)));
+	}
+}
+
+bool FHashIndex::IsHashIndex(FFile::Ptr File)
+{
+	int MagicNum = 0;
+	return File->ReadAt(0, MagicNum) && MagicNum == HASH_INDEX_MAGIC_NUM;
+}
+
+FHashIndex::FPageRef FHashIndex::GetPage(uint32 Page)
+{
+	if (auto Cached = PageCache.GetAndRefer(Page))
+		return *Cached;
+
+	auto Result = ReadPage(Page);
+	PageCache.Push(Page, Result);
+	return Result;
+}
+
+FHashIndex::FPageRef FHashIndex::ReadPage(uint32 Page)
+{
+	auto Offset = GetHashPageOffset(Page);
+	FHashPageHeader PageHeader;
+	CHECK_RESULT(File->ReadAt(Offset, PageHeader));
+	check(PageHeader.Num <= (uint32)HASH_PAGE_CAPACITY);
+
+	auto Result = MakeShared<FHashPage>();
+	Result->Id = Page;
+	Result->Overflow = PageHeader.Overflow;
+	Result->Keys.SetNumUninitialized(PageHeader.Num);
+	Result->Datas.SetNumUninitialized(PageHeader.Num);
+	CHECK_RESULT(File->ReadAt(Offset + HASH_KEYS_BEGIN, Result->Keys.GetData(), PageHeader.Num * sizeof(int64)));
+	CHECK_RESULT(File->ReadAt(Offset + HASH_DATAS_BEGIN, Result->Datas.GetData(), PageHeader.Num * sizeof(uint32)));
+	return Result;
+}
+
+void FHashIndex::WritePage(const TSharedRef<FHashPage>& Page)
+{
+	auto Num = Page->Keys.Num();
+	check(Num <= HASH_PAGE_CAPACITY && Page->Datas.Num() == Num);
+
+	auto Offset = GetHashPageOffset(Page->Id);
+	FHashPageHeader PageHeader = { (uint32)Num, Page->Overflow };
+	CHECK_RESULT(File->WriteAt(Offset, PageHeader));
+	CHECK_RESULT(File->WriteAt(Offset + HASH_KEYS_BEGIN, Page->Keys.GetData(), Num * sizeof(int64)));
+	CHECK_RESULT(File->WriteAt(Offset + HASH_DATAS_BEGIN, Page->Datas.GetData(), Num * sizeof(uint32)));
+	PageCache.Push(Page->Id, Page);
+}
+
+void FHashIndex::AddBucket(uint32 Page)
+{
+	auto Bucket = (uint32)Buckets.Num();
+	Buckets.Add(Page);
+
+	auto Directory = Bucket / PAGE_IDS_PER_PAGE;
+	if (Directory == DirectoryPages.Num())
+	{
+		check(sizeof(Header) + (Directory + 1) * sizeof(uint32) <= FILE_PAGE_SIZE);
+		DirectoryPages.Add(CreatePage());
+		Header.NumDirectoryPages = DirectoryPages.Num();
+		CHECK_RESULT(File->WriteAt(sizeof(Header) + Directory * sizeof(uint32), DirectoryPages.Last()));
+		FlushHeader();
+	}
+	CHECK_RESULT(File->WriteAt(GetHashPageOffset(DirectoryPages[Directory]) + (Bucket % PAGE_IDS_PER_PAGE) * sizeof(uint32), Page));
+}
+
+uint32 FHashIndex::AllocatePage()
+{
+	if (Header.FreePage == INVALID_PAGE)
+		return CreatePage();
+
+	auto Page = Header.FreePage;
+	FHashPageHeader PageHeader;
+	CHECK_RESULT(File->ReadAt(GetHashPageOffset(Page), PageHeader));
+	Header.FreePage = PageHeader.Overflow;
+	return Page;
+}
+
+void FHashIndex::FreePage(uint32 Page)
+{
+	// freed pages are listed through their overflow field
+	PageCache.Remove(Page);
+	FHashPageHeader PageHeader = { 0, Header.FreePage };
+	CHECK_RESULT(File->WriteAt(GetHashPageOffset(Page), PageHeader));
+	Header.FreePage = Page;
+}
+
+uint32 FHashIndex::CreatePage()
+{
+	File->AppendPage();
+	auto NewPage = ++Header.PageCount;
+	FlushHeader();
+
+	return NewPage;
+}
+
+void FHashIndex::FlushHeader()
+{
+	File->WriteAt(0, Header);
+}
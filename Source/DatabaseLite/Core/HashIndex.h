@@ -0,0 +1,98 @@
+#pragma once
+
+#include "File.h"
+#include "LRUCache.h"
+
+// a bucket page read into memory, the keys are sorted
+struct FHashPage
+{
+	uint32 Id;
+	// next page of the same bucket
+	uint32 Overflow;
+	TArray<int64> Keys;
+	TArray<uint32> Datas;
+};
+
+// a hash index has no order, its cursor is never valid
+class FHashIndexCursor
+{
+public:
+	bool IsValid() const { return false; }
+	int64 GetKey() const { return 0; }
+	uint32 GetData() const { return 0; }
+	void Next() {}
+};
+
+/*
+	linear hashing over pages of the file: a key is looked up in the single bucket its hash selects,
+	overflow pages only appear when a bucket gets more keys than a page holds.
+	when the index is too full the next bucket in turn is split, so the number of buckets grows by one at a time.
+	only exact lookups are supported
+*/
+class FHashIndex
+{
+public:
+	FHashIndex(FFile::Ptr File);
+
+	TArray<uint32> Find(int64 Key);
+	bool FindOne(int64 Key, const TFunction<bool(uint32)>& Callback);
+	// the cursor is never valid, check bRangeSupported before
+	FHashIndexCursor FindRange(int64 Lo, int64 Hi, bool bAscending = true);
+	// every key is a lookup of its own, sorting them does not help
+	bool FindMany(TArrayView<const int64> Keys, const TFunction<bool(int32, uint32)>& Callback);
+
+	void Insert(int64 Key, uint32 Data);
+	// an emptied overflow page is freed, buckets are never merged again
+	bool Remove(int64 Key, uint32 Data);
+	// the index must be empty, FillFactor is how full the buckets are made
+	void BulkLoad(const TArray<TPair<int64, uint32>>& Entries, float FillFactor = 1.0f);
+	FString GetTypeName()const;
+	static constexpr bool bRangeSupported = false;
+
+	void Init();
+	void Open();
+
+	// whether the file holds an index of this kind
+	static bool IsHashIndex(FFile::Ptr File);
+
+private:
+	using FPageRef = TSharedPtr<const FHashPage>;
+
+	uint32 GetBucket(int64 Key) const;
+	FPageRef GetPage(uint32 Page);
+	FPageRef ReadPage(uint32 Page);
+	// writes the page and caches it, the page must not be changed afterwards
+	void WritePage(const TSharedRef<FHashPage>& Page);
+	// writes the entries of a bucket to its page and as many overflow pages as needed, Pages are reused first
+	void WriteBucket(uint32 FirstPage, TArray<uint32>& Pages, TArrayView<const TPair<int64, uint32>> Entries);
+
+	void SplitBucket();
+	void AddBucket(uint32 Page);
+	uint32 AllocatePage();
+	void FreePage(uint32 Page);
+	uint32 CreatePage();
+
+	void FlushHeader();
+
+private:
+	FFile::Ptr File;
+
+	static constexpr int PAGE_CACHE_SIZE = 128;
+	TFlatLRUCache<uint32, FPageRef, PAGE_CACHE_SIZE> PageCache;
+
+	// first page of every bucket, kept on the directory pages as well
+	TArray<uint32> Buckets;
+	TArray<uint32> DirectoryPages;
+
+	struct
+	{
+		int MagicNum;
+		// buckets below Split use one more bit of the hash
+		uint32 Level;
+		uint32 Split;
+		uint32 NumEntries;
+		uint32 PageCount;
+		uint32 FreePage;
+		uint32 NumDirectoryPages;
+	}Header;
+};
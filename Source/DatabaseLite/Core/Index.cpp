@@ -1,5 +1,6 @@
 #include "Index.h"
 #include "Range.h"
+#include "StaticText.h"
 
 
 
@@ -63,6 +64,31 @@ bool FIndexHelper::Write(const FKeySequence& Keys, FFile::Ptr File, const FKeyTy
 	return true;
 }
 
+void FIndexHelper::Write(const FKeySequence& Keys, uint8* Buffer, const FKeyTypeSequence& Types, FStaticText& StaticText)
+{
+	for (auto Index : XRange(Types.Num()))
+	{
+		auto& Data = Keys[Index];
+		switch (Types[Index])
+		{
+		case EKeyType::Integer:
+		{
+			auto Value = AnyCast<int64>(Data);
+			FMemory::Memcpy(Buffer, &Value, sizeof(Value));
+			Buffer += sizeof(Value);
+		}
+		break;
+		case EKeyType::String:
+		{
+			uint32 Value = StaticText.FindOrCreate(AnyCast<FString>(Data));
+			FMemory::Memcpy(Buffer, &Value, sizeof(Value));
+			Buffer += sizeof(Value);
+		}
+		break;
+		}
+	}
+}
+
 int32 FIndexHelper::GetKeySize(const FKeyTypeSequence& KeyTypes)
 {
 	int Size = 0;
@@ -105,4 +131,34 @@ uint32 FIndexHelper::Hash(const FKeySequence& Keys)
 		HashValue = HashCombine(HashValue, Keys[Index].Hash());
 	}
 	return HashValue;
-}
\ No newline at end of file
+}
+
+void FIndexHelper::Encode(const FKeySequence& Keys, const FKeyTypeSequence& Types, FEncodedKey& Out)
+{
+	check(Keys.Num() <= Types.Num());
+	for (auto Index : XRange(Keys.Num()))
+	{
+		switch (Types[Index])
+		{
+		case EKeyType::Integer: Encode(AnyCast<int64>(Keys[Index]), Out); break;
+		case EKeyType::String: Encode(AnyCast<FString>(Keys[Index]), Out); break;
+		}
+	}
+}
+
+void FIndexHelper::Encode(int64 Value, FEncodedKey& Out)
+{
+	auto Bits = (uint64)Value ^ (1ull << 63);
+	for (int32 Shift = 56; Shift >= 0; Shift -= 8)
+		Out.Add((uint8)(Bits >> Shift));
+}
+
+void FIndexHelper::Encode(const FString& Value, FEncodedKey& Out)
+{
+	// UTF-8 bytes order like the code points, and a string holds no zero.
+	// lower case, strings order ignoring case like FString compares them. spellings of a string share their entries,
+	// exact lookups compare the rows afterwards and still tell them apart
+	FTCHARToUTF8 Converter(*Value.ToLower());
+	Out.Append((const uint8*)Converter.Get(), Converter.Length());
+	Out.Add(0);
+}
@@ -13,6 +13,18 @@ enum class EKeyType : uint8
 
 using FKeyTypeSequence = TArray<EKeyType>;
 
+// how an index of a table is stored
+enum class EIndexType : uint8
+{
+	// a B-tree, multi-column keys are kept in order
+	BTree,
+	// linear hashing, one page access for a lookup but no FindRange
+	Hash,
+};
+
+// memcomparable bytes of a key, see FIndexHelper::Encode. strings are lower case, they order like FString compares them
+using FEncodedKey = TArray<uint8, TInlineAllocator<64>>;
+
 
 struct FKeySequence
 {
@@ -87,6 +99,106 @@ struct FKeySequence
 
 //using FKeySequence = TArray<FAny>;
 
+template<class T>
+struct TDBKeyTraits;
+
+template<>
+struct TDBKeyTraits<int64>
+{
+	static constexpr EKeyType Type = EKeyType::Integer;
+	using StorageType = int64;
+};
+
+template<>
+struct TDBKeyTraits<FString>
+{
+	static constexpr EKeyType Type = EKeyType::String;
+	using StorageType = FString;
+};
+
+/*
+	key with its types known at compile time, e.g. TDBKey<int64> or TDBKey<int64, FString>.
+	looking up with it does not box the values into FAny.
+	strings are held by value, so a key built from a temporary stays valid. move a string in to avoid the copy
+*/
+template<class... Ts>
+struct TDBKey
+{
+	static_assert(sizeof...(Ts) > 0, "a key needs at least one value");
+
+	static constexpr int32 NumKeys = sizeof...(Ts);
+	static constexpr EKeyType Types[NumKeys] = { TDBKeyTraits<Ts>::Type... };
+
+	TTuple<typename TDBKeyTraits<Ts>::StorageType...> Values;
+
+	TDBKey(Ts... InValues) : Values(MoveTemp(InValues)...)
+	{}
+
+	// Func is called with every value in order
+	template<class FuncType>
+	void ForEach(FuncType&& Func) const
+	{
+		Values.ApplyAfter([&](const auto&... Keys) { (Func(Keys), ...); });
+	}
+
+	// same as FIndexHelper::Hash of the equal FKeySequence
+	uint32 Hash() const
+	{
+		uint32 HashValue = 0;
+		bool bFirst = true;
+		ForEach([&](const auto& Key)
+			{
+				HashValue = bFirst ? GetTypeHash(Key) : HashCombine(HashValue, GetTypeHash(Key));
+				bFirst = false;
+			});
+		return HashValue;
+	}
+
+	static bool Matches(const FKeyTypeSequence& KeyTypes)
+	{
+		if (KeyTypes.Num() != NumKeys)
+			return false;
+		for (int32 Index = 0; Index < NumKeys; Index++)
+		{
+			if (KeyTypes[Index] != Types[Index])
+				return false;
+		}
+		return true;
+	}
+};
+
+
+class FIndexCursor
+{
+public:
+	using Ptr = TSharedPtr<FIndexCursor>;
+public:
+	virtual ~FIndexCursor(){};
+	virtual bool IsValid() const = 0;
+	virtual int64 GetKey() const = 0;
+	virtual uint32 GetData() const = 0;
+	virtual void Next() = 0;
+	// key of an entry of an ordered index, empty for the other indices
+	virtual TArrayView<const uint8> GetEncodedKey() const { return TArrayView<const uint8>(); }
+};
+
+template<class CursorType>
+class TIndexCursor : public FIndexCursor
+{
+public:
+	TIndexCursor(CursorType InCursor) :Cursor(MoveTemp(InCursor))
+	{
+
+	}
+
+	virtual bool IsValid() const override { return Cursor.IsValid(); }
+	virtual int64 GetKey() const override { return Cursor.GetKey(); }
+	virtual uint32 GetData() const override { return Cursor.GetData(); }
+	virtual void Next() override { Cursor.Next(); }
+private:
+	CursorType Cursor;
+};
+
 
 class FBaseIndex
 {
@@ -96,7 +208,34 @@ public:
 	virtual ~FBaseIndex(){};
 	virtual TArray<uint32> Find(int64 Key) = 0;
 	virtual bool FindOne(int64 Key, const TFunction<bool(uint32)>& Callback) = 0;
+	virtual FIndexCursor::Ptr FindRange(int64 Lo, int64 Hi, bool bAscending) = 0;
+	// false for an index which only finds exact keys, its FindRange finds nothing
+	virtual bool IsRangeSupported() const = 0;
 	virtual void Insert(int64 Key, uint32 Data) = 0;
+	// removes the entry of Key with Data, false if there is none
+	virtual bool Remove(int64 Key, uint32 Data) = 0;
+	virtual void BulkLoad(const TArray<TPair<int64, uint32>>& Entries, float FillFactor) = 0;
+	virtual FString GetTypeName()const = 0;
+	// Keys sorted and unique, Callback gets the position of a key and one of its datas and returns true to stop
+	virtual bool FindMany(TArrayView<const int64> Keys, const TFunction<bool(int32, uint32)>& Callback) = 0;
+};
+
+// an ordered index is searched with encoded keys instead of numbers, so it has neither hash collisions nor
+// an order of its own, see FIndexHelper::Encode
+class FOrderedIndex
+{
+public:
+	using Ptr = TSharedPtr<FOrderedIndex>;
+public:
+	virtual ~FOrderedIndex(){};
+	virtual bool FindOne(TArrayView<const uint8> Key, const TFunction<bool(uint32)>& Callback) = 0;
+	// Lo is inclusive, every key starting with Hi is in the range
+	virtual FIndexCursor::Ptr FindRange(TArrayView<const uint8> Lo, TArrayView<const uint8> Hi, bool bAscending) = 0;
+	virtual void Insert(TArrayView<const uint8> Key, uint32 Data) = 0;
+	// removes the entry of Key with Data, false if there is none
+	virtual bool Remove(TArrayView<const uint8> Key, uint32 Data) = 0;
+	// Entries sorted by key and data
+	virtual void BulkLoad(const TArray<TPair<TArrayView<const uint8>, uint32>>& Entries, float FillFactor) = 0;
 	virtual FString GetTypeName()const = 0;
 };
 
@@ -130,15 +269,113 @@ public:
 		return Seacher.FindOne(Key, Callback);
 	}
 
+	virtual FIndexCursor::Ptr FindRange(int64 Lo, int64 Hi, bool bAscending) override
+	{
+		using CursorType = decltype(Seacher.FindRange(Lo, Hi, bAscending));
+		return MakeShared<TIndexCursor<CursorType>>(Seacher.FindRange(Lo, Hi, bAscending));
+	}
+
+	virtual bool IsRangeSupported() const override
+	{
+		return SeachType::bRangeSupported;
+	}
+
 	virtual void Insert(int64 Key, uint32 Data) override
 	{
 		Seacher.Insert(Key, Data);
 	}	
 
+	virtual bool Remove(int64 Key, uint32 Data) override
+	{
+		return Seacher.Remove(Key, Data);
+	}
+
+	virtual void BulkLoad(const TArray<TPair<int64, uint32>>& Entries, float FillFactor) override
+	{
+		Seacher.BulkLoad(Entries, FillFactor);
+	}
+
 	virtual FString GetTypeName()const
 	{
 		return Seacher.GetTypeName();
 	}
+
+	virtual bool FindMany(TArrayView<const int64> Keys, const TFunction<bool(int32, uint32)>& Callback) override
+	{
+		return Seacher.FindMany(Keys, Callback);
+	}
+private:
+	SeachType Seacher;
+};
+
+template<class CursorType>
+class TOrderedIndexCursor : public FIndexCursor
+{
+public:
+	TOrderedIndexCursor(CursorType InCursor) :Cursor(MoveTemp(InCursor))
+	{
+
+	}
+
+	virtual bool IsValid() const override { return Cursor.IsValid(); }
+	// ordered keys have no number
+	virtual int64 GetKey() const override { return 0; }
+	virtual uint32 GetData() const override { return Cursor.GetData(); }
+	virtual void Next() override { Cursor.Next(); }
+	virtual TArrayView<const uint8> GetEncodedKey() const override { return Cursor.GetKey(); }
+private:
+	CursorType Cursor;
+};
+
+template<class SeachType>
+class TOrderedIndex : public FOrderedIndex
+{
+public:
+	TOrderedIndex(FFile::Ptr File) :Seacher(File)
+	{
+
+	}
+
+	void Init()
+	{
+		Seacher.Init();
+	}
+
+	void Open()
+	{
+		Seacher.Open();
+	}
+
+	virtual bool FindOne(TArrayView<const uint8> Key, const TFunction<bool(uint32)>& Callback) override
+	{
+		return Seacher.FindOne(Key, Callback);
+	}
+
+	virtual FIndexCursor::Ptr FindRange(TArrayView<const uint8> Lo, TArrayView<const uint8> Hi, bool bAscending) override
+	{
+		using CursorType = decltype(Seacher.FindRange(Lo, Hi, bAscending));
+		return MakeShared<TOrderedIndexCursor<CursorType>>(Seacher.FindRange(Lo, Hi, bAscending));
+	}
+
+	virtual void Insert(TArrayView<const uint8> Key, uint32 Data) override
+	{
+		Seacher.Insert(Key, Data);
+	}
+
+	virtual bool Remove(TArrayView<const uint8> Key, uint32 Data) override
+	{
+		return Seacher.Remove(Key, Data);
+	}
+
+	virtual void BulkLoad(const TArray<TPair<TArrayView<const uint8>, uint32>>& Entries, float FillFactor) override
+	{
+		Seacher.BulkLoad(Entries, FillFactor);
+	}
+
+	virtual FString GetTypeName()const override
+	{
+		return Seacher.GetTypeName();
+	}
 private:
 	SeachType Seacher;
 };
@@ -148,8 +385,19 @@ class FIndexHelper
 public:
 	static bool Read(FKeySequence& Keys, FFile::Ptr File, const FKeyTypeSequence& Types);
 	static bool Write(const FKeySequence& Keys, FFile::Ptr File, const FKeyTypeSequence& Types);
+	// same layout as writing to a file, Buffer must hold GetKeySize bytes
+	static void Write(const FKeySequence& Keys, uint8* Buffer, const FKeyTypeSequence& Types, class FStaticText& StaticText);
 	static int32 GetKeySize(const FKeyTypeSequence& KeyTypes);
 	static bool Equal(const FKeySequence& Keys1, const FKeySequence& Keys2);
 	static uint32 Hash(const FKeySequence& Keys);
 
+	/*
+		bytes which compare with memcmp like the keys compare: integers big-endian with the sign bit flipped,
+		strings as lower case UTF-8 ended by a zero, so they compare case-insensitively like everywhere else.
+		Keys may be a prefix of the key types, it encodes to a prefix of the whole key
+	*/
+	static void Encode(const FKeySequence& Keys, const FKeyTypeSequence& Types, FEncodedKey& Out);
+	static void Encode(int64 Value, FEncodedKey& Out);
+	static void Encode(const FString& Value, FEncodedKey& Out);
+
 };
\ No newline at end of file
@@ -0,0 +1,677 @@
+#include "KeyBTree.h"
+#include "Range.h"
+
+constexpr int32 KEY_BTREE_MAGIC_NUM = 0xFB7ce6;
+constexpr uint32 INVALID_NODE = ~0;
+constexpr int32 ENTRY_DATA_SIZE = sizeof(uint32);
+
+/*
+	┌──────────────────────────────────────────────────────────────────────┐
+	│ FKeyNodeHeader │ key offsets (uint16) │ children (uint32) │ keys ... │
+	└──────────────────────────────────────────────────────────────────────┘
+	leaves have no children
+*/
+struct FKeyNodeHeader
+{
+	uint8 bLeaf;
+	uint8 Pad;
+	uint16 Num;
+	uint32 Prev;
+	uint32 Next;
+	uint32 BytesSize;
+};
+
+// at least three keys of the largest size fit into a node filled to the minimum
+constexpr int32 MIN_FILL_SIZE = FILE_PAGE_SIZE / 4;
+static_assert(3 * (FKeyBTree::MAX_KEY_SIZE + ENTRY_DATA_SIZE + sizeof(uint16) + sizeof(uint32)) + sizeof(FKeyNodeHeader) <= MIN_FILL_SIZE, "keys are too large for the page");
+
+inline uint64 GetKeyNodeOffset(uint32 Node)
+{
+	return (uint64)Node * FILE_PAGE_SIZE;
+}
+
+static int32 GetPageSize(const FKeyBTreeNode& Node)
+{
+	auto Num = Node.Num();
+	return sizeof(FKeyNodeHeader) + Num * sizeof(uint16) + (Node.bLeaf ? 0 : (Num + 1) * sizeof(uint32)) + Node.Bytes.Num();
+}
+
+static int32 Compare(TArrayView<const uint8> A, TArrayView<const uint8> B)
+{
+	auto Result = FMemory::Memcmp(A.GetData(), B.GetData(), FMath::Min(A.Num(), B.Num()));
+	return Result != 0 ? Result : A.Num() - B.Num();
+}
+
+// 0 when A starts with Prefix
+static int32 ComparePrefix(TArrayView<const uint8> A, TArrayView<const uint8> Prefix)
+{
+	auto Result = FMemory::Memcmp(A.GetData(), Prefix.GetData(), FMath::Min(A.Num(), Prefix.Num()));
+	return Result != 0 ? Result : (A.Num() < Prefix.Num() ? -1 : 0);
+}
+
+// number of keys below Key
+static int32 LowerBound(const FKeyBTreeNode& Node, TArrayView<const uint8> Key)
+{
+	int32 Begin = 0;
+	int32 End = Node.Num();
+	while (Begin != End)
+	{
+		auto Mid = (Begin + End) / 2;
+		if (Compare(Node.GetKey(Mid), Key) < 0)
+			Begin = Mid + 1;
+		else
+			End = Mid;
+	}
+	return Begin;
+}
+
+// number of keys not above Key, the child of an inner node which holds Key
+static int32 UpperBound(const FKeyBTreeNode& Node, TArrayView<const uint8> Key)
+{
+	int32 Begin = 0;
+	int32 End = Node.Num();
+	while (Begin != End)
+	{
+		auto Mid = (Begin + End) / 2;
+		if (Compare(Node.GetKey(Mid), Key) <= 0)
+			Begin = Mid + 1;
+		else
+			End = Mid;
+	}
+	return Begin;
+}
+
+// number of keys not above the keys starting with Prefix
+static int32 PrefixUpperBound(const FKeyBTreeNode& Node, TArrayView<const uint8> Prefix)
+{
+	int32 Begin = 0;
+	int32 End = Node.Num();
+	while (Begin != End)
+	{
+		auto Mid = (Begin + End) / 2;
+		if (ComparePrefix(Node.GetKey(Mid), Prefix) <= 0)
+			Begin = Mid + 1;
+		else
+			End = Mid;
+	}
+	return Begin;
+}
+
+static uint32 DecodeData(TArrayView<const uint8> Entry)
+{
+	auto Data = Entry.GetData() + Entry.Num() - ENTRY_DATA_SIZE;
+	return ((uint32)Data[0] << 24) | ((uint32)Data[1] << 16) | ((uint32)Data[2] << 8) | (uint32)Data[3];
+}
+
+// big-endian, so that equal keys are ordered by their data
+static void MakeEntry(TArrayView<const uint8> Key, uint32 Data, TArray<uint8>& Entry)
+{
+	Entry.Reset(Key.Num() + ENTRY_DATA_SIZE);
+	Entry.Append(Key.GetData(), Key.Num());
+	Entry.Add((uint8)(Data >> 24));
+	Entry.Add((uint8)(Data >> 16));
+	Entry.Add((uint8)(Data >> 8));
+	Entry.Add((uint8)Data);
+}
+
+static void InsertKey(FKeyBTreeNode& Node, int32 Pos, TArrayView<const uint8> Key)
+{
+	auto Offset = Node.Offsets[Pos];
+	Node.Bytes.Insert(Key.GetData(), Key.Num(), Offset);
+	Node.Offsets.Insert(Offset, Pos);
+	for (auto Index : XRange(Pos + 1, Node.Offsets.Num()))
+		Node.Offsets[Index] += Key.Num();
+}
+
+static void EraseKey(FKeyBTreeNode& Node, int32 Pos)
+{
+	auto Size = Node.Offsets[Pos + 1] - Node.Offsets[Pos];
+	Node.Bytes.RemoveAt(Node.Offsets[Pos], Size, false);
+	Node.Offsets.RemoveAt(Pos + 1, 1, false);
+	for (auto Index : XRange(Pos + 1, Node.Offsets.Num()))
+		Node.Offsets[Index] -= Size;
+}
+
+static void AppendKey(FKeyBTreeNode& Node, TArrayView<const uint8> Key)
+{
+	Node.Bytes.Append(Key.GetData(), Key.Num());
+	Node.Offsets.Add(Node.Bytes.Num());
+}
+
+static TSharedRef<FKeyBTreeNode> NewNode(uint32 Id, bool bLeaf)
+{
+	auto Node = MakeShared<FKeyBTreeNode>();
+	Node->Id = Id;
+	Node->bLeaf = bLeaf;
+	Node->Prev = INVALID_NODE;
+	Node->Next = INVALID_NODE;
+	Node->Offsets.Add(0);
+	return Node;
+}
+
+
+FKeyBTree::FKeyBTree(FFile::Ptr InFile):File(InFile)
+{
+}
+
+TArray<uint32> FKeyBTree::Find(TArrayView<const uint8> Key)
+{
+	TArray<uint32> Datas;
+	FindOne(Key, [&](uint32 Data) {
+		Datas.Add(Data);
+		return false;
+	});
+	return Datas;
+}
+
+bool FKeyBTree::FindOne(TArrayView<const uint8> Key, const TFunction<bool(uint32)>& Callback)
+{
+	int32 Pos;
+	auto Node = FindLeaf(Key, Pos);
+	while (true)
+	{
+		if (Pos >= Node->Num())
+		{
+			if (Node->Next == INVALID_NODE)
+				return false;
+			Node = GetNode(Node->Next);
+			Pos = 0;
+			continue;
+		}
+
+		auto Entry = Node->GetKey(Pos++);
+		if (ComparePrefix(Entry, Key) != 0)
+			return false;
+		if (Entry.Num() == Key.Num() + ENTRY_DATA_SIZE && Callback(DecodeData(Entry)))
+			return true;
+	}
+}
+
+FKeyBTreeCursor FKeyBTree::FindRange(TArrayView<const uint8> Lo, TArrayView<const uint8> Hi, bool bAscending)
+{
+	FKeyBTreeCursor Cursor;
+	Cursor.Tree = this;
+	Cursor.Lo.Append(Lo.GetData(), Lo.Num());
+	Cursor.Hi.Append(Hi.GetData(), Hi.Num());
+	Cursor.bAscending = bAscending;
+
+	if (bAscending)
+	{
+		Cursor.Node = FindLeaf(Lo, Cursor.Pos);
+	}
+	else
+	{
+		// the last entry starting with Hi or below it
+		auto Node = GetNode(Header.RootNode);
+		while (!Node->bLeaf)
+			Node = GetNode(Node->Children[PrefixUpperBound(*Node, Hi)]);
+		Cursor.Node = Node;
+		Cursor.Pos = PrefixUpperBound(*Node, Hi) - 1;
+	}
+
+	Cursor.Settle();
+	return Cursor;
+}
+
+TArrayView<const uint8> FKeyBTreeCursor::GetKey() const
+{
+	auto Entry = Node->GetKey(Pos);
+	return TArrayView<const uint8>(Entry.GetData(), Entry.Num() - ENTRY_DATA_SIZE);
+}
+
+uint32 FKeyBTreeCursor::GetData() const
+{
+	return DecodeData(Node->GetKey(Pos));
+}
+
+void FKeyBTreeCursor::Next()
+{
+	check(IsValid());
+	Pos += bAscending ? 1 : -1;
+	Settle();
+}
+
+void FKeyBTreeCursor::Settle()
+{
+	// neighbouring leaves are followed through the list, empty ones are passed over
+	while (Node.IsValid())
+	{
+		if (Pos >= Node->Num())
+		{
+			auto Next = Node->Next;
+			Node.Reset();
+			if (Next != INVALID_NODE)
+				Node = Tree->GetNode(Next);
+			Pos = 0;
+		}
+		else if (Pos < 0)
+		{
+			auto Prev = Node->Prev;
+			Node.Reset();
+			if (Prev != INVALID_NODE)
+				Node = Tree->GetNode(Prev);
+			Pos = Node.IsValid() ? Node->Num() - 1 : 0;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if (!Node.IsValid())
+		return;
+
+	auto Entry = Node->GetKey(Pos);
+	if (bAscending ? ComparePrefix(Entry, Hi) > 0 : Compare(Entry, Lo) < 0)
+		Node.Reset();
+}
+
+FKeyBTree::FNodeRef FKeyBTree::FindLeaf(TArrayView<const uint8> Key, int32& Pos)
+{
+	// a separator is the first entry of the child behind it, entries below Key are never right of it
+	auto Node = GetNode(Header.RootNode);
+	while (!Node->bLeaf)
+		Node = GetNode(Node->Children[LowerBound(*Node, Key)]);
+
+	Pos = LowerBound(*Node, Key);
+	return Node;
+}
+
+void FKeyBTree::Insert(TArrayView<const uint8> Key, uint32 Data)
+{
+	checkf(Key.Num() <= MAX_KEY_SIZE, TEXT("key of %d bytes is too large"), Key.Num());
+
+	TArray<uint8> Entry;
+	MakeEntry(Key, Data, Entry);
+
+	// the nodes passed on the way down and the child taken in each
+	TArray<TPair<uint32, int32>, TInlineAllocator<16>> Path;
+	auto Node = GetNode(Header.RootNode);
+	while (!Node->bLeaf)
+	{
+		auto Index = UpperBound(*Node, Entry);
+		Path.Emplace(Node->Id, Index);
+		Node = GetNode(Node->Children[Index]);
+	}
+
+	// cursors may still hold the cached node, it is copied before the change
+	auto Mutable = MakeShared<FKeyBTreeNode>(*Node);
+	auto Pos = LowerBound(*Mutable, Entry);
+	check(Pos == Mutable->Num() || Compare(Mutable->GetKey(Pos), Entry) != 0);
+	InsertKey(*Mutable, Pos, Entry);
+
+	TArray<uint8> Separator;
+	while (GetPageSize(*Mutable) > FILE_PAGE_SIZE)
+	{
+		auto Right = NewNode(CreatePage(), Mutable->bLeaf);
+		Split(*Mutable, *Right, Separator);
+		WriteNode(Mutable);
+		WriteNode(Right);
+
+		if (Path.Num() == 0)
+		{
+			auto Root = NewNode(CreatePage(), false);
+			AppendKey(*Root, Separator);
+			Root->Children.Add(Mutable->Id);
+			Root->Children.Add(Right->Id);
+			WriteNode(Root);
+
+			Header.RootNode = Root->Id;
+			FlushHeader();
+			return;
+		}
+
+		auto Parent = Path.Pop(false);
+		Mutable = MakeShared<FKeyBTreeNode>(*GetNode(Parent.Key));
+		InsertKey(*Mutable, Parent.Value, Separator);
+		Mutable->Children.Insert(Right->Id, Parent.Value + 1);
+	}
+
+	WriteNode(Mutable);
+}
+
+void FKeyBTree::Split(FKeyBTreeNode& Left, FKeyBTreeNode& Right, TArray<uint8>& Separator)
+{
+	// split where the bytes are halved, not the keys
+	auto Num = Left.Num();
+	int32 Mid = 1;
+	while (Mid < Num - 1 && Left.Offsets[Mid] < Left.Bytes.Num() / 2)
+		++Mid;
+
+	auto MidKey = Left.GetKey(Mid);
+	Separator.Reset();
+	Separator.Append(MidKey.GetData(), MidKey.Num());
+
+	// a leaf keeps the separator as its first entry, an inner node moves it up
+	auto RightBegin = Left.bLeaf ? Mid : Mid + 1;
+	for (auto Index : XRange(RightBegin, Num))
+		AppendKey(Right, Left.GetKey(Index));
+
+	if (Left.bLeaf)
+	{
+		Right.Prev = Left.Id;
+		Right.Next = Left.Next;
+		if (Left.Next != INVALID_NODE)
+		{
+			auto Next = MakeShared<FKeyBTreeNode>(*GetNode(Left.Next));
+			Next->Prev = Right.Id;
+			WriteNode(Next);
+		}
+		Left.Next = Right.Id;
+	}
+	else
+	{
+		Right.Children.Append(Left.Children.GetData() + Mid + 1, Num - Mid);
+		Left.Children.SetNum(Mid + 1, false);
+	}
+
+	Left.Bytes.SetNum(Left.Offsets[Mid], false);
+	Left.Offsets.SetNum(Mid + 1, false);
+}
+
+bool FKeyBTree::Remove(TArrayView<const uint8> Key, uint32 Data)
+{
+	TArray<uint8> Entry;
+	MakeEntry(Key, Data, Entry);
+
+	// a separator is not above the entries right of it, so an entry equal to one is found on the right
+	TArray<TPair<uint32, int32>, TInlineAllocator<16>> Path;
+	auto Node = GetNode(Header.RootNode);
+	while (!Node->bLeaf)
+	{
+		auto Index = UpperBound(*Node, Entry);
+		Path.Emplace(Node->Id, Index);
+		Node = GetNode(Node->Children[Index]);
+	}
+
+	auto Pos = LowerBound(*Node, Entry);
+	if (Pos >= Node->Num() || Compare(Node->GetKey(Pos), Entry) != 0)
+		return false;
+
+	auto Mutable = MakeShared<FKeyBTreeNode>(*Node);
+	EraseKey(*Mutable, Pos);
+	Rebalance(Mutable, Path);
+	return true;
+}
+
+void FKeyBTree::Rebalance(TSharedRef<FKeyBTreeNode> Node, TArray<TPair<uint32, int32>, TInlineAllocator<16>>& Path)
+{
+	while (Path.Num() > 0 && GetPageSize(*Node) < MIN_FILL_SIZE)
+	{
+		auto Parent = MakeShared<FKeyBTreeNode>(*GetNode(Path.Last().Key));
+		auto Index = Path.Pop(false).Value;
+		// a parent left without keys by a failed balance below has no sibling to offer
+		if (Parent->Num() == 0)
+			break;
+
+		// the left sibling is taken if there is one, Sep is the key of the parent between the two
+		const bool bHasLeft = Index > 0;
+		const int32 Sep = bHasLeft ? Index - 1 : 0;
+		auto Sibling = MakeShared<FKeyBTreeNode>(*GetNode(Parent->Children[bHasLeft ? Sep : 1]));
+		const auto& Left = bHasLeft ? Sibling : Node;
+		const auto& Right = bHasLeft ? Node : Sibling;
+
+		// everything goes into the left node, between inner nodes the separator comes down
+		auto Merged = MakeShared<FKeyBTreeNode>(*Left);
+		if (!Merged->bLeaf)
+		{
+			AppendKey(*Merged, Parent->GetKey(Sep));
+			Merged->Children.Append(Right->Children);
+		}
+		else
+		{
+			Merged->Next = Right->Next;
+		}
+		for (auto Key : XRange(Right->Num()))
+			AppendKey(*Merged, Right->GetKey(Key));
+
+		if (GetPageSize(*Merged) <= FILE_PAGE_SIZE)
+		{
+			if (Merged->bLeaf)
+			{
+				if (Right->Next != INVALID_NODE)
+				{
+					auto Next = MakeShared<FKeyBTreeNode>(*GetNode(Right->Next));
+					Next->Prev = Merged->Id;
+					WriteNode(Next);
+				}
+			}
+			WriteNode(Merged);
+			ReleasePage(Right->Id);
+
+			EraseKey(*Parent, Sep);
+			Parent->Children.RemoveAt(Sep + 1, 1, false);
+			Node = Parent;
+			continue;
+		}
+
+		// too much for one page, the entries are shared out again where the bytes are halved
+		auto Balanced = NewNode(Right->Id, Right->bLeaf);
+		TArray<uint8> Separator;
+		Split(*Merged, *Balanced, Separator);
+		EraseKey(*Parent, Sep);
+		InsertKey(*Parent, Sep, Separator);
+		// the parent can not take a longer separator, the node stays below the minimum instead.
+		// leaves are never left empty, an empty one always fits into its sibling
+		if (GetPageSize(*Parent) > FILE_PAGE_SIZE)
+			break;
+
+		WriteNode(Merged);
+		WriteNode(Balanced);
+		WriteNode(Parent);
+		return;
+	}
+
+	// an inner root with a single child hands over to it
+	if (Node->Id == Header.RootNode && !Node->bLeaf && Node->Num() == 0)
+	{
+		Header.RootNode = Node->Children[0];
+		FlushHeader();
+		ReleasePage(Node->Id);
+		return;
+	}
+	WriteNode(Node);
+}
+
+void FKeyBTree::BulkLoad(const TArray<TPair<TArrayView<const uint8>, uint32>>& Entries, float FillFactor)
+{
+	auto Root = GetNode(Header.RootNode);
+	check(Root->bLeaf && Root->Num() == 0);
+	if (Entries.Num() == 0)
+		return;
+
+	const int32 Capacity = FMath::Clamp((int32)(FILE_PAGE_SIZE * FillFactor), MIN_FILL_SIZE, FILE_PAGE_SIZE);
+
+	// every node of a level with its first entry, the separator in front of it one level up
+	TArray<TPair<uint32, TArray<uint8>>> Level;
+
+	// the leaves are written one behind the other, the empty root page becomes the first
+	TArray<uint8> Entry;
+	auto Leaf = NewNode(Header.RootNode, true);
+	for (auto& Item : Entries)
+	{
+		checkf(Item.Key.Num() <= MAX_KEY_SIZE, TEXT("key of %d bytes is too large"), Item.Key.Num());
+		MakeEntry(Item.Key, Item.Value, Entry);
+		if (Leaf->Num() > 0 && GetPageSize(*Leaf) + Entry.Num() + (int32)sizeof(uint16) > Capacity)
+		{
+			auto NextLeaf = NewNode(CreatePage(), true);
+			NextLeaf->Prev = Leaf->Id;
+			Leaf->Next = NextLeaf->Id;
+			WriteNode(Leaf);
+			Leaf = NextLeaf;
+		}
+
+		check(Leaf->Num() == 0 || Compare(Leaf->GetKey(Leaf->Num() - 1), Entry) < 0);
+		if (Leaf->Num() == 0)
+			Level.Emplace(Leaf->Id, Entry);
+		AppendKey(*Leaf, Entry);
+	}
+	WriteNode(Leaf);
+
+	while (Level.Num() > 1)
+	{
+		TArray<TPair<uint32, TArray<uint8>>> Upper;
+		TSharedPtr<FKeyBTreeNode> Node;
+		for (auto& Child : Level)
+		{
+			if (Node.IsValid() && Node->Num() > 0 && GetPageSize(*Node) + Child.Value.Num() + (int32)(sizeof(uint16) + sizeof(uint32)) > Capacity)
+			{
+				WriteNode(Node.ToSharedRef());
+				Node.Reset();
+			}
+
+			if (!Node.IsValid())
+			{
+				Node = NewNode(CreatePage(), false);
+				Upper.Emplace(Node->Id, MoveTemp(Child.Value));
+			}
+			else
+			{
+				AppendKey(*Node, Child.Value);
+			}
+			Node->Children.Add(Child.Key);
+		}
+		WriteNode(Node.ToSharedRef());
+		Level = MoveTemp(Upper);
+	}
+
+	Header.RootNode = Level[0].Key;
+	FlushHeader();
+}
+
+FString FKeyBTree::GetTypeName()const
+{
+	return TEXT("KeyBTreeSeacher");
+}
+
+void FKeyBTree::Init()
+{
+	Header.MagicNum = KEY_BTREE_MAGIC_NUM;
+	Header.PageCount = 0;
+	Header.FreePage = INVALID_NODE;
+	NodeCache.Reset();
+
+	Header.RootNode = CreatePage();
+	WriteNode(NewNode(Header.RootNode, true));
+	FlushHeader();
+}
+
+void FKeyBTree::Open()
+{
+	File->ReadAt(0, Header);
+	check(Header.MagicNum == KEY_BTREE_MAGIC_NUM);
+	NodeCache.Reset();
+}
+
+bool FKeyBTree::IsKeyBTree(FFile::Ptr File)
+{
+	int MagicNum = 0;
+	return File->ReadAt(0, MagicNum) && MagicNum == KEY_BTREE_MAGIC_NUM;
+}
+
+FKeyBTree::FNodeRef FKeyBTree::GetNode(uint32 Node)
+{
+	if (auto Cached = NodeCache.GetAndRefer(Node))
+		return *Cached;
+
+	auto Result = ReadNode(Node);
+	NodeCache.Push(Node, Result);
+	return Result;
+}
+
+FKeyBTree::FNodeRef FKeyBTree::ReadNode(uint32 Node)
+{
+	TArray<uint8> Page;
+	Page.SetNumUninitialized(FILE_PAGE_SIZE);
+	CHECK_RESULT(File->ReadAt(GetKeyNodeOffset(Node), Page.GetData(), Page.Num()));
+
+	FKeyNodeHeader NodeHeader;
+	FMemory::Memcpy(&NodeHeader, Page.GetData(), sizeof(NodeHeader));
+
+	auto Result = NewNode(Node, NodeHeader.bLeaf != 0);
+	Result->Prev = NodeHeader.Prev;
+	Result->Next = NodeHeader.Next;
+
+	int32 Num = NodeHeader.Num;
+	auto Cur = Page.GetData() + sizeof(NodeHeader);
+	Result->Offsets.SetNumUninitialized(Num + 1);
+	for (auto Index : XRange(Num))
+	{
+		uint16 Offset;
+		FMemory::Memcpy(&Offset, Cur + Index * sizeof(uint16), sizeof(uint16));
+		Result->Offsets[Index] = Offset;
+	}
+	Result->Offsets[Num] = NodeHeader.BytesSize;
+	Cur += Num * sizeof(uint16);
+
+	if (!Result->bLeaf)
+	{
+		Result->Children.SetNumUninitialized(Num + 1);
+		FMemory::Memcpy(Result->Children.GetData(), Cur, (Num + 1) * sizeof(uint32));
+		Cur += (Num + 1) * sizeof(uint32);
+	}
+
+	check(Cur + NodeHeader.BytesSize <= Page.GetData() + Page.Num());
+	Result->Bytes.Append(Cur, NodeHeader.BytesSize);
+	return Result;
+}
+
+void FKeyBTree::WriteNode(const TSharedRef<FKeyBTreeNode>& Node)
+{
+	auto Num = Node->Num();
+	TArray<uint8> Page;
+	Page.SetNumUninitialized(GetPageSize(*Node));
+	check(Page.Num() <= FILE_PAGE_SIZE);
+
+	FKeyNodeHeader NodeHeader = { (uint8)Node->bLeaf, 0, (uint16)Num, Node->Prev, Node->Next, (uint32)Node->Bytes.Num() };
+	FMemory::Memcpy(Page.GetData(), &NodeHeader, sizeof(NodeHeader));
+
+	auto Cur = Page.GetData() + sizeof(NodeHeader);
+	for (auto Index : XRange(Num))
+	{
+		uint16 Offset = (uint16)Node->Offsets[Index];
+		FMemory::Memcpy(Cur + Index * sizeof(uint16), &Offset, sizeof(uint16));
+	}
+	Cur += Num * sizeof(uint16);
+
+	if (!Node->bLeaf)
+	{
+		check(Node->Children.Num() == Num + 1);
+		FMemory::Memcpy(Cur, Node->Children.GetData(), (Num + 1) * sizeof(uint32));
+		Cur += (Num + 1) * sizeof(uint32);
+	}
+	FMemory::Memcpy(Cur, Node->Bytes.GetData(), Node->Bytes.Num());
+
+	CHECK_RESULT(File->WriteAt(GetKeyNodeOffset(Node->Id), Page.GetData(), Page.Num()));
+	NodeCache.Push(Node->Id, Node);
+}
+
+uint32 FKeyBTree::CreatePage()
+{
+	if (Header.FreePage != INVALID_NODE)
+	{
+		auto Page = Header.FreePage;
+		CHECK_RESULT(File->ReadAt(GetKeyNodeOffset(Page), Header.FreePage));
+		FlushHeader();
+		return Page;
+	}
+
+	File->AppendPage();
+	auto NewPage = ++Header.PageCount;
+	FlushHeader();
+
+	return NewPage;
+}
+
+void FKeyBTree::ReleasePage(uint32 Page)
+{
+	NodeCache.Remove(Page);
+	File->WriteAt(GetKeyNodeOffset(Page), Header.FreePage);
+	Header.FreePage = Page;
+	FlushHeader();
+}
+
+void FKeyBTree::FlushHeader()
+{
+	File->WriteAt(0, Header);
+}
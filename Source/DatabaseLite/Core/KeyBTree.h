@@ -0,0 +1,121 @@
+#pragma once
+
+#include "File.h"
+#include "LRUCache.h"
+
+// a node read into memory, its keys are packed into one buffer
+struct FKeyBTreeNode
+{
+	uint32 Id;
+	bool bLeaf;
+	// the leaves form a list in key order
+	uint32 Prev;
+	uint32 Next;
+	TArray<uint8> Bytes;
+	// key i is Bytes[Offsets[i], Offsets[i + 1])
+	TArray<int32> Offsets;
+	// one more than keys, child i holds the keys below key i
+	TArray<uint32> Children;
+
+	int32 Num() const { return Offsets.Num() - 1; }
+	TArrayView<const uint8> GetKey(int32 Index) const
+	{
+		return TArrayView<const uint8>(Bytes.GetData() + Offsets[Index], Offsets[Index + 1] - Offsets[Index]);
+	}
+};
+
+/*
+	walks the entries from Lo up to the last one starting with Hi, or the other way round.
+	the tree must not be modified while a cursor is in use
+*/
+class FKeyBTreeCursor
+{
+public:
+	bool IsValid() const { return Node.IsValid(); }
+	// the key without the data
+	TArrayView<const uint8> GetKey() const;
+	uint32 GetData() const;
+	void Next();
+
+private:
+	friend class FKeyBTree;
+	void Settle();
+
+	class FKeyBTree* Tree = nullptr;
+	TSharedPtr<const FKeyBTreeNode> Node;
+	int32 Pos = 0;
+	TArray<uint8> Lo;
+	TArray<uint8> Hi;
+	bool bAscending = true;
+};
+
+/*
+	B+tree over memcomparable byte keys, the keys of a node take as much of the page as they need.
+	a key may be stored with several datas, the data is appended big-endian to the key to make every entry unique,
+	so equal keys are neighbours and every search is a range search
+*/
+class FKeyBTree
+{
+	friend class FKeyBTreeCursor;
+
+public:
+	static constexpr int32 MAX_KEY_SIZE = 1024;
+public:
+	FKeyBTree(FFile::Ptr File);
+
+	TArray<uint32> Find(TArrayView<const uint8> Key);
+	// Callback returns true to stop, the result is whether it did
+	bool FindOne(TArrayView<const uint8> Key, const TFunction<bool(uint32)>& Callback);
+	// Lo is inclusive, every key starting with Hi is in range
+	FKeyBTreeCursor FindRange(TArrayView<const uint8> Lo, TArrayView<const uint8> Hi, bool bAscending = true);
+
+	void Insert(TArrayView<const uint8> Key, uint32 Data);
+	// removes the entry of Key with Data, false if there is none. a node below a quarter of its page
+	// borrows from a sibling or is merged into it
+	bool Remove(TArrayView<const uint8> Key, uint32 Data);
+	// builds the tree bottom-up from entries sorted by key and data, the tree must be empty
+	void BulkLoad(const TArray<TPair<TArrayView<const uint8>, uint32>>& Entries, float FillFactor = 1.0f);
+	FString GetTypeName()const;
+
+	void Init();
+	void Open();
+
+	// whether the file holds a tree of this kind
+	static bool IsKeyBTree(FFile::Ptr File);
+
+private:
+	using FNodeRef = TSharedPtr<const FKeyBTreeNode>;
+
+	// leaf and position of the first entry not below Key, the position may be the end of the leaf
+	FNodeRef FindLeaf(TArrayView<const uint8> Key, int32& Pos);
+	FNodeRef GetNode(uint32 Node);
+	FNodeRef ReadNode(uint32 Node);
+	// writes the node and caches it, the node must not be changed afterwards
+	void WriteNode(const TSharedRef<FKeyBTreeNode>& Node);
+	// splits a node too large for its page, Separator is the key to insert into the parent before Right
+	void Split(FKeyBTreeNode& Left, FKeyBTreeNode& Right, TArray<uint8>& Separator);
+	// Path holds the nodes above Node and the child taken in each, Node is written by it
+	void Rebalance(TSharedRef<FKeyBTreeNode> Node, TArray<TPair<uint32, int32>, TInlineAllocator<16>>& Path);
+	// the first page of the free list or a new one
+	uint32 CreatePage();
+	// puts the page of a dropped node on the free list
+	void ReleasePage(uint32 Page);
+
+	void FlushHeader();
+
+private:
+	FFile::Ptr File;
+
+	// decoded nodes, a written node replaces its entry
+	static constexpr int NODE_CACHE_SIZE = 128;
+	TFlatLRUCache<uint32, FNodeRef, NODE_CACHE_SIZE> NodeCache;
+
+	struct
+	{
+		int MagicNum;
+		uint32 RootNode;
+		uint32 PageCount;
+		// released pages, each holds the id of the next one
+		uint32 FreePage;
+	}Header;
+};
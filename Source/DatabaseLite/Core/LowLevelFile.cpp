@@ -1,6 +1,28 @@
 #include "LowLevelFile.h"
 #include "HAL/PlatformFilemanager.h"
 #include "GenericPlatform/GenericPlatformFile.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "Misc/ScopeRWLock.h"
+
+#define WITH_MAPPED_FILE (PLATFORM_WINDOWS || PLATFORM_UNIX || PLATFORM_MAC || PLATFORM_ANDROID || PLATFORM_IOS)
+
+#if PLATFORM_WINDOWS
+#include "Windows/WindowsHWrapper.h"
+#elif WITH_MAPPED_FILE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#endif
+
+bool ILowLevelFile::Preallocate(uint64 Offset, uint64 Size)
+{
+	static const uint8 Zeros[4096] = {};
+	auto Count = (uint32)FMath::Min<uint64>(Size, sizeof(Zeros));
+	return Count == 0 || WriteAt(Offset + Size - Count, Zeros, Count);
+}
 
 ILowLevelFile::Ptr FGenericPlatformFile::OpenRead(const FString& FileName)
 {
@@ -17,6 +39,26 @@ ILowLevelFile::Ptr FGenericPlatformFile::OpenWrite(const FString& FileName, bool
 
 
 
+bool FGenericPlatformFile::ReadAt(uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	FScopeLock Lock(&Mutex);
+	return FileHandle->Seek(Offset) && FileHandle->Read(Buffer, Size);
+}
+
+bool FGenericPlatformFile::WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size)
+{
+	FScopeLock Lock(&Mutex);
+	return FileHandle->Seek(Offset) && FileHandle->Write(Buffer, Size);
+}
+
+bool FGenericPlatformFile::Flush()
+{
+	FScopeLock Lock(&Mutex);
+	return FileHandle->Flush(true);
+}
+
+
+
 ILowLevelFile::Ptr FCachedFile::OpenRead(const FString& FileName)
 {
 	auto& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
@@ -39,84 +81,172 @@ FCachedFile::FCachedFile()
 
 FCachedFile::~FCachedFile()
 {
-
+	FScopeLock Lock(&Mutex);
+	if (FileHandle)
+		WriteDirtyPages();
 }
 
 bool FCachedFile::Write(const uint8* Buffer, uint32 Size)
 {
-	auto Pos = Tell();
-	auto Index = Pos / SINGLE_CACHE_SIZE;
-	auto Offset = Pos % SINGLE_CACHE_SIZE;
-	auto Space = SINGLE_CACHE_SIZE - Offset;
-	if (Space < Size)
+	if (!WriteAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+bool FCachedFile::Read(uint8* Buffer, uint32 Size)
+{
+	if (!ReadAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+uint64 FCachedFile::Tell()
+{
+	return Pos;
+}
+
+bool FCachedFile::Seek(uint64 InPos)
+{
+	Pos = InPos;
+	return true;
+}
+
+bool FCachedFile::ReadAt(uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	FScopeLock Lock(&Mutex);
+	while (Size > 0)
 	{
-		if (!Write(Buffer, Space))
-		{ 
+		auto Index = (uint32)(Offset / SINGLE_CACHE_SIZE);
+		auto PageOffset = (uint32)(Offset % SINGLE_CACHE_SIZE);
+		auto Count = FMath::Min(SINGLE_CACHE_SIZE - PageOffset, Size);
+
+		FCachedPage* Page = PageCaches.GetAndRefer(Index + 1);
+		if (!Page && FileSize >= (uint64)(Index + 1) * SINGLE_CACHE_SIZE)
+		{
+			Page = LoadPage(Index, false);
+			if (!Page)
+				return false;
+		}
+
+		// dirty pages are always cached, a partial page which is not is up to date on disk
+		if (Page)
+		{
+			FMemory::Memcpy(Buffer, Page->Data.GetData() + PageOffset, Count);
+		}
+		else if (!FileHandle->Seek(Offset) || !FileHandle->Read(Buffer, Count))
+		{
 			return false;
 		}
 
-		return Write(Buffer + Space, Size - Space);
-	}
-	if (auto Cache = PageCaches.Get(Index + 1))
-	{
-		FMemory::Memcpy(Cache->GetData() + Offset, Buffer, Size);
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
 	}
-	return FileHandle->Write(Buffer, Size);
+	return true;
 }
 
-bool FCachedFile::Read(uint8* Buffer, uint32 Size)
+bool FCachedFile::WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size)
 {
-	const auto Pos = Tell();
-	auto Index = Pos / SINGLE_CACHE_SIZE;
-	auto Offset = Pos % SINGLE_CACHE_SIZE;
-	auto Space = SINGLE_CACHE_SIZE - Offset;
-	if (Space < Size)
+	FScopeLock Lock(&Mutex);
+	while (Size > 0)
 	{
-		if (!Read(Buffer, Space))
+		auto Index = (uint32)(Offset / SINGLE_CACHE_SIZE);
+		auto PageOffset = (uint32)(Offset % SINGLE_CACHE_SIZE);
+		auto Count = FMath::Min(SINGLE_CACHE_SIZE - PageOffset, Size);
+
+		FCachedPage* Page = PageCaches.GetAndRefer(Index + 1);
+		if (!Page && !(Page = LoadPage(Index, Count == SINGLE_CACHE_SIZE)))
 			return false;
 
-		return Read(Buffer + Space, Size - Space);
-	}
+		FMemory::Memcpy(Page->Data.GetData() + PageOffset, Buffer, Count);
+		Page->bDirty = true;
 
-	TArray<uint8>* Cache = PageCaches.Get(Index + 1);
-	if (Cache)
-	{
-		FMemory::Memcpy(Buffer, Cache->GetData() + Offset, Size);
-		PageCaches.Refer(Index + 1);
-		FileHandle->Seek(Pos + Size);
-		return true;
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
+		FileSize = FMath::Max(FileSize, Offset);
 	}
-	else if (FileHandle->Size() >= (Index + 1) * SINGLE_CACHE_SIZE)
-	{
+	return true;
+}
 
-		Cache = PageCaches.Push(Index + 1);
-		if (Cache)
-		{
-			Cache->SetNumUninitialized(SINGLE_CACHE_SIZE);
-			FileHandle->Seek(Index * SINGLE_CACHE_SIZE);
-			if (!FileHandle->Read(Cache->GetData(), SINGLE_CACHE_SIZE))
-			{
-				return false;
-			}
-			FMemory::Memcpy(Buffer, Cache->GetData() + Offset, Size);
-			return FileHandle->Seek(Pos + Size);
-		}
-	}
-	return FileHandle->Read(Buffer, Size);
+bool FCachedFile::Flush()
+{
+	FScopeLock Lock(&Mutex);
+	return WriteDirtyPages() && FileHandle->Flush(true);
 }
 
-uint32 FCachedFile::Tell()
+FCachedFile::FCachedPage* FCachedFile::LoadPage(uint32 Index, bool bOverwrite)
 {
-	return FileHandle->Tell();
+	uint32 EvictedKey;
+	auto Evicted = PageCaches.GetLeastRecent(EvictedKey);
+	if (Evicted && Evicted->bDirty && !WritePage(EvictedKey - 1, *Evicted))
+		return nullptr;
+
+	auto Page = PageCaches.Push(Index + 1);
+	Page->bDirty = false;
+	Page->Data.SetNumUninitialized(SINGLE_CACHE_SIZE, false);
+
+	// the part behind the end of the file on disk may only exist in dirty pages which were evicted, it reads as zero
+	const int64 Begin = (int64)Index * SINGLE_CACHE_SIZE;
+	const int64 DiskSize = FileHandle->Size();
+	auto Count = bOverwrite ? 0 : (uint32)FMath::Clamp<int64>(DiskSize - Begin, 0, SINGLE_CACHE_SIZE);
+	if (Count > 0 && (!FileHandle->Seek(Begin) || !FileHandle->Read(Page->Data.GetData(), Count)))
+	{
+		PageCaches.Remove(Index + 1);
+		return nullptr;
+	}
+	FMemory::Memzero(Page->Data.GetData() + Count, SINGLE_CACHE_SIZE - Count);
+	return Page;
 }
 
-bool FCachedFile::Seek(uint32 Pos)
+bool FCachedFile::WritePage(uint32 Index, FCachedPage& Page)
 {
-	return FileHandle->Seek(Pos);
+	const uint64 Begin = (uint64)Index * SINGLE_CACHE_SIZE;
+	auto Count = (uint32)FMath::Min<uint64>(FileSize - Begin, SINGLE_CACHE_SIZE);
+	if (!FileHandle->Seek(Begin) || !FileHandle->Write(Page.Data.GetData(), Count))
+		return false;
+
+	Page.bDirty = false;
+	return true;
 }
 
+bool FCachedFile::WriteDirtyPages()
+{
+	TArray<uint32> Dirty;
+	PageCaches.ForEach([&](uint32 Key, FCachedPage& Page) {
+		if (Page.bDirty)
+			Dirty.Add(Key - 1);
+	});
+	Dirty.Sort();
+
+	TArray<uint8> Buffer;
+	for (int Begin = 0; Begin < Dirty.Num();)
+	{
+		auto End = Begin + 1;
+		while (End < Dirty.Num() && Dirty[End] == Dirty[End - 1] + 1)
+			++End;
 
+		Buffer.Reset();
+		for (auto Index = Begin; Index < End; ++Index)
+		{
+			Buffer.Append(PageCaches.Get(Dirty[Index] + 1)->Data);
+		}
 
+		const uint64 Offset = (uint64)Dirty[Begin] * SINGLE_CACHE_SIZE;
+		auto Count = (uint32)FMath::Min<uint64>(FileSize - Offset, Buffer.Num());
+		if (!FileHandle->Seek(Offset) || !FileHandle->Write(Buffer.GetData(), Count))
+			return false;
+
+		for (auto Index = Begin; Index < End; ++Index)
+		{
+			PageCaches.Get(Dirty[Index] + 1)->bDirty = false;
+		}
+		Begin = End;
+	}
+	return true;
+}
 
 
 ILowLevelFile::Ptr FMemoryFile::OpenRead(const FString& FileName)
@@ -145,65 +275,551 @@ FMemoryFile::~FMemoryFile()
 
 bool FMemoryFile::Write(const uint8* Buffer, uint32 Size)
 {
-	check(Size <= MEMORY_PAGE_SIZE);
-	auto Index = Pos / MEMORY_PAGE_SIZE;
-	auto Offset = Pos % MEMORY_PAGE_SIZE;
-	auto Space = MEMORY_PAGE_SIZE - Offset;
+	if (!WriteAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
 
-	if (Space < Size)
+bool FMemoryFile::Read(uint8* Buffer, uint32 Size)
+{
+	if (!ReadAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+uint64 FMemoryFile::Tell()
+{
+	return Pos;
+}
+
+bool FMemoryFile::Seek(uint64 InPos)
+{
+	if (InPos / MEMORY_PAGE_SIZE >= (uint32)Pages.Num())
+		return false;
+	Pos = InPos;
+	return true;
+}
+
+bool FMemoryFile::ReadAt(uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	while (Size > 0)
 	{
-		if (!Write(Buffer, Space))
+		auto Index = (uint32)(Offset / MEMORY_PAGE_SIZE);
+		if (Index >= (uint32)Pages.Num())
 			return false;
-		
-		return Write(Buffer + Space, Size - Space);
-		
+
+		auto PageOffset = (uint32)(Offset % MEMORY_PAGE_SIZE);
+		auto Count = FMath::Min(MEMORY_PAGE_SIZE - PageOffset, Size);
+		FMemory::Memcpy(Buffer, Pages[Index] + PageOffset, Count);
+
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
 	}
-	else if (Space == Size && Index == Pages.Num() - 1)
+	return true;
+}
+
+bool FMemoryFile::WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size)
+{
+	DataSize = FMath::Max(DataSize, Offset + Size);
+	while (Size > 0)
 	{
-		AppendPage();
-	}
+		auto Index = (uint32)(Offset / MEMORY_PAGE_SIZE);
+		auto PageOffset = (uint32)(Offset % MEMORY_PAGE_SIZE);
+		auto Count = FMath::Min(MEMORY_PAGE_SIZE - PageOffset, Size);
+		// keep one page ahead so that seeking to the end of the data is always valid
+		while (Index + 1 >= (uint32)Pages.Num())
+		{
+			AppendPage();
+		}
+		FMemory::Memcpy(Pages[Index] + PageOffset, Buffer, Count);
 
-	Pos += Size;
-	FMemory::Memcpy(Pages[Index] + Offset, Buffer, Size);
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
+	}
 	return true;
 }
 
-bool FMemoryFile::Read(uint8* Buffer, uint32 Size)
+const uint8* FMemoryFile::Pin(uint64 Offset, uint32 Size)
 {
-	check(Size <= MEMORY_PAGE_SIZE);
-	auto Index = Pos / MEMORY_PAGE_SIZE;
-	if (Index >= (uint32)Pages.Num())
-		return false;
+	// the pages never move, a range inside of one can be used in place
+	auto Index = (uint32)(Offset / MEMORY_PAGE_SIZE);
+	if (Index >= (uint32)Pages.Num() || Offset % MEMORY_PAGE_SIZE + Size > MEMORY_PAGE_SIZE)
+		return nullptr;
+	return Pages[Index] + Offset % MEMORY_PAGE_SIZE;
+}
+
+void FMemoryFile::AppendPage()
+{
+	// preallocated ranges are only written at their end
+	Pages.Add((uint8*)FMemory::MallocZeroed(MEMORY_PAGE_SIZE));
+}
 
-	auto Offset = Pos % MEMORY_PAGE_SIZE;
-	auto Space = MEMORY_PAGE_SIZE - Offset;
-	if (Space < Size)
+ILowLevelFile::Ptr FLoadedFile::OpenRead(const FString& FileName)
+{
+	TSharedPtr<FLoadedFile> File(new FLoadedFile());
+	File->FileName = FileName;
+	if (!File->Load())
+		return {};
+	return File;
+}
+
+ILowLevelFile::Ptr FLoadedFile::OpenWrite(const FString& FileName, bool bAppend, bool bAllowRead)
+{
+	TSharedPtr<FLoadedFile> File(new FLoadedFile());
+	File->FileName = FileName;
+	File->bWritable = true;
+	// a truncated file is only replaced on disk by the first Persist
+	if (bAppend && !File->Load())
+		return {};
+	File->bDirty = !bAppend;
+	return File;
+}
+
+bool FLoadedFile::Load()
+{
+	auto& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	TUniquePtr<IFileHandle> Handle(PlatformFile.OpenRead(*FileName));
+	if (!Handle)
+		return !PlatformFile.FileExists(*FileName);
+
+	// one pass over the file, every memory page with a single read
+	const uint64 Size = Handle->Size();
+	Pages.Reserve(Size / MEMORY_PAGE_SIZE + 2);
+	for (uint64 Offset = 0; Offset < Size; Offset += MEMORY_PAGE_SIZE)
 	{
-		if (!Read(Buffer, Space))
+		auto Index = (int32)(Offset / MEMORY_PAGE_SIZE);
+		while (Index + 1 >= Pages.Num())
+		{
+			AppendPage();
+		}
+		if (!Handle->Read(Pages[Index], (int64)FMath::Min<uint64>(Size - Offset, MEMORY_PAGE_SIZE)))
 			return false;
+	}
+	DataSize = Size;
+	return true;
+}
 
-		return Read(Buffer + Space, Size - Space);
+bool FLoadedFile::WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size)
+{
+	check(bWritable);
+	bDirty = true;
+	return FMemoryFile::WriteAt(Offset, Buffer, Size);
+}
+
+bool FLoadedFile::Persist()
+{
+	if (!bWritable || !bDirty)
+		return true;
+
+	// the data goes to a new file first, a failure on the way leaves the old one as it was
+	auto& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	const FString TempName = FileName + TEXT(".tmp");
+	bool bWritten = false;
+	{
+		TUniquePtr<IFileHandle> Handle(PlatformFile.OpenWrite(*TempName));
+		bWritten = Handle.IsValid();
+		for (uint64 Offset = 0; bWritten && Offset < DataSize; Offset += MEMORY_PAGE_SIZE)
+		{
+			bWritten = Handle->Write(Pages[(int32)(Offset / MEMORY_PAGE_SIZE)], (int64)FMath::Min<uint64>(DataSize - Offset, MEMORY_PAGE_SIZE));
+		}
+		bWritten = bWritten && Handle->Flush(true);
 	}
+
+	// windows and posix replace the old file in one step, a crash leaves either of them but never neither.
+	// elsewhere the old file is deleted first, a crash in between leaves the data only in the temporary file
+#if PLATFORM_WINDOWS
+	const FString FullName = FPaths::ConvertRelativePathToFull(FileName);
+	const FString FullTempName = FPaths::ConvertRelativePathToFull(TempName);
+	bWritten = bWritten && MoveFileExW(*FullTempName, *FullName, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#elif WITH_MAPPED_FILE
+	const FString FullName = FPaths::ConvertRelativePathToFull(FileName);
+	const FString FullTempName = FPaths::ConvertRelativePathToFull(TempName);
+	bWritten = bWritten && rename(TCHAR_TO_UTF8(*FullTempName), TCHAR_TO_UTF8(*FullName)) == 0;
+#else
+	bWritten = bWritten && (!PlatformFile.FileExists(*FileName) || PlatformFile.DeleteFile(*FileName));
+	// the old file is gone, the temporary one is all that is left of the data
+	if (bWritten && !PlatformFile.MoveFile(*FileName, *TempName))
+		return false;
+#endif
+	if (!bWritten)
+	{
+		PlatformFile.DeleteFile(*TempName);
+		return false;
+	}
+
+	bDirty = false;
+	return true;
+}
+
+
+
+
+ILowLevelFile::Ptr FMappedFile::OpenRead(const FString& FileName)
+{
+#if WITH_MAPPED_FILE
+	TSharedPtr<FMappedFile> File(new FMappedFile());
+	if (!File->Open(FileName, false, false))
+		return {};
+	return File;
+#else
+	return FCachedFile::OpenRead(FileName);
+#endif
+}
+
+ILowLevelFile::Ptr FMappedFile::OpenWrite(const FString& FileName, bool bAppend, bool bAllowRead)
+{
+#if WITH_MAPPED_FILE
+	TSharedPtr<FMappedFile> File(new FMappedFile());
+	if (!File->Open(FileName, true, !bAppend))
+		return {};
+	return File;
+#else
+	return FCachedFile::OpenWrite(FileName, bAppend, bAllowRead);
+#endif
+}
+
+FMappedFile::~FMappedFile()
+{
+	Close();
+}
+
+bool FMappedFile::Write(const uint8* Buffer, uint32 Size)
+{
+	if (!WriteAt(Pos, Buffer, Size))
+		return false;
 	Pos += Size;
-	FMemory::Memcpy(Buffer, Pages[Index] + Offset, Size);
 	return true;
+}
 
+bool FMappedFile::Read(uint8* Buffer, uint32 Size)
+{
+	if (!ReadAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
 }
 
-uint32 FMemoryFile::Tell()
+uint64 FMappedFile::Tell()
 {
 	return Pos;
 }
 
-bool FMemoryFile::Seek(uint32 InPos)
+bool FMappedFile::Seek(uint64 InPos)
 {
-	if (InPos / MEMORY_PAGE_SIZE >= (uint32)Pages.Num())
+	if (!bWritable && InPos > DataSize)
 		return false;
 	Pos = InPos;
 	return true;
 }
 
-void FMemoryFile::AppendPage()
+bool FMappedFile::ReadAt(uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	FReadScopeLock Lock(MappingLock);
+	if ((uint64)Offset + Size > DataSize)
+		return false;
+
+	FMemory::Memcpy(Buffer, MappedData + Offset, Size);
+	return true;
+}
+
+bool FMappedFile::WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size)
 {
-	Pages.Add((uint8*)FMemory::Malloc(MEMORY_PAGE_SIZE));
+	if (!bWritable)
+		return false;
+
+	const uint64 End = (uint64)Offset + Size;
+	if (End > MappedSize)
+	{
+		FWriteScopeLock Lock(MappingLock);
+		if (End > MappedSize && !Remap(Align(End, MAPPED_GROW_SIZE)))
+			return false;
+	}
+
+	FReadScopeLock Lock(MappingLock);
+	FMemory::Memcpy(MappedData + Offset, Buffer, Size);
+	// only grows, writers of the same file are serialised by the database
+	DataSize = FMath::Max(DataSize, End);
+	return true;
+}
+
+const uint8* FMappedFile::Pin(uint64 Offset, uint32 Size)
+{
+	FReadScopeLock Lock(MappingLock);
+	if (!MappedData || Offset + Size > DataSize)
+		return nullptr;
+
+	PinCount.Increment();
+	return MappedData + Offset;
 }
+
+void FMappedFile::Unpin(uint64 Offset)
+{
+	if (PinCount.Decrement() > 0 || RetiredCount.GetValue() == 0)
+		return;
+
+	FWriteScopeLock Lock(MappingLock);
+	if (PinCount.GetValue() == 0)
+		ReleaseRetired();
+}
+
+bool FMappedFile::Preallocate(uint64 Offset, uint64 Size)
+{
+	if (!bWritable)
+		return false;
+
+	FWriteScopeLock Lock(MappingLock);
+	const uint64 End = Offset + Size;
+	if (End > MappedSize && !Remap(Align(End, MAPPED_GROW_SIZE)))
+		return false;
+
+#if PLATFORM_LINUX
+	// the mapping only made the file longer, fallocate gives the range real blocks so writing it can not run out of space
+	if (Size > 0 && posix_fallocate(FileDescriptor, Offset, Size) != 0)
+		return false;
+#endif
+
+	// the range is kept when closing
+	DataSize = FMath::Max(DataSize, End);
+	return true;
+}
+
+#if PLATFORM_WINDOWS
+
+void FMappedFile::Prefetch(uint64 Offset, uint64 Size)
+{
+	// the pages are faulted in on access, PrefetchVirtualMemory is not available everywhere
+}
+
+bool FMappedFile::IsValid()
+{
+	return FileHandle != nullptr;
+}
+
+bool FMappedFile::Open(const FString& FileName, bool bWrite, bool bTruncate)
+{
+	const FString FullPath = FPaths::ConvertRelativePathToFull(FileName);
+	const DWORD Access = bWrite ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+	const DWORD Creation = bWrite ? (bTruncate ? CREATE_ALWAYS : OPEN_ALWAYS) : OPEN_EXISTING;
+	HANDLE Handle = CreateFileW(*FullPath, Access, FILE_SHARE_READ, nullptr, Creation, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (Handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	FileHandle = Handle;
+	bWritable = bWrite;
+
+	LARGE_INTEGER FileSize;
+	if (!GetFileSizeEx(Handle, &FileSize))
+		return false;
+
+	DataSize = FileSize.QuadPart;
+	return DataSize == 0 || Remap(bWritable ? Align(DataSize, MAPPED_GROW_SIZE) : DataSize);
+}
+
+bool FMappedFile::Remap(uint64 NewSize)
+{
+	Unmap();
+
+	ULARGE_INTEGER MappingSize;
+	MappingSize.QuadPart = NewSize;
+	// a writable mapping larger than the file extends the file
+	MappingHandle = CreateFileMappingW((HANDLE)FileHandle, nullptr, bWritable ? PAGE_READWRITE : PAGE_READONLY, MappingSize.HighPart, MappingSize.LowPart, nullptr);
+	if (!MappingHandle)
+		return false;
+
+	MappedData = (uint8*)MapViewOfFile((HANDLE)MappingHandle, bWritable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)NewSize);
+	if (!MappedData)
+	{
+		Unmap();
+		return false;
+	}
+	MappedSize = NewSize;
+	return true;
+}
+
+bool FMappedFile::Flush()
+{
+	FReadScopeLock Lock(MappingLock);
+	if (!bWritable)
+		return true;
+	if (MappedData && !FlushViewOfFile(MappedData, (SIZE_T)DataSize))
+		return false;
+	return FlushFileBuffers((HANDLE)FileHandle) != 0;
+}
+
+void FMappedFile::Unmap()
+{
+	// pinned views keep the old mapping until the last one is released
+	if (MappedData && PinCount.GetValue() > 0)
+	{
+		RetiredMappings.Add({ MappedData, MappedSize, MappingHandle });
+		RetiredCount.Increment();
+	}
+	else
+	{
+		if (MappedData)
+			UnmapViewOfFile(MappedData);
+		if (MappingHandle)
+			CloseHandle((HANDLE)MappingHandle);
+	}
+
+	MappedData = nullptr;
+	MappingHandle = nullptr;
+	MappedSize = 0;
+}
+
+void FMappedFile::ReleaseRetired()
+{
+	for (auto& Mapping : RetiredMappings)
+	{
+		UnmapViewOfFile(Mapping.Data);
+		if (Mapping.Handle)
+			CloseHandle((HANDLE)Mapping.Handle);
+	}
+	RetiredMappings.Reset();
+	RetiredCount.Reset();
+}
+
+void FMappedFile::Close()
+{
+	checkf(PinCount.GetValue() == 0, TEXT("row views are still pinned"));
+	Unmap();
+	ReleaseRetired();
+	if (!FileHandle)
+		return;
+
+	if (bWritable)
+	{
+		// drop the preallocated tail
+		LARGE_INTEGER End;
+		End.QuadPart = DataSize;
+		SetFilePointerEx((HANDLE)FileHandle, End, nullptr, FILE_BEGIN);
+		SetEndOfFile((HANDLE)FileHandle);
+	}
+	CloseHandle((HANDLE)FileHandle);
+	FileHandle = nullptr;
+}
+
+#elif WITH_MAPPED_FILE
+
+void FMappedFile::Prefetch(uint64 Offset, uint64 Size)
+{
+	FReadScopeLock Lock(MappingLock);
+	if (!MappedData || Offset >= DataSize)
+		return;
+
+	// madvise needs a page aligned start
+	const uint64 PageSize = FPlatformMemory::GetConstants().PageSize;
+	const uint64 Begin = AlignDown(Offset, PageSize);
+	const uint64 End = FMath::Min(Offset + Size, DataSize);
+	madvise(MappedData + Begin, End - Begin, MADV_WILLNEED);
+}
+
+bool FMappedFile::IsValid()
+{
+	return FileDescriptor != -1;
+}
+
+bool FMappedFile::Open(const FString& FileName, bool bWrite, bool bTruncate)
+{
+	const FString FullPath = FPaths::ConvertRelativePathToFull(FileName);
+	int Flags = bWrite ? (O_RDWR | O_CREAT) : O_RDONLY;
+	if (bWrite && bTruncate)
+		Flags |= O_TRUNC;
+
+	FileDescriptor = open(TCHAR_TO_UTF8(*FullPath), Flags, 0644);
+	if (FileDescriptor == -1)
+		return false;
+
+	bWritable = bWrite;
+
+	struct stat FileStat;
+	if (fstat(FileDescriptor, &FileStat) != 0)
+		return false;
+
+	DataSize = FileStat.st_size;
+	return DataSize == 0 || Remap(bWritable ? Align(DataSize, MAPPED_GROW_SIZE) : DataSize);
+}
+
+bool FMappedFile::Remap(uint64 NewSize)
+{
+	Unmap();
+
+	if (bWritable && ftruncate(FileDescriptor, NewSize) != 0)
+		return false;
+
+	void* Data = mmap(nullptr, NewSize, bWritable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, FileDescriptor, 0);
+	if (Data == MAP_FAILED)
+		return false;
+
+	MappedData = (uint8*)Data;
+	MappedSize = NewSize;
+	return true;
+}
+
+bool FMappedFile::Flush()
+{
+	FReadScopeLock Lock(MappingLock);
+	if (!bWritable || !MappedData)
+		return true;
+	return msync(MappedData, MappedSize, MS_SYNC) == 0;
+}
+
+void FMappedFile::Unmap()
+{
+	// pinned views keep the old mapping until the last one is released
+	if (MappedData && PinCount.GetValue() > 0)
+	{
+		RetiredMappings.Add({ MappedData, MappedSize, nullptr });
+		RetiredCount.Increment();
+	}
+	else if (MappedData)
+	{
+		munmap(MappedData, MappedSize);
+	}
+
+	MappedData = nullptr;
+	MappedSize = 0;
+}
+
+void FMappedFile::ReleaseRetired()
+{
+	for (auto& Mapping : RetiredMappings)
+	{
+		munmap(Mapping.Data, Mapping.Size);
+	}
+	RetiredMappings.Reset();
+	RetiredCount.Reset();
+}
+
+void FMappedFile::Close()
+{
+	checkf(PinCount.GetValue() == 0, TEXT("row views are still pinned"));
+	Unmap();
+	ReleaseRetired();
+	if (FileDescriptor == -1)
+		return;
+
+	// drop the preallocated tail
+	if (bWritable)
+		verify(ftruncate(FileDescriptor, DataSize) == 0);
+
+	close(FileDescriptor);
+	FileDescriptor = -1;
+}
+
+#else
+
+void FMappedFile::Prefetch(uint64 Offset, uint64 Size) {}
+bool FMappedFile::IsValid() { return false; }
+bool FMappedFile::Open(const FString& FileName, bool bWrite, bool bTruncate) { return false; }
+bool FMappedFile::Remap(uint64 NewSize) { return false; }
+bool FMappedFile::Flush() { return true; }
+void FMappedFile::Unmap() {}
+void FMappedFile::ReleaseRetired() {}
+void FMappedFile::Close() {}
+
+#endif
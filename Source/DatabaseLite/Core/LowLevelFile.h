@@ -2,12 +2,17 @@
 
 #include "CoreMinimal.h"
 #include "LRUCache.h"
+#include "HAL/CriticalSection.h"
+#include "HAL/ThreadSafeCounter.h"
 
 enum class ELowLevelFileType
 {
 	Normal,
 	Memory,
 	Cached,
+	Mapped,
+	// the whole file is read into memory at open, it is only written back when closing and by FDatabaseLite::Checkpoint
+	Loaded,
 };
 
 class ILowLevelFile
@@ -18,9 +23,26 @@ public:
 	virtual ~ILowLevelFile(){}
 	virtual bool Write(const uint8* Buffer, uint32 Size) = 0;
 	virtual bool Read(uint8* Buffer, uint32 Size ) = 0;
-	virtual uint32 Tell() = 0;
-	virtual bool Seek(uint32 Pos) = 0;
+	virtual uint64 Tell() = 0;
+	virtual bool Seek(uint64 Pos) = 0;
 	virtual bool IsValid() = 0;
+
+	// positional access, does not move the cursor used by Read/Write/Seek
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) = 0;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) = 0;
+	// make everything written so far durable
+	virtual bool Flush() = 0;
+	// makes [Offset, Offset + Size) part of the file, nothing behind Offset has been written yet.
+	// the default writes the last bytes of the range and leaves a hole in front, which reads as zero
+	virtual bool Preallocate(uint64 Offset, uint64 Size);
+	// hint that the range will be read soon, it may be loaded in the background
+	virtual void Prefetch(uint64 Offset, uint64 Size) {}
+	// the bytes in place without a copy, they stay valid until Unpin with the same offset.
+	// null when the backend can not hand them out, the range must not cross a 16KB page
+	virtual const uint8* Pin(uint64 Offset, uint32 Size) { return nullptr; }
+	virtual void Unpin(uint64 Offset) {}
+	// writes a file served from memory back to disk, the others are durable after Flush already
+	virtual bool Persist() { return true; }
 };
 
 class FGenericPlatformFile: public ILowLevelFile
@@ -37,25 +59,31 @@ public:
 	{
 		return FileHandle->Read(Buffer, Size);
 	}
-	virtual uint32 Tell()override
+	virtual uint64 Tell()override
 	{
 		return FileHandle->Tell();
 	}
-	virtual bool Seek(uint32 Pos)override
+	virtual bool Seek(uint64 Pos)override
 	{
 		return FileHandle->Seek(Pos);
 	}
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) override;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override;
+	virtual bool Flush() override;
 
 	FGenericPlatformFile(TSharedPtr<IFileHandle> InFile): FileHandle(InFile){}
 
 	virtual bool IsValid() override {return FileHandle.IsValid();}
 private:
 	TSharedPtr<IFileHandle> FileHandle;
+	// IFileHandle only has a stateful cursor, keep seek + read/write as one operation
+	FCriticalSection Mutex;
 
 
 };
 
-
+// write-back page cache of one file handle, FMappedFile falls back to it where files can not be mapped.
+// a ELowLevelFileType::Cached database shares a FBufferPool between its tables instead
 class FCachedFile : public ILowLevelFile
 {
 	static const int SINGLE_CACHE_SIZE = 1024 * 16;
@@ -69,13 +97,33 @@ public:
 
 	virtual bool Write(const uint8* Buffer, uint32 Size)override;
 	virtual bool Read(uint8* Buffer, uint32 Size) override;
-	virtual uint32 Tell() override;
-	virtual bool Seek(uint32 Pos) override;
-	FCachedFile(TSharedPtr<IFileHandle> InFile) : FileHandle(InFile) {}
+	virtual uint64 Tell() override;
+	virtual bool Seek(uint64 Pos) override;
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) override;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override;
+	virtual bool Flush() override;
+	FCachedFile(TSharedPtr<IFileHandle> InFile) : FileHandle(InFile), FileSize(InFile ? InFile->Size() : 0) {}
 	virtual bool IsValid() override { return FileHandle.IsValid(); }
+private:
+	// written pages stay dirty in the cache until they are evicted or flushed
+	struct FCachedPage
+	{
+		TArray<uint8> Data;
+		bool bDirty = false;
+	};
+
+	// caches the page, writes back the evicted one, the content is not read when the caller overwrites all of it
+	FCachedPage* LoadPage(uint32 Index, bool bOverwrite);
+	bool WritePage(uint32 Index, FCachedPage& Page);
+	// writes all dirty pages, neighbouring pages with one write
+	bool WriteDirtyPages();
 private:
 	TSharedPtr<IFileHandle> FileHandle;
-	TFlatLRUCache<uint32, TArray<uint8>, TOTAL_CACHE_SIZE / SINGLE_CACHE_SIZE> PageCaches;
+	TFlatLRUCache<uint32, FCachedPage, TOTAL_CACHE_SIZE / SINGLE_CACHE_SIZE> PageCaches;
+	FCriticalSection Mutex;
+	uint64 Pos = 0;
+	// size of the file including the dirty pages
+	uint64 FileSize = 0;
 };
 
 class FMemoryFile : public ILowLevelFile
@@ -90,14 +138,100 @@ public:
 
 	virtual bool Write(const uint8* Buffer, uint32 Size)override;
 	virtual bool Read(uint8* Buffer, uint32 Size) override;
-	virtual uint32 Tell() override;
-	virtual bool Seek(uint32 Pos) override;
+	virtual uint64 Tell() override;
+	virtual bool Seek(uint64 Pos) override;
 	virtual bool IsValid() override { return true; }
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) override;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override;
+	virtual bool Flush() override { return true; }
+	virtual const uint8* Pin(uint64 Offset, uint32 Size) override;
 
-private:
+protected:
 	void AppendPage();
-private:
+protected:
 	TArray<uint8*> Pages;
-	uint32 TotalSize;
-	uint32 Pos;
-};
\ No newline at end of file
+	uint64 Pos = 0;
+	// end of the written data
+	uint64 DataSize = 0;
+};
+
+// a FMemoryFile with the content of a file, Persist replaces the file with a new one holding all of the data
+class FLoadedFile : public FMemoryFile
+{
+public:
+	static ILowLevelFile::Ptr OpenRead(const FString& FileName);
+	static ILowLevelFile::Ptr OpenWrite(const FString& FileName, bool bAppend, bool bAllowRead);
+public:
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override;
+	virtual bool Persist() override;
+
+private:
+	// reads the file front to back, a missing file is empty
+	bool Load();
+private:
+	FString FileName;
+	bool bWritable = false;
+	// written since the last Persist
+	bool bDirty = false;
+};
+
+class FMappedFile : public ILowLevelFile
+{
+	static const uint64 MAPPED_GROW_SIZE = 32 * 1024 * 1024;
+public:
+	static ILowLevelFile::Ptr OpenRead(const FString& FileName);
+	static ILowLevelFile::Ptr OpenWrite(const FString& FileName, bool bAppend, bool bAllowRead);
+public:
+	~FMappedFile();
+
+	virtual bool Write(const uint8* Buffer, uint32 Size)override;
+	virtual bool Read(uint8* Buffer, uint32 Size) override;
+	virtual uint64 Tell() override;
+	virtual bool Seek(uint64 Pos) override;
+	virtual bool IsValid() override;
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) override;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override;
+	virtual bool Flush() override;
+	// the space is reserved with fallocate where there is one
+	virtual bool Preallocate(uint64 Offset, uint64 Size) override;
+	virtual void Prefetch(uint64 Offset, uint64 Size) override;
+	virtual const uint8* Pin(uint64 Offset, uint32 Size) override;
+	virtual void Unpin(uint64 Offset) override;
+
+private:
+	FMappedFile() = default;
+	bool Open(const FString& FileName, bool bWrite, bool bTruncate);
+	// map the first NewSize bytes of the file, the file is extended when it is shorter
+	bool Remap(uint64 NewSize);
+	void Unmap();
+	// unmaps the mappings which were replaced while views were pinned
+	void ReleaseRetired();
+	void Close();
+private:
+	struct FMapping
+	{
+		uint8* Data;
+		uint64 Size;
+		void* Handle;
+	};
+
+	uint8* MappedData = nullptr;
+	// bytes covered by the mapping, may be larger than the data when the file is growing
+	uint64 MappedSize = 0;
+	// end of the data which has been written, the file is truncated to it when closing
+	uint64 DataSize = 0;
+	uint64 Pos = 0;
+	bool bWritable = false;
+	// remapping moves the mapping, accesses from other threads must not overlap it
+	FRWLock MappingLock;
+	FThreadSafeCounter PinCount;
+	FThreadSafeCounter RetiredCount;
+	TArray<FMapping> RetiredMappings;
+
+#if PLATFORM_WINDOWS
+	void* FileHandle = nullptr;
+	void* MappingHandle = nullptr;
+#else
+	int FileDescriptor = -1;
+#endif
+};
@@ -52,26 +52,16 @@ FStaticText::FStaticText(FFileSystem* System):
 }
 FString FStaticText::Get(uint32 Index)
 {
-	if (File->GetSize() <= Index )
-		return {};
-
-	File->SeekRead(Index);
-	FString Content;
-	File->Read(Content);
-	return Content;
+	LoadStrings();
+	auto String = Strings.Find(Index);
+	return String ? *String : FString();
 }
 
 uint32 FStaticText::Find(const FString& String)
 {
-	auto HashValue = GetStringHash(String);
-	uint32 DataIndex = -1;
-	auto Ret = BTree->FindOne(HashValue,[&](auto Data){
-		auto Content = Get(Data);
-		DataIndex = Data;
-		return Content == String;
-	});
-
-	return DataIndex;
+	LoadStrings();
+	auto Index = Indices.Find(String);
+	return Index ? *Index : -1;
 }
 
 uint32 FStaticText::FindOrCreate(const FString& String)
@@ -82,13 +72,15 @@ uint32 FStaticText::FindOrCreate(const FString& String)
 
 	auto HashValue = GetStringHash(String);
 
-	DataIndex = File->GetSize();
+	DataIndex = (uint32)File->GetSize();
 	File->SeekWrite(DataIndex);
 	File->Write(String);
 
 	Header.Count++;
 	FlushHeader();
+	// the hash index is kept up for files opened by older versions
 	BTree->Insert(HashValue, DataIndex);
+	AddString(DataIndex, String);
 
 	return DataIndex;
 }
@@ -104,6 +96,30 @@ void FStaticText::Open()
 	File->Read(Header);
 }
 
+void FStaticText::LoadStrings()
+{
+	if (bLoaded)
+		return;
+	bLoaded = true;
+
+	Indices.Reserve(Header.Count);
+	Strings.Reserve(Header.Count);
+	File->SeekRead(sizeof(Header));
+	for (auto Index : XRange(Header.Count))
+	{
+		auto DataIndex = (uint32)File->TellRead();
+		FString String;
+		CHECK_RESULT(File->Read(String));
+		AddString(DataIndex, String);
+	}
+}
+
+void FStaticText::AddString(uint32 Index, const FString& String)
+{
+	Indices.Add(String, Index);
+	Strings.Add(Index, String);
+}
+
 void FStaticText::FlushHeader()
 {
 	File->SeekWrite(0);
@@ -5,6 +5,11 @@
 class FFileSystem;
 class FFile;
 class FBTree;
+
+/*
+	strings stored once and referred to by their offset in the file.
+	all strings are read into memory on first use, looking one up does not touch the disk afterwards
+*/
 class FStaticText
 {
 public:
@@ -19,12 +24,25 @@ public:
 	void Open();
 private:
 	void FlushHeader();
+	void LoadStrings();
+	void AddString(uint32 Index, const FString& String);
 private:
 
 	FFileSystem* FileSystem;
 	TSharedPtr<FFile> File;
 	TSharedPtr<FBTree> BTree;
 
+	// every spelling is a string of its own, like the hash of the index on disk tells them apart
+	struct FCaseSensitiveKeyFuncs : TDefaultMapHashableKeyFuncs<FString, uint32, false>
+	{
+		static bool Matches(const FString& A, const FString& B) { return A.Equals(B, ESearchCase::CaseSensitive); }
+		static uint32 GetKeyHash(const FString& Key) { return FCrc::StrCrc32(*Key); }
+	};
+
+	bool bLoaded = false;
+	TMap<FString, uint32, FDefaultSetAllocator, FCaseSensitiveKeyFuncs> Indices;
+	TMap<uint32, FString> Strings;
+
 	struct
 	{
 		int MagicNum;
@@ -1,13 +1,65 @@
 #include "Table.h"
+#include "BTree.h"
+#include "KeyBTree.h"
+#include "HashIndex.h"
+#include "BloomFilter.h"
 #include "Range.h"
 #include "StaticText.h"
+#include "Async/ParallelFor.h"
+#include "HAL/ThreadSafeCounter.h"
 
 
-constexpr int32 TABLE_MAGIC_NUM = 0xFDB7ab1e;
+constexpr int32 TABLE_MAGIC_NUM = 0xFDB7ab67;
 
 constexpr uint32 INVALID_DATA_INDEX = -1;
+// rows point into the data file with 64-bit offsets, the row directory itself stays addressable by uint32 row ids
+constexpr uint64 INVALID_DATA_POINTER = ~0ull;
+// bytes of the row directory a worker of ParallelScan takes at once
+constexpr uint32 SCAN_RANGE_SIZE = 4 * FILE_PAGE_SIZE;
+
+constexpr int32 BULK_BUFFER_SIZE = 1024 * 1024;
+// a cursor batch ends early once it holds this much row data
+constexpr int64 CURSOR_BATCH_SIZE = 1024 * 1024;
+
+/*
+	a block of the data file is [FBlobHeader][data][uint32 capacity], the capacity is the one of its size class.
+	free blocks keep FFreeLinks behind the header, the trailing capacity lets Vacuum walk back from the end
+*/
+struct FBlobHeader
+{
+	int32 Size;
+	uint32 Capacity;
+	// row id of the row pointing here
+	uint32 Owner;
+};
+
+struct FFreeLinks
+{
+	uint64 Prev;
+	uint64 Next;
+};
+
+constexpr int32 FREE_BLOB_SIZE = -1;
+constexpr uint32 BLOB_OVERHEAD = sizeof(FBlobHeader) + sizeof(uint32);
+constexpr uint32 MIN_BLOB_SHIFT = 5;
+
+// four classes for every power of two, at most a quarter of a block is wasted
+static int32 GetSizeClass(uint32 BlockSize)
+{
+	if (BlockSize <= (1u << MIN_BLOB_SHIFT))
+		return 0;
+
+	auto Value = BlockSize - 1;
+	auto Shift = FMath::FloorLog2(Value);
+	auto Quarter = (Value >> (Shift - 2)) & 3;
+	return (Shift - MIN_BLOB_SHIFT) * 4 + Quarter + 1;
+}
+
+static uint32 GetClassCapacity(int32 Class)
+{
+	return (4u + Class % 4) << (Class / 4 + MIN_BLOB_SHIFT - 2);
+}
 
-#define THREAD_SAFTY 0
 
 FDBTable::FDBTable(FFile::Ptr InFile):
 	File(InFile)
@@ -17,21 +69,46 @@ FDBTable::FDBTable(FFile::Ptr InFile):
 
 }
 
-void FDBTable::Init(const TMap<FString, FKeyTypeSequence>& IndexKeyTypes)
+void FDBTable::Init(const TMap<FString, FKeyTypeSequence>& IndexKeyTypes, const TMap<FString, EIndexType>& IndexTypes)
 { 
+	FFileSystem::FMutationScope Mutation(FileSystem);
 
 	Header.MagicNum = TABLE_MAGIC_NUM;
 	Header.NumRows = 0;
-	Header.FreeList = INVALID_DATA_INDEX;
+	Header.DataFileEnd = 0;
+	Header.FreeRow = INVALID_DATA_INDEX;
+	for (auto& Head : Header.FreeLists)
+	{
+		Head = INVALID_DATA_POINTER;
+	}
 
 	int KeyOffset = 0;
 	for (auto& KeyItem: IndexKeyTypes)
 	{
 		FIndex DBIndex;
 		DBIndex.File = FileSystem->NewFile();
-		auto SeachIndex = new TIndex<FBTree>(DBIndex.File);
-		SeachIndex->Init();
-		DBIndex.Index = FBaseIndex::Ptr(SeachIndex);
+		if (IndexTypes.FindRef(KeyItem.Key) == EIndexType::Hash)
+		{
+			auto SeachIndex = new TIndex<FHashIndex>(DBIndex.File);
+			SeachIndex->Init();
+			DBIndex.Index = FBaseIndex::Ptr(SeachIndex);
+		}
+		// composite keys are kept in order instead of being hashed
+		else if (KeyItem.Value.Num() > 1)
+		{
+			auto SeachIndex = new TOrderedIndex<FKeyBTree>(DBIndex.File);
+			SeachIndex->Init();
+			DBIndex.OrderedIndex = FOrderedIndex::Ptr(SeachIndex);
+		}
+		else
+		{
+			auto SeachIndex = new TIndex<FBTree>(DBIndex.File);
+			SeachIndex->Init();
+			DBIndex.Index = FBaseIndex::Ptr(SeachIndex);
+		}
+		DBIndex.FilterFile = FileSystem->NewFile();
+		DBIndex.Filter = MakeShared<FBloomFilter>(DBIndex.FilterFile, false);
+		DBIndex.Filter->Init();
 		DBIndex.KeyTypes = KeyItem.Value;
 		DBIndex.KeyOffset = KeyOffset;
 		KeyOffset += FIndexHelper::GetKeySize(KeyItem.Value);
@@ -54,9 +131,10 @@ void FDBTable::Init(const TMap<FString, FKeyTypeSequence>& IndexKeyTypes)
 			File->Write(Type);
 		}
 		File->Write(DBIndex.KeyOffset);
+		File->Write(DBIndex.FilterFile->GetId());
 	}
 
-	Header.DataBegin = Header.DataEnd = File->TellWrite();
+	Header.DataBegin = Header.DataEnd = (uint32)File->TellWrite();
 	Header.NumIndices = Indices.Num();
 	DataFile = FileSystem->NewFile();
 	Header.DataFileId = DataFile->GetId();
@@ -64,10 +142,13 @@ void FDBTable::Init(const TMap<FString, FKeyTypeSequence>& IndexKeyTypes)
 
 }
 
-void FDBTable::Open()
+bool FDBTable::Open()
 {
-	File->Read(Header);
-	check(TABLE_MAGIC_NUM == Header.MagicNum);
+	if (!File->Read(Header) || Header.MagicNum != TABLE_MAGIC_NUM)
+	{
+		UE_LOG(LogDatabaseLite, Error, TEXT("table was written by another version of the database format, which is not read"));
+		return false;
+	}
 	for (auto Index = 0; Index < Header.NumIndices; ++Index)
 	{
 		FIndex DBIndex;
@@ -89,21 +170,51 @@ void FDBTable::Open()
 
 		File->Read(DBIndex.KeyOffset);
 
+		PageId FilterId;
+		File->Read(FilterId);
+		DBIndex.FilterFile = FileSystem->OpenFile(FilterId);
+		DBIndex.Filter = MakeShared<FBloomFilter>(DBIndex.FilterFile, FileSystem->IsReadOnly());
+
 		DBIndex.File = FileSystem->OpenFile(Id);
 
-		auto SeachIndex = new TIndex<FBTree>(DBIndex.File);
-		SeachIndex->Open();
-		DBIndex.Index = FBaseIndex::Ptr(SeachIndex);
+		// the kind of index is told by the header of its file, see Init
+		if (FKeyBTree::IsKeyBTree(DBIndex.File))
+		{
+			auto SeachIndex = new TOrderedIndex<FKeyBTree>(DBIndex.File);
+			SeachIndex->Open();
+			DBIndex.OrderedIndex = FOrderedIndex::Ptr(SeachIndex);
+		}
+		else if (FHashIndex::IsHashIndex(DBIndex.File))
+		{
+			auto SeachIndex = new TIndex<FHashIndex>(DBIndex.File);
+			SeachIndex->Open();
+			DBIndex.Index = FBaseIndex::Ptr(SeachIndex);
+		}
+		else
+		{
+			auto SeachIndex = new TIndex<FBTree>(DBIndex.File);
+			SeachIndex->Open();
+			DBIndex.Index = FBaseIndex::Ptr(SeachIndex);
+		}
 
 		Indices.Add(Name, DBIndex);
 	}
 
 	DataFile = FileSystem->OpenFile(Header.DataFileId);
 	check(DataFile);
+
+	// the filter of a table not closed properly may lack keys
+	for (auto& Item : Indices)
+	{
+		if (!Item.Value.Filter->Open())
+			RebuildFilter(Item.Value, Header.NumRows * 2);
+	}
+	return true;
 }
 
 void FDBTable::Delete()
 {
+	FFileSystem::FMutationScope Mutation(FileSystem);
 	Header.MagicNum = 0xDeadDead;
 	FlushHeader();
 
@@ -114,14 +225,96 @@ void FDBTable::Delete()
 	for (auto& Item : Indices)
 	{
 		Item.Value.File->Delete();
+		Item.Value.FilterFile->Delete();
 	}
 	Indices.Reset();
 }
 
+void FDBTable::FlushFilters()
+{
+	for (auto& Item : Indices)
+	{
+		Item.Value.Filter->Flush();
+	}
+}
+
+FDBIndexHandle FDBTable::GetIndexHandle(const FString& KeyName) const
+{
+	return FDBIndexHandle(this, Indices.Find(KeyName));
+}
+
+const FDBTable::FIndex& FDBTable::GetIndex(const FDBIndexHandle& Handle) const
+{
+	check(Handle.IsValid() && Handle.Table == this);
+	return *Handle.Index;
+}
+
+int32 FDBTable::ParallelScan(TFunctionRef<bool(uint32, const FRowView&)> Predicate, TFunctionRef<void(uint32, const FRowView&)> Consumer, int32 NumWorkers)
+{
+	const uint32 RowSize = Header.RowDataOffset + sizeof(uint64);
+	const uint32 NumRows = (Header.DataEnd - Header.DataBegin) / RowSize;
+	// a range is whole rows of about SCAN_RANGE_SIZE bytes of the directory
+	const uint32 RangeRows = FMath::Max(1u, SCAN_RANGE_SIZE / RowSize);
+	const int32 NumRanges = (int32)FMath::DivideAndRoundUp(NumRows, RangeRows);
+	if (NumRanges == 0)
+		return 0;
+
+	if (NumWorkers <= 0)
+		NumWorkers = FPlatformMisc::NumberOfCoresIncludingHyperthreads();
+	NumWorkers = FMath::Min(NumWorkers, NumRanges);
+
+	// the readers are opened here, the workers never touch the files of the table.
+	// the two readers of a worker share a handle, they are only used by its thread
+	TArray<TPair<FFile::Ptr, FFile::Ptr>> Readers;
+	for (auto Worker : XRange(NumWorkers))
+	{
+		auto Handle = FileSystem->OpenReadHandle();
+		Readers.Emplace(File->OpenReader(Handle), DataFile->OpenReader(Handle));
+	}
+
+	FThreadSafeCounter NextRange;
+	FThreadSafeCounter Count;
+	ParallelFor(NumWorkers, [&](int32 Worker)
+		{
+			auto& RowReader = *Readers[Worker].Key;
+			auto& DataReader = *Readers[Worker].Value;
+			TArray<uint8> Directory;
+			FRowView View;
+
+			int32 Range;
+			while ((Range = NextRange.Increment() - 1) < NumRanges)
+			{
+				auto FirstRow = (uint32)Range * RangeRows;
+				auto Rows = FMath::Min(RangeRows, NumRows - FirstRow);
+				auto RangeBegin = Header.DataBegin + FirstRow * RowSize;
+				Directory.SetNumUninitialized(Rows * RowSize, false);
+				CHECK_RESULT(RowReader.ReadAt(RangeBegin, Directory.GetData(), Directory.Num()));
+
+				for (auto Row : XRange(Rows))
+				{
+					uint64 DataPointer;
+					FMemory::Memcpy(&DataPointer, Directory.GetData() + Row * RowSize + Header.RowDataOffset, sizeof(DataPointer));
+					if (DataPointer == INVALID_DATA_POINTER || !ReadBlobView(DataReader, DataPointer, View))
+						continue;
+
+					auto RowId = RangeBegin + Row * RowSize;
+					if (Predicate(RowId, View))
+					{
+						Consumer(RowId, View);
+						Count.Increment();
+					}
+				}
+			}
+		});
+	return Count.GetValue();
+}
+
 TArray<FDBTable::RowData> FDBTable::GetRows()
 {
 	TArray<RowData> Result;
 	Result.Reserve(Header.NumRows);
+	// the rows are read front to back, the data mostly is too and is picked up by the read-ahead
+	File->Prefetch(Header.DataBegin, Header.DataEnd - Header.DataBegin);
 	File->SeekRead(Header.DataBegin);
 	int Index = 0;
 
@@ -129,17 +322,16 @@ TArray<FDBTable::RowData> FDBTable::GetRows()
 	{
 		RowData Data;
 		File->SkipRead(Header.RowDataOffset);
-		uint32 DataPointer;
+		uint64 DataPointer;
 		CHECK_RESULT(File->Read(DataPointer));
-		if (DataPointer == INVALID_DATA_INDEX)
+		if (DataPointer == INVALID_DATA_POINTER)
 			continue;
 
 		Index+=1;
-		DataFile->SeekRead(DataPointer);
-		int Size;
-		CHECK_RESULT(DataFile->Read(Size));
-		Data.SetNumUninitialized(Size);
-		CHECK_RESULT(DataFile->Read(Data.GetData(), Size));
+		FBlobHeader Blob;
+		CHECK_RESULT(DataFile->ReadAt(DataPointer, Blob));
+		Data.SetNumUninitialized(Blob.Size);
+		CHECK_RESULT(DataFile->ReadAt(DataPointer + sizeof(Blob), Data.GetData(), Blob.Size));
 
 		Result.Add(MoveTemp(Data));
 	}
@@ -147,11 +339,20 @@ TArray<FDBTable::RowData> FDBTable::GetRows()
 	return Result;
 }
 
+FDBTableCursor FDBTable::CreateCursor(int32 BatchRows)
+{
+	return FDBTableCursor(this, BatchRows);
+}
+
 FDBTable::RowArray FDBTable::Find(const FString& KeyName, const FKeySequence& Key)
 {
-	auto Index = Indices.Find(KeyName);
-	check(Index);
-	auto DataIndices = Index->Index->Find(ConverToNumber(Key, Index->KeyTypes, false));
+	return Find(GetIndexHandle(KeyName), Key);
+}
+
+FDBTable::RowArray FDBTable::Find(const FDBIndexHandle& Handle, const FKeySequence& Key)
+{
+	auto Index = &GetIndex(Handle);
+	auto DataIndices = FindRowIds(*Index, MakeIndexKey(*Index, Key, false));
 
 	RowArray Result;
 	for (auto& DataIndex : DataIndices)
@@ -168,9 +369,13 @@ FDBTable::RowArray FDBTable::Find(const FString& KeyName, const FKeySequence& Ke
 
 bool FDBTable::FindOne(const FString& KeyName, const FKeySequence& Key,const TFunction<void*(int)>& Buffer)
 {
-	auto Index = Indices.Find(KeyName);
-	check(Index);
-	if (!Index->Index->FindOne(ConverToNumber(Key, Index->KeyTypes, false),[&](uint32 Data){
+	return FindOne(GetIndexHandle(KeyName), Key, Buffer);
+}
+
+bool FDBTable::FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key,const TFunction<void*(int)>& Buffer)
+{
+	auto Index = &GetIndex(Handle);
+	if (!FindRowIds(*Index, MakeIndexKey(*Index, Key, false),[&](uint32 Data){
 			if (!Equal(Data, Index->KeyOffset,Key, Index->KeyTypes))
 				return false;
 
@@ -186,18 +391,22 @@ bool FDBTable::FindOne(const FString& KeyName, const FKeySequence& Key,const TFu
 
 bool FDBTable::FindOne(const FString& KeyName, const FKeySequence& Key, const TFunction<bool(const void*, int)>& Buffer)
 {
-	auto Index = Indices.Find(KeyName);
-	check(Index);
-	if (!Index->Index->FindOne(ConverToNumber(Key, Index->KeyTypes, false), [&](uint32 DataIndex)
+	return FindOne(GetIndexHandle(KeyName), Key, Buffer);
+}
+
+bool FDBTable::FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key, const TFunction<bool(const void*, int)>& Buffer)
+{
+	auto Index = &GetIndex(Handle);
+	if (!FindRowIds(*Index, MakeIndexKey(*Index, Key, false), [&](uint32 DataIndex)
 		{
 			if (!Equal(DataIndex, Index->KeyOffset, Key, Index->KeyTypes))
 				return false;
 
-			TArray<uint8> Data;
-			if (!ReadRowData(DataIndex, Data))
+			FRowView View;
+			if (!ReadRowView(DataIndex, View))
 				return false;
 
-			return Buffer(Data.GetData(), Data.Num());
+			return Buffer(View.GetData(), View.Num());
 		}))
 	{
 		return false;
@@ -210,76 +419,372 @@ bool FDBTable::FindOne(const FString& KeyName, const FKeySequence& Key, const TF
 
 bool FDBTable::FindOne(const FString& KeyName, const FKeySequence& Key, FString& Str)
 {
-	return FindOne(KeyName, Key, [&](const void* Buffer, int Size)->bool {
-		auto Begin = (const uint8*) Buffer;
-
-		int Num = 0;
-		FMemory::Memcpy(&Num, Begin, 4);
-		Begin +=4;
-
-		if (Num <= 0)
-			return true;
+	return FindOne(GetIndexHandle(KeyName), Key, Str);
+}
 
-		Str.GetCharArray().SetNumUninitialized(Num + 1);
-		FMemory::Memcpy(GetData(Str), Begin, Num * sizeof(TCHAR));
-		Str.GetCharArray()[Num] = 0;
+bool FDBTable::FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key, FString& Str)
+{
+	return FindOne(Handle, Key, [&](const void* Buffer, int Size)->bool {
+		ReadString((const uint8*)Buffer, Str);
 		return true;
 	});
 }
 
-bool FDBTable::AddRow(const TMap<FString, FKeySequence>& Keys, const void* Buffer, int Size, bool bUnique)
+void FDBTable::ReadString(const uint8* Begin, FString& Str)
 {
+	int Num = 0;
+	FMemory::Memcpy(&Num, Begin, 4);
+	Begin +=4;
 
-	uint32 ReservedDataIndex = INVALID_DATA_INDEX;
+	if (Num <= 0)
+		return;
 
-	for (auto& Item : Keys)
+	Str.GetCharArray().SetNumUninitialized(Num + 1);
+	FMemory::Memcpy(GetData(Str), Begin, Num * sizeof(TCHAR));
+	Str.GetCharArray()[Num] = 0;
+}
+
+bool FDBTable::FindOne(const FString& KeyName, const FKeySequence& Key, FRowView& View)
+{
+	return FindOne(GetIndexHandle(KeyName), Key, View);
+}
+
+bool FDBTable::FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key, FRowView& View)
+{
+	View.Release();
+	auto Index = &GetIndex(Handle);
+	return FindRowIds(*Index, MakeIndexKey(*Index, Key, false), [&](uint32 DataIndex)
+		{
+			return Equal(DataIndex, Index->KeyOffset, Key, Index->KeyTypes) && ReadRowView(DataIndex, View);
+		});
+}
+
+int32 FDBTable::FindViews(const FString& KeyName, const FKeySequence& Key, TFunctionRef<bool(const FRowView&)> Visitor)
+{
+	return FindViews(GetIndexHandle(KeyName), Key, Visitor);
+}
+
+int32 FDBTable::FindViews(const FDBIndexHandle& Handle, const FKeySequence& Key, TFunctionRef<bool(const FRowView&)> Visitor)
+{
+	auto Index = &GetIndex(Handle);
+
+	int32 Count = 0;
+	FRowView View;
+	FindRowIds(*Index, MakeIndexKey(*Index, Key, false), [&](uint32 DataIndex)
+		{
+			if (!Equal(DataIndex, Index->KeyOffset, Key, Index->KeyTypes) || !ReadRowView(DataIndex, View))
+				return false;
+
+			Count++;
+			// returning true ends the search
+			return !Visitor(View);
+		});
+	return Count;
+}
+
+int32 FDBTable::FindMany(const FString& KeyName, TArrayView<const FKeySequence> Keys, TFunctionRef<bool(int32, const FRowView&)> Visitor)
+{
+	return FindMany(GetIndexHandle(KeyName), Keys, Visitor);
+}
+
+int32 FDBTable::FindMany(const FDBIndexHandle& Handle, TArrayView<const FKeySequence> Keys, TFunctionRef<bool(int32, const FRowView&)> Visitor)
+{
+	auto Index = &GetIndex(Handle);
+	const bool bOrdered = Index->IsOrdered();
+
+	// keys the filter lets through, sorted like the index
+	TArray<TPair<FIndexKey, int32>> Sorted;
+	Sorted.Reserve(Keys.Num());
+	for (auto KeyIndex : XRange(Keys.Num()))
 	{
-		auto Index = Indices.Find(Item.Key);
-		check(Index);
-		auto DataIndices = Index->Index->Find(ConverToNumber(Item.Value, Index->KeyTypes, false));
+		auto Key = MakeIndexKey(*Index, Keys[KeyIndex], false);
+		if (Index->Filter->MayContain(HashIndexKey(*Index, Key)))
+			Sorted.Emplace(MoveTemp(Key), KeyIndex);
+	}
+	auto Less = [bOrdered](const FIndexKey& A, const FIndexKey& B) {
+		if (!bOrdered)
+			return A.Number < B.Number;
+		auto Result = FMemory::Memcmp(A.Bytes.GetData(), B.Bytes.GetData(), FMath::Min(A.Bytes.Num(), B.Bytes.Num()));
+		return Result < 0 || (Result == 0 && A.Bytes.Num() < B.Bytes.Num());
+	};
+	Sorted.StableSort([&](const TPair<FIndexKey, int32>& A, const TPair<FIndexKey, int32>& B) { return Less(A.Key, B.Key); });
+
+	// Groups[i] is where the keys equal to the i-th searched key begin in Sorted
+	TArray<int32> Groups;
+	for (auto SortedIndex : XRange(Sorted.Num()))
+	{
+		if (SortedIndex == 0 || Less(Sorted[SortedIndex - 1].Key, Sorted[SortedIndex].Key))
+			Groups.Add(SortedIndex);
+	}
+	Groups.Add(Sorted.Num());
 
-		RowArray Result;
-		for (auto& DataIndex : DataIndices)
+	// a hashed composite key may stand for several keys, a row goes to the first key it really has
+	struct FMatch
+	{
+		uint64 DataPointer;
+		uint32 DataIndex;
+		int32 KeyIndex;
+	};
+	TArray<FMatch> Matches;
+	auto AddMatch = [&](int32 Group, uint32 DataIndex) {
+		uint64 DataPointer;
+		if (!File->ReadAt(DataIndex + Header.RowDataOffset, DataPointer) || DataPointer == INVALID_DATA_POINTER)
+			return false;
+
+		for (auto SortedIndex : XRange(Groups[Group], Groups[Group + 1]))
 		{
-			if (IsRowValid(DataIndex))
+			auto KeyIndex = Sorted[SortedIndex].Value;
+			if (Equal(DataIndex, Index->KeyOffset, Keys[KeyIndex], Index->KeyTypes))
 			{
-				if (!Equal(DataIndex, Index->KeyOffset, Item.Value, Index->KeyTypes))
-					continue;
+				Matches.Add({DataPointer, DataIndex, KeyIndex});
+				break;
+			}
+		}
+		return false;
+	};
 
-				if (bUnique)
-					return false;
+	if (bOrdered)
+	{
+		// neighbouring keys share the nodes of their path in the node cache
+		for (auto Group : XRange(Groups.Num() - 1))
+		{
+			FindRowIds(*Index, Sorted[Groups[Group]].Key, [&](uint32 DataIndex) { return AddMatch(Group, DataIndex); });
+		}
+	}
+	else
+	{
+		TArray<int64> Numbers;
+		Numbers.Reserve(Groups.Num() - 1);
+		for (auto Group : XRange(Groups.Num() - 1))
+			Numbers.Add(Sorted[Groups[Group]].Key.Number);
+		Index->Index->FindMany(Numbers, AddMatch);
+	}
+
+	Matches.Sort([](const FMatch& A, const FMatch& B) { return A.DataPointer < B.DataPointer; });
+
+	int32 Count = 0;
+	FRowView View;
+	for (auto& Match : Matches)
+	{
+		if (!ReadRowView(Match.DataIndex, View))
+			continue;
+		Count++;
+		if (!Visitor(Match.KeyIndex, View))
+			break;
+	}
+	return Count;
+}
+
+FDBTable::FRangeCursor FDBTable::FindRange(const FString& KeyName, const FKeySequence& Lo, const FKeySequence& Hi, bool bAscending)
+{
+	return FindRange(GetIndexHandle(KeyName), Lo, Hi, bAscending);
+}
+
+FDBTable::FRangeCursor FDBTable::FindRange(const FDBIndexHandle& Handle, const FKeySequence& Lo, const FKeySequence& Hi, bool bAscending)
+{
+	auto Index = &GetIndex(Handle);
+	if (Index->IsOrdered())
+	{
+		FEncodedKey LoKey, HiKey;
+		FIndexHelper::Encode(Lo, Index->KeyTypes, LoKey);
+		FIndexHelper::Encode(Hi, Index->KeyTypes, HiKey);
+		return FRangeCursor(this, Index, Index->OrderedIndex->FindRange(LoKey, HiKey, bAscending));
+	}
+
+	// a hash index has no order, the cursor is invalid from the start
+	if (!Index->Index->IsRangeSupported())
+		return FRangeCursor(this, Index, nullptr);
+
+	check(Index->KeyTypes.Num() == 1 && Index->KeyTypes[0] == EKeyType::Integer);
+	check(Lo.Num() == 1 && Hi.Num() == 1);
+
+	auto Cursor = Index->Index->FindRange(AnyCast<int64>(Lo[0]), AnyCast<int64>(Hi[0]), bAscending);
+	return FRangeCursor(this, Index, Cursor);
+}
+
+FDBTable::FRangeCursor::FRangeCursor(FDBTable* InTable, const FDBTableIndex* InIndex, FIndexCursor::Ptr InCursor):
+	Table(InTable), Index(InIndex), Cursor(InCursor)
+{
+	SkipInvalid();
+}
+
+bool FDBTable::FRangeCursor::GetRowData(RowData& Data) const
+{
+	return IsValid() && Table->ReadRowData(GetRowId(), Data);
+}
+
+bool FDBTable::FRangeCursor::GetRowView(FRowView& View) const
+{
+	View.Release();
+	return IsValid() && Table->ReadRowView(GetRowId(), View);
+}
+
+FDBTable::FRowView::FRowView(FRowView&& Other)
+{
+	*this = MoveTemp(Other);
+}
 
+FDBTable::FRowView& FDBTable::FRowView::operator=(FRowView&& Other)
+{
+	if (this == &Other)
+		return *this;
+
+	Release();
+	// a copy may live in the inline storage, which moves along
+	bool bCopied = Other.bValid && Other.Data == Other.Copy.GetData();
+	Copy = MoveTemp(Other.Copy);
+	Data = bCopied ? Copy.GetData() : Other.Data;
+	Size = Other.Size;
+	bValid = Other.bValid;
+	PinnedFile = Other.PinnedFile;
+	PinnedPos = Other.PinnedPos;
+
+	Other.PinnedFile = nullptr;
+	Other.Data = nullptr;
+	Other.bValid = false;
+	return *this;
+}
+
+void FDBTable::FRowView::Release()
+{
+	if (PinnedFile)
+		PinnedFile->Unpin(PinnedPos);
+
+	PinnedFile = nullptr;
+	Data = nullptr;
+	Size = 0;
+	bValid = false;
+	Copy.Reset();
+}
+
+void FDBTable::FRangeCursor::Next()
+{
+	Cursor->Next();
+	SkipInvalid();
+}
+
+void FDBTable::FRangeCursor::SkipInvalid()
+{
+	// hashed keys collide, an entry only counts if the row holds its key
+	while (Cursor && Cursor->IsValid())
+	{
+		auto DataIndex = Cursor->GetData();
+		if (Table->IsRowValid(DataIndex))
+		{
+			if (Index->IsOrdered())
+			{
+				FEncodedKey Key;
+				FIndexHelper::Encode(Table->ReadRowKey(DataIndex, Index->KeyOffset, Index->KeyTypes), Index->KeyTypes, Key);
+				auto EntryKey = Cursor->GetEncodedKey();
+				if (Key.Num() == EntryKey.Num() && FMemory::Memcmp(Key.GetData(), EntryKey.GetData(), Key.Num()) == 0)
+					break;
 			}
-			else 
+			else
 			{
-				if (ReservedDataIndex == INVALID_DATA_INDEX)
-					ReservedDataIndex = DataIndex;
-				else
-				{
-					check(ReservedDataIndex == DataIndex);
-				}
+				int64 Key;
+				if (Table->File->ReadAt(DataIndex + Index->KeyOffset, Key) && Key == Cursor->GetKey())
+					break;
 			}
 		}
+		Cursor->Next();
 	}
+}
+
+FDBTable::RowArray FDBTable::FindResolved(const FIndex& Index, const FIndexKey& Key, const int64* Values)
+{
+	RowArray Result;
+	FindRowIds(Index, Key, [&](uint32 DataIndex)
+		{
+			if (Equal(DataIndex, Index.KeyOffset, Values, Index.KeyTypes))
+			{
+				RowData Data;
+				if (ReadRowData(DataIndex, Data))
+					Result.Add(MoveTemp(Data));
+			}
+			return false;
+		});
+	return Result;
+}
 
-	if (ReservedDataIndex != INVALID_DATA_INDEX)
+bool FDBTable::FindOneResolved(const FIndex& Index, const FIndexKey& Key, const int64* Values, FRowView& View)
+{
+	return FindRowIds(Index, Key, [&](uint32 DataIndex)
+		{
+			return Equal(DataIndex, Index.KeyOffset, Values, Index.KeyTypes) && ReadRowView(DataIndex, View);
+		});
+}
+
+bool FDBTable::AddRowResolved(const FIndex& Index, const FIndexKey& Key, const int64* Values, const void* Buffer, int Size, bool bUnique)
+{
+	bool bExists = false;
+	FindRowIds(Index, Key, [&](uint32 DataIndex)
+		{
+			bExists = bExists || Equal(DataIndex, Index.KeyOffset, Values, Index.KeyTypes);
+			return bUnique && bExists;
+		});
+
+	if (bUnique && bExists)
+		return false;
+
+	auto DataIndex = AllocateRow();
+	WriteRowKey(DataIndex, Index, Values);
+	CHECK_RESULT(File->WriteAt(DataIndex + Header.RowDataOffset, WriteData(Buffer, Size, DataIndex)));
+	Header.NumRows++;
+	FlushHeader();
+
+	InsertRowId(Index, Key, DataIndex);
+	return true;
+}
+
+bool FDBTable::AddRow(const TMap<FString, FKeySequence>& Keys, const void* Buffer, int Size, bool bUnique)
+{
+	return AddRow(ResolveKeys(Keys), Buffer, Size, bUnique);
+}
+
+bool FDBTable::AddRow(const FDBIndexHandle& Handle, const FKeySequence& Key, const void* Buffer, int Size, bool bUnique)
+{
+	FRowKeys Keys;
+	Keys.Emplace(&GetIndex(Handle), &Key);
+	return AddRow(Keys, Buffer, Size, bUnique);
+}
+
+FDBTable::FRowKeys FDBTable::ResolveKeys(const TMap<FString, FKeySequence>& Keys) const
+{
+	FRowKeys Result;
+	for (auto& Item : Keys)
 	{
-		WriteRow(Keys,ReservedDataIndex, WriteData(Buffer, Size));
-		Header.NumRows += 1;
-		FlushHeader();
+		auto Index = Indices.Find(Item.Key);
+		check(Index);
+		Result.Emplace(Index, &Item.Value);
 	}
-	else
+	return Result;
+}
+
+bool FDBTable::AddRow(const FRowKeys& Keys, const void* Buffer, int Size, bool bUnique)
+{
+	FFileSystem::FMutationScope Mutation(FileSystem);
+
+	if (bUnique)
 	{
-		auto DataIndex = WriteRow(Keys, Buffer, Size);
 		for (auto& Item : Keys)
 		{
-			auto Index = Indices.Find(Item.Key);
-			check(Index);
-
-			Index->Index->Insert(ConverToNumber(Item.Value, Index->KeyTypes, true), DataIndex);
+			auto Index = Item.Key;
+			auto& Key = *Item.Value;
+			bool bExists = FindRowIds(*Index, MakeIndexKey(*Index, Key, false), [&](uint32 DataIndex)
+				{
+					return Equal(DataIndex, Index->KeyOffset, Key, Index->KeyTypes);
+				});
+			if (bExists)
+				return false;
 		}
 	}
 
+	auto DataIndex = WriteRow(Keys, Buffer, Size);
+	for (auto& Item : Keys)
+	{
+		InsertRowId(*Item.Key, MakeIndexKey(*Item.Key, *Item.Value, true), DataIndex);
+	}
+
 	return true;
 }
 
@@ -293,57 +798,250 @@ bool FDBTable::AddRow(const TMap<FString, FKeySequence>& Keys, const FString& Va
 	return AddRow(Keys, Data.GetData(), Data.Num(), bUnique);
 }
 
+bool FDBTable::BulkInsert(const TArray<FBulkRow>& Rows, bool bUnique, float FillFactor)
+{
+	FFileSystem::FMutationScope Mutation(FileSystem);
+
+	if (Header.DataEnd != Header.DataBegin)
+	{
+		bool bSucceeded = true;
+		for (auto& Row : Rows)
+		{
+			bSucceeded &= AddRow(Row.Keys, Row.Data.GetData(), Row.Data.Num(), bUnique);
+		}
+		return bSucceeded;
+	}
+
+	const uint32 RowSize = Header.RowDataOffset + sizeof(uint64);
+	check((uint64)Header.DataBegin + (uint64)RowSize * Rows.Num() <= MAX_uint32);
+
+	TMap<FString, TArray<TPair<int64, uint32>>> IndexEntries;
+	// ordered indices get the encoded keys, Offsets[i] is where the key of entry i starts in Bytes
+	struct FEncodedEntries
+	{
+		TArray<uint8> Bytes;
+		TArray<int32> Offsets;
+		TArray<uint32> Datas;
+	};
+	TMap<FString, FEncodedEntries> EncodedEntries;
+	for (auto& Item : Indices)
+	{
+		if (Item.Value.IsOrdered())
+		{
+			auto& Entries = EncodedEntries.Add(Item.Key);
+			Entries.Offsets.Reserve(Rows.Num() + 1);
+			Entries.Datas.Reserve(Rows.Num());
+		}
+		else
+			IndexEntries.Add(Item.Key).Reserve(Rows.Num());
+	}
+
+	FEncodedKey EncodedKey;
+	for (auto RowIndex : XRange(Rows.Num()))
+	{
+		auto DataIndex = Header.DataBegin + RowIndex * RowSize;
+		for (auto& Item : Rows[RowIndex].Keys)
+		{
+			auto Index = Indices.Find(Item.Key);
+			check(Index);
+			if (Index->IsOrdered())
+			{
+				auto& Entries = EncodedEntries[Item.Key];
+				EncodedKey.Reset();
+				FIndexHelper::Encode(Item.Value, Index->KeyTypes, EncodedKey);
+				Entries.Offsets.Add(Entries.Bytes.Num());
+				Entries.Bytes.Append(EncodedKey);
+				Entries.Datas.Add(DataIndex);
+			}
+			else
+				IndexEntries[Item.Key].Emplace(ConverToNumber(Item.Value, Index->KeyTypes, true), DataIndex);
+		}
+	}
+
+	// the views point into Bytes, which does not grow any more
+	TMap<FString, TArray<TPair<TArrayView<const uint8>, uint32>>> OrderedEntries;
+	for (auto& Item : EncodedEntries)
+	{
+		auto& Encoded = Item.Value;
+		Encoded.Offsets.Add(Encoded.Bytes.Num());
+		auto& Entries = OrderedEntries.Add(Item.Key);
+		Entries.Reserve(Encoded.Datas.Num());
+		for (auto EntryIndex : XRange(Encoded.Datas.Num()))
+		{
+			TArrayView<const uint8> Key(Encoded.Bytes.GetData() + Encoded.Offsets[EntryIndex], Encoded.Offsets[EntryIndex + 1] - Encoded.Offsets[EntryIndex]);
+			Entries.Emplace(Key, Encoded.Datas[EntryIndex]);
+		}
+
+		auto Less = [](TArrayView<const uint8> A, TArrayView<const uint8> B) {
+			auto Result = FMemory::Memcmp(A.GetData(), B.GetData(), FMath::Min(A.Num(), B.Num()));
+			return Result < 0 || (Result == 0 && A.Num() < B.Num());
+		};
+		Entries.StableSort([&](const TPair<TArrayView<const uint8>, uint32>& A, const TPair<TArrayView<const uint8>, uint32>& B) { return Less(A.Key, B.Key); });
+		if (!bUnique)
+			continue;
+
+		// the keys are exact, equal neighbours are duplicates
+		for (int EntryIndex = 1; EntryIndex < Entries.Num(); ++EntryIndex)
+		{
+			if (!Less(Entries[EntryIndex - 1].Key, Entries[EntryIndex].Key))
+				return false;
+		}
+	}
+
+	for (auto& Item : IndexEntries)
+	{
+		auto& Entries = Item.Value;
+		// stable, so equal keys keep the row order like repeated inserts
+		Entries.StableSort([](const TPair<int64, uint32>& A, const TPair<int64, uint32>& B) { return A.Key < B.Key; });
+		if (!bUnique)
+			continue;
+
+		// composite keys are hashed, only rows with equal keys in a run of equal numbers are duplicates
+		for (int Begin = 0; Begin < Entries.Num(); ++Begin)
+		{
+			for (auto Other = Begin + 1; Other < Entries.Num() && Entries[Other].Key == Entries[Begin].Key; ++Other)
+			{
+				auto& Keys1 = Rows[(Entries[Begin].Value - Header.DataBegin) / RowSize].Keys[Item.Key];
+				auto& Keys2 = Rows[(Entries[Other].Value - Header.DataBegin) / RowSize].Keys[Item.Key];
+				if (FIndexHelper::Equal(Keys1, Keys2))
+					return false;
+			}
+		}
+	}
+
+	TArray<uint8> Buffer;
+	Buffer.Reserve(BULK_BUFFER_SIZE + RowSize);
+	auto FlushBuffer = [&](FFile::Ptr Target, uint64& Pos) {
+		CHECK_RESULT(Target->WriteAt(Pos, Buffer.GetData(), Buffer.Num()));
+		Pos += Buffer.Num();
+		Buffer.Reset();
+	};
+
+	// row data goes to the end of the data file in row order
+	TArray<uint64> DataPointers;
+	DataPointers.SetNumUninitialized(Rows.Num());
+	uint64 DataPos = Header.DataFileEnd;
+	uint64 DataPointer = DataPos;
+	for (auto RowIndex : XRange(Rows.Num()))
+	{
+		auto& Data = Rows[RowIndex].Data;
+		FBlobHeader Blob;
+		Blob.Size = Data.Num();
+		Blob.Capacity = GetClassCapacity(GetSizeClass(BLOB_OVERHEAD + Data.Num()));
+		Blob.Owner = Header.DataBegin + RowIndex * RowSize;
+		DataPointers[RowIndex] = DataPointer;
+		DataPointer += Blob.Capacity;
+
+		Buffer.Append((const uint8*)&Blob, sizeof(Blob));
+		Buffer.Append(Data);
+		Buffer.AddZeroed(Blob.Capacity - BLOB_OVERHEAD - Data.Num());
+		Buffer.Append((const uint8*)&Blob.Capacity, sizeof(Blob.Capacity));
+		if (Buffer.Num() >= BULK_BUFFER_SIZE)
+			FlushBuffer(DataFile, DataPos);
+	}
+	if (Buffer.Num() > 0)
+		FlushBuffer(DataFile, DataPos);
+	Header.DataFileEnd = DataPos;
+
+	uint64 RowPos = Header.DataBegin;
+	for (auto RowIndex : XRange(Rows.Num()))
+	{
+		auto RowOffset = Buffer.AddZeroed(RowSize);
+		auto Row = Buffer.GetData() + RowOffset;
+		for (auto& Item : Rows[RowIndex].Keys)
+		{
+			auto& Index = Indices[Item.Key];
+			FIndexHelper::Write(Item.Value, Row + Index.KeyOffset, Index.KeyTypes, FileSystem->GetStaticText());
+		}
+		FMemory::Memcpy(Row + Header.RowDataOffset, &DataPointers[RowIndex], sizeof(uint64));
+		if (Buffer.Num() >= BULK_BUFFER_SIZE)
+			FlushBuffer(File, RowPos);
+	}
+	if (Buffer.Num() > 0)
+		FlushBuffer(File, RowPos);
+
+	// the table was empty, the filters only get the new keys
+	for (auto& Item : IndexEntries)
+	{
+		auto& Index = Indices[Item.Key];
+		Index.Index->BulkLoad(Item.Value, FillFactor);
+		Index.Filter->Reset(FMath::Max(Index.Filter->GetCapacity(), (uint32)Item.Value.Num() * 2));
+		for (auto& Entry : Item.Value)
+			Index.Filter->Add(FBloomFilter::Hash(Entry.Key));
+	}
+	for (auto& Item : OrderedEntries)
+	{
+		auto& Index = Indices[Item.Key];
+		Index.OrderedIndex->BulkLoad(Item.Value, FillFactor);
+		Index.Filter->Reset(FMath::Max(Index.Filter->GetCapacity(), (uint32)Item.Value.Num() * 2));
+		for (auto& Entry : Item.Value)
+			Index.Filter->Add(FBloomFilter::Hash(Entry.Key));
+	}
+
+	Header.NumRows += Rows.Num();
+	Header.DataEnd = (uint32)RowPos;
+	FlushHeader();
+	return true;
+}
+
 bool FDBTable::UpdateRow(const FString& KeyName, const FKeySequence& Key, const void* Buffer, int Size)
 {
-	auto Index = Indices.Find(KeyName);
-	check(Index);
-	auto KeyId = ConverToNumber(Key, Index->KeyTypes, false);
-	auto DataIndices = Index->Index->Find(KeyId);
+	return UpdateRow(GetIndexHandle(KeyName), Key, Buffer, Size);
+}
+
+bool FDBTable::UpdateRow(const FDBIndexHandle& Handle, const FKeySequence& Key, const void* Buffer, int Size)
+{
+	FFileSystem::FMutationScope Mutation(FileSystem);
+	auto Index = &GetIndex(Handle);
+	auto DataIndices = FindRowIds(*Index, MakeIndexKey(*Index, Key, false));
 	if (DataIndices.Num() == 0)
 		return false;
 
 
 	for (auto& Data : DataIndices)
 	{
-		if (!Equal(Data, Index->KeyOffset,Key, Index->KeyTypes))
+		if (!IsRowValid(Data) || !Equal(Data, Index->KeyOffset,Key, Index->KeyTypes))
 			continue;
 		UpdateRow(Data, Buffer, Size);
 	}
+	FlushHeader();
 
 	return true;
 }
 
 bool FDBTable::RemoveRow(const FString& KeyName, const FKeySequence& Key)
 {
-	auto Index = Indices.Find(KeyName);
-	check(Index);
-	auto KeyId = ConverToNumber(Key, Index->KeyTypes, false);
-	auto DataIndices = Index->Index->Find(KeyId);
+	return RemoveRow(GetIndexHandle(KeyName), Key);
+}
+
+bool FDBTable::RemoveRow(const FDBIndexHandle& Handle, const FKeySequence& Key)
+{
+	FFileSystem::FMutationScope Mutation(FileSystem);
+	auto Index = &GetIndex(Handle);
+	auto DataIndices = FindRowIds(*Index, MakeIndexKey(*Index, Key, false));
 	if (DataIndices.Num() == 0)
 		return false;
 
 
+	// the row leaves every index under the key it has there, its data block goes back to the free lists
 	int RemoveCount = 0;
-	auto Count = DataIndices.Num();
-	for (int i = 0; i < Count; ++i)
+	for (auto Data : DataIndices)
 	{
-		auto Data = DataIndices[i];
-
-		if (!IsRowValid(Data))
+		if (!IsRowValid(Data) || !Equal(Data, Index->KeyOffset, Key, Index->KeyTypes))
 			continue;
-		if (!Equal(Data, Index->KeyOffset, Key, Index->KeyTypes))
-		{
-			if (RemoveCount)
-			{
-				MoveRowData(DataIndices[i - RemoveCount], Data);
-			}
-		}
-		else
+
+		for (auto& Item : Indices)
 		{
-			File->SeekWrite(Data + Header.RowDataOffset);
-			File->Write(INVALID_DATA_INDEX);
-			RemoveCount++;
+			auto& Other = Item.Value;
+			RemoveRowId(Other, MakeIndexKey(Other, ReadRowKey(Data, Other.KeyOffset, Other.KeyTypes), false), Data);
 		}
+
+		uint64 DataPointer;
+		CHECK_RESULT(File->ReadAt(Data + Header.RowDataOffset, DataPointer));
+		FreeData(DataPointer);
+		CHECK_RESULT(File->WriteAt(Data + Header.RowDataOffset, INVALID_DATA_POINTER));
+		FreeRow(Data);
+		RemoveCount++;
 	}
 
 
@@ -354,11 +1052,71 @@ bool FDBTable::RemoveRow(const FString& KeyName, const FKeySequence& Key)
 
 }
 
+bool FDBTable::Vacuum(int32 MaxMoves)
+{
+	FFileSystem::FMutationScope Mutation(FileSystem);
+
+	bool bFinished = true;
+	int32 Moves = 0;
+	while (Header.DataFileEnd > 0)
+	{
+		uint32 Capacity;
+		CHECK_RESULT(DataFile->ReadAt(Header.DataFileEnd - sizeof(Capacity), Capacity));
+		auto DataPointer = Header.DataFileEnd - Capacity;
+		FBlobHeader Blob;
+		CHECK_RESULT(DataFile->ReadAt(DataPointer, Blob));
+		check(Blob.Capacity == Capacity);
+
+		if (Blob.Size == FREE_BLOB_SIZE)
+		{
+			UnlinkFree(DataPointer, Capacity);
+			Header.DataFileEnd = DataPointer;
+			continue;
+		}
+
+		if (Moves >= MaxMoves)
+		{
+			bFinished = false;
+			break;
+		}
+
+		// every free block lies in front of the last block, take the smallest one that fits
+		auto Class = GetSizeClass(Capacity);
+		while (Class < NUM_SIZE_CLASSES && Header.FreeLists[Class] == INVALID_DATA_POINTER)
+			++Class;
+		if (Class == NUM_SIZE_CLASSES)
+			break;
+
+		auto Target = Header.FreeLists[Class];
+		Blob.Capacity = GetClassCapacity(Class);
+		UnlinkFree(Target, Blob.Capacity);
+
+		TArray<uint8> Data;
+		Data.SetNumUninitialized(Blob.Size, false);
+		CHECK_RESULT(DataFile->ReadAt(DataPointer + sizeof(Blob), Data.GetData(), Blob.Size));
+		CHECK_RESULT(DataFile->WriteAt(Target, Blob));
+		if (Blob.Size > 0)
+			CHECK_RESULT(DataFile->WriteAt(Target + sizeof(Blob), Data.GetData(), Blob.Size));
+
+		uint64 RowPointer;
+		CHECK_RESULT(File->ReadAt(Blob.Owner + Header.RowDataOffset, RowPointer));
+		check(RowPointer == DataPointer);
+		CHECK_RESULT(File->WriteAt(Blob.Owner + Header.RowDataOffset, Target));
+
+		Header.DataFileEnd = DataPointer;
+		Moves++;
+	}
+
+	DataFile->Truncate(Header.DataFileEnd);
+	FlushHeader();
+	return bFinished;
+}
+
 bool FDBTable::IsRowValid(uint32 DataIndex)
 {
 	File->SeekRead(DataIndex + Header.RowDataOffset);
-	uint32 Ptr;
-	return File->Read(Ptr) && Ptr != INVALID_DATA_INDEX;
+	uint64 Ptr;
+	return File->Read(Ptr) && Ptr != INVALID_DATA_POINTER;
 }
 
 
@@ -395,6 +1153,35 @@ bool FDBTable::Equal(uint32 DataIndex, int Offset, const FKeySequence& Keys, con
 }
 
 
+bool FDBTable::Equal(uint32 DataIndex, int Offset, const int64* Values, const FKeyTypeSequence& Types)
+{
+	File->SeekRead(DataIndex + Offset);
+
+	// strings have one id each, comparing the ids is enough
+	for (auto Type : Types)
+	{
+		switch (Type)
+		{
+		case EKeyType::Integer:
+		{
+			int64 Key;
+			if (!File->Read(Key) || Key != *Values)
+				return false;
+		}
+		break;
+		case EKeyType::String:
+		{
+			uint32 StringIndex;
+			if (!File->Read(StringIndex) || StringIndex != *Values)
+				return false;
+		}
+		break;
+		}
+		Values++;
+	}
+	return true;
+}
+
 FKeySequence FDBTable::ReadRowKey(uint32 DataIndex, int Offset, const FKeyTypeSequence& Types)
 {
 	File->SeekRead(DataIndex + Offset);
@@ -403,106 +1190,240 @@ FKeySequence FDBTable::ReadRowKey(uint32 DataIndex, int Offset, const FKeyTypeSe
 	return Keys;
 }
 
-bool FDBTable::MoveRowData(uint32 DstDataIndex, uint32 SrcDataIndex)
+bool FDBTable::ReadRowData(uint32 DataIndex, RowData& Data)
 {
-	if (DstDataIndex == INVALID_DATA_INDEX || SrcDataIndex == INVALID_DATA_INDEX)
+	if (DataIndex == INVALID_DATA_INDEX)
 		return false;
 
-	File->SeekRead(SrcDataIndex + Header.RowDataOffset);
-	uint32 DataPointer;
+	File->SeekRead(DataIndex + Header.RowDataOffset);
+	uint64 DataPointer;
 	File->Read(DataPointer);
-
-	File->SeekWrite(DstDataIndex + Header.RowDataOffset);
-	File->Write(DataPointer);
+	if (DataPointer == INVALID_DATA_POINTER)
+		return false;
+	FBlobHeader Blob;
+	DataFile->ReadAt(DataPointer, Blob);
+	Data.SetNumUninitialized(Blob.Size, false);
+	DataFile->ReadAt(DataPointer + sizeof(Blob), Data.GetData(), Blob.Size);
 
 	return true;
 }
 
-
-bool FDBTable::ReadRowData(uint32 DataIndex, RowData& Data)
+bool FDBTable::ReadRowData(uint32 DataIndex, const TFunction<void* (int)>& Buffer)
 {
 	if (DataIndex == INVALID_DATA_INDEX)
 		return false;
 
 	File->SeekRead(DataIndex + Header.RowDataOffset);
-	uint32 DataPointer;
+	uint64 DataPointer;
 	File->Read(DataPointer);
-	if (DataPointer == INVALID_DATA_INDEX)
+	if (DataPointer == INVALID_DATA_POINTER)
 		return false;
-	int Size;
-	DataFile->SeekRead(DataPointer);
-	DataFile->Read(Size);
-	Data.SetNumUninitialized(Size, false);
-	DataFile->Read(Data.GetData(), Size);
-
+	FBlobHeader Blob;
+	DataFile->ReadAt(DataPointer, Blob);
+	auto Data = Buffer(Blob.Size);
+	if (Blob.Size == 0)
+		return true;
+	if (!Data)
+		return false;
+	DataFile->ReadAt(DataPointer + sizeof(Blob), Data, Blob.Size);
 	return true;
 }
 
-bool FDBTable::ReadRowData(uint32 DataIndex, const TFunction<void* (int)>& Buffer)
+
+bool FDBTable::ReadRowView(uint32 DataIndex, FRowView& View)
 {
+	View.Release();
 	if (DataIndex == INVALID_DATA_INDEX)
 		return false;
 
-	File->SeekRead(DataIndex + Header.RowDataOffset);
-	uint32 DataPointer;
-	File->Read(DataPointer);
-	if (DataPointer == INVALID_DATA_INDEX)
+	uint64 DataPointer;
+	if (!File->ReadAt(DataIndex + Header.RowDataOffset, DataPointer) || DataPointer == INVALID_DATA_POINTER)
 		return false;
-	int Size;
-	DataFile->SeekRead(DataPointer);
-	DataFile->Read(Size);
-	auto Data = Buffer(Size);
-	if (Size == 0)
-		return true;
-	if (!Data)
+
+	return ReadBlobView(*DataFile, DataPointer, View);
+}
+
+bool FDBTable::ReadBlobView(const FFile& From, uint64 DataPointer, FRowView& View)
+{
+	View.Release();
+	FBlobHeader Blob;
+	if (!From.ReadAt(DataPointer, Blob))
 		return false;
-	DataFile->Read(Data, Size);
+
+	const uint64 Pos = DataPointer + sizeof(Blob);
+	if (Blob.Size > 0)
+	{
+		if (auto Pinned = From.Pin(Pos, Blob.Size))
+		{
+			View.Data = Pinned;
+			View.PinnedFile = &From;
+			View.PinnedPos = Pos;
+		}
+	}
+
+	if (!View.PinnedFile)
+	{
+		// rows across a page boundary and handles without pinning are copied, small rows stay in the inline storage
+		View.Copy.SetNumUninitialized(Blob.Size, false);
+		if (Blob.Size > 0 && !From.ReadAt(Pos, View.Copy.GetData(), Blob.Size))
+			return false;
+		View.Data = View.Copy.GetData();
+	}
+
+	View.Size = Blob.Size;
+	View.bValid = true;
 	return true;
 }
 
+uint64 FDBTable::WriteData(const void* Buffer, int Size, uint32 Owner)
+{
+	FBlobHeader Blob;
+	Blob.Size = Size;
+	Blob.Owner = Owner;
+	auto DataPointer = AllocateData(BLOB_OVERHEAD + Size, Blob.Capacity);
+	CHECK_RESULT(DataFile->WriteAt(DataPointer, Blob));
+	if (Size > 0)
+		CHECK_RESULT(DataFile->WriteAt(DataPointer + sizeof(Blob), Buffer, Size));
+	return DataPointer;
+}
 
-uint32 FDBTable::WriteData(const void* Buffer, int Size)
+uint64 FDBTable::AllocateData(uint32 BlockSize, uint32& Capacity)
 {
-	auto DataPointer = DataFile->GetSize();
-	DataFile->SeekWrite(DataPointer);
-	DataFile->Write(Size);
-	DataFile->Write(Buffer, Size);
+	auto Class = GetSizeClass(BlockSize);
+	check(Class < NUM_SIZE_CLASSES);
+	Capacity = GetClassCapacity(Class);
+
+	auto DataPointer = Header.FreeLists[Class];
+	if (DataPointer != INVALID_DATA_POINTER)
+	{
+		UnlinkFree(DataPointer, Capacity);
+		return DataPointer;
+	}
+
+	DataPointer = Header.DataFileEnd;
+	Header.DataFileEnd += Capacity;
+	DataFile->Reserve(Header.DataFileEnd);
+	CHECK_RESULT(DataFile->WriteAt(Header.DataFileEnd - sizeof(Capacity), Capacity));
 	return DataPointer;
 }
 
+void FDBTable::FreeData(uint64 DataPointer)
+{
+	FBlobHeader Blob;
+	CHECK_RESULT(DataFile->ReadAt(DataPointer, Blob));
+	Blob.Size = FREE_BLOB_SIZE;
+	Blob.Owner = INVALID_DATA_INDEX;
+	CHECK_RESULT(DataFile->WriteAt(DataPointer, Blob));
+	LinkFree(DataPointer, Blob.Capacity);
+}
+
+void FDBTable::LinkFree(uint64 DataPointer, uint32 Capacity)
+{
+	auto& Head = Header.FreeLists[GetSizeClass(Capacity)];
+	FFreeLinks Links{ INVALID_DATA_POINTER, Head };
+	CHECK_RESULT(DataFile->WriteAt(DataPointer + sizeof(FBlobHeader), Links));
+	if (Head != INVALID_DATA_POINTER)
+		CHECK_RESULT(DataFile->WriteAt(Head + sizeof(FBlobHeader) + STRUCT_OFFSET(FFreeLinks, Prev), DataPointer));
+	Head = DataPointer;
+}
+
+void FDBTable::UnlinkFree(uint64 DataPointer, uint32 Capacity)
+{
+	FFreeLinks Links;
+	CHECK_RESULT(DataFile->ReadAt(DataPointer + sizeof(FBlobHeader), Links));
+	if (Links.Prev != INVALID_DATA_POINTER)
+		CHECK_RESULT(DataFile->WriteAt(Links.Prev + sizeof(FBlobHeader) + STRUCT_OFFSET(FFreeLinks, Next), Links.Next));
+	else
+		Header.FreeLists[GetSizeClass(Capacity)] = Links.Next;
+
+	if (Links.Next != INVALID_DATA_POINTER)
+		CHECK_RESULT(DataFile->WriteAt(Links.Next + sizeof(FBlobHeader) + STRUCT_OFFSET(FFreeLinks, Prev), Links.Prev));
+}
+
 
-void FDBTable::WriteRow(const TMap<FString, FKeySequence>& Keys, uint32 DataIndex, uint32 Data)
+void FDBTable::WriteRow(const FRowKeys& Keys, uint32 DataIndex, uint64 Data)
 {
 	for (auto& Item : Keys)
 	{
-		auto Index = Indices.Find(Item.Key);
-		check(Index);
-		File->SeekWrite(DataIndex + Index->KeyOffset);
-		FIndexHelper::Write(Item.Value, File, Index->KeyTypes);
+		File->SeekWrite(DataIndex + Item.Key->KeyOffset);
+		FIndexHelper::Write(*Item.Value, File, Item.Key->KeyTypes);
 	}
 	File->SeekWrite(DataIndex + Header.RowDataOffset);
 	File->Write(Data);
 }
 
-uint32 FDBTable::WriteRow(const TMap<FString, FKeySequence>& Keys, const void* Buffer, int Size)
+void FDBTable::WriteRowKey(uint32 DataIndex, const FIndex& Index, const int64* Values)
 {
-	return WriteRow(Keys,WriteData(Buffer, Size));
+	File->SeekWrite(DataIndex + Index.KeyOffset);
+	for (auto Type : Index.KeyTypes)
+	{
+		switch (Type)
+		{
+		case EKeyType::Integer: File->Write(*Values); break;
+		case EKeyType::String: File->Write((uint32)*Values); break;
+		}
+		Values++;
+	}
 }
 
-uint32 FDBTable::WriteRow(const TMap<FString, FKeySequence>& Keys, uint32 Data)
+uint32 FDBTable::WriteRow(const FRowKeys& Keys, const void* Buffer, int Size)
 {
-	auto DataIndex = Header.DataEnd;
-	WriteRow(Keys,DataIndex,Data);
+	auto DataIndex = AllocateRow();
+	WriteRow(Keys, DataIndex, WriteData(Buffer, Size, DataIndex));
 	Header.NumRows++;
-	Header.DataEnd = DataIndex + Header.RowDataOffset + sizeof(Data);
 	FlushHeader();
 	return DataIndex;
 }
 
+uint32 FDBTable::AllocateRow()
+{
+	const uint32 RowSize = Header.RowDataOffset + sizeof(uint64);
+	if (Header.FreeRow == INVALID_DATA_INDEX)
+	{
+		auto DataIndex = Header.DataEnd;
+		check((uint64)DataIndex + RowSize <= MAX_uint32);
+		Header.DataEnd = DataIndex + RowSize;
+		return DataIndex;
+	}
+
+	auto DataIndex = Header.FreeRow;
+	CHECK_RESULT(File->ReadAt(DataIndex, Header.FreeRow));
+
+	// keys the new row is not given must not be left over from the removed one
+	TArray<uint8, TInlineAllocator<64>> Zeros;
+	Zeros.SetNumZeroed(Header.RowDataOffset);
+	CHECK_RESULT(File->WriteAt(DataIndex, Zeros.GetData(), Zeros.Num()));
+	return DataIndex;
+}
+
+void FDBTable::FreeRow(uint32 DataIndex)
+{
+	// every table that can remove a row has an index, so there is room for the link
+	check(Header.RowDataOffset >= (int32)sizeof(uint32));
+	CHECK_RESULT(File->WriteAt(DataIndex, Header.FreeRow));
+	Header.FreeRow = DataIndex;
+}
+
 void FDBTable::UpdateRow(uint32 DataIndex, const void* Buffer, int Size)
 {
-	File->SeekWrite(DataIndex + Header.RowDataOffset);
-	File->Write(WriteData(Buffer, Size));
+	uint64 DataPointer;
+	CHECK_RESULT(File->ReadAt(DataIndex + Header.RowDataOffset, DataPointer));
+	FBlobHeader Blob;
+	CHECK_RESULT(DataFile->ReadAt(DataPointer, Blob));
+
+	// rewrite in place if the block fits and is not more than twice as large as needed
+	auto BlockSize = BLOB_OVERHEAD + Size;
+	if (BlockSize <= Blob.Capacity && GetSizeClass(BlockSize) + 4 > GetSizeClass(Blob.Capacity))
+	{
+		Blob.Size = Size;
+		CHECK_RESULT(DataFile->WriteAt(DataPointer, Blob));
+		if (Size > 0)
+			CHECK_RESULT(DataFile->WriteAt(DataPointer + sizeof(Blob), Buffer, Size));
+		return;
+	}
+
+	FreeData(DataPointer);
+	CHECK_RESULT(File->WriteAt(DataIndex + Header.RowDataOffset, WriteData(Buffer, Size, DataIndex)));
 }
 
 void FDBTable::FlushHeader()
@@ -529,3 +1450,145 @@ int64 FDBTable::ConverToNumber(const FKeySequence& Key,const FKeyTypeSequence& T
 	return FIndexHelper::Hash(Key);
 }
 
+FDBTable::FIndexKey FDBTable::MakeIndexKey(const FIndex& Index, const FKeySequence& Key, bool bRefresh)
+{
+	FIndexKey Result;
+	if (Index.IsOrdered())
+		FIndexHelper::Encode(Key, Index.KeyTypes, Result.Bytes);
+	else
+		Result.Number = ConverToNumber(Key, Index.KeyTypes, bRefresh);
+	return Result;
+}
+
+uint64 FDBTable::HashIndexKey(const FIndex& Index, const FIndexKey& Key)
+{
+	if (Index.IsOrdered())
+		return FBloomFilter::Hash(Key.Bytes);
+	return FBloomFilter::Hash(Key.Number);
+}
+
+void FDBTable::RebuildFilter(const FIndex& Index, uint32 Capacity)
+{
+	Index.Filter->Reset(Capacity);
+	const uint32 RowSize = Header.RowDataOffset + sizeof(uint64);
+	for (auto DataIndex = Header.DataBegin; DataIndex < Header.DataEnd; DataIndex += RowSize)
+	{
+		if (!IsRowValid(DataIndex))
+			continue;
+		auto Key = ReadRowKey(DataIndex, Index.KeyOffset, Index.KeyTypes);
+		Index.Filter->Add(HashIndexKey(Index, MakeIndexKey(Index, Key, false)));
+	}
+}
+
+bool FDBTable::FindRowIds(const FIndex& Index, const FIndexKey& Key, const TFunction<bool(uint32)>& Callback)
+{
+	if (!Index.Filter->MayContain(HashIndexKey(Index, Key)))
+		return false;
+	if (Index.IsOrdered())
+		return Index.OrderedIndex->FindOne(Key.Bytes, Callback);
+	return Index.Index->FindOne(Key.Number, Callback);
+}
+
+TArray<uint32> FDBTable::FindRowIds(const FIndex& Index, const FIndexKey& Key)
+{
+	TArray<uint32> DataIndices;
+	FindRowIds(Index, Key, [&](uint32 DataIndex)
+		{
+			DataIndices.Add(DataIndex);
+			return false;
+		});
+	return DataIndices;
+}
+
+void FDBTable::InsertRowId(const FIndex& Index, const FIndexKey& Key, uint32 DataIndex)
+{
+	// the row is written already, a rebuilt filter may hold its key before it is added
+	if (Index.Filter->IsFull())
+		RebuildFilter(Index, Index.Filter->GetCapacity() * 2);
+	Index.Filter->Add(HashIndexKey(Index, Key));
+
+	if (Index.IsOrdered())
+		Index.OrderedIndex->Insert(Key.Bytes, DataIndex);
+	else
+		Index.Index->Insert(Key.Number, DataIndex);
+}
+
+bool FDBTable::RemoveRowId(const FIndex& Index, const FIndexKey& Key, uint32 DataIndex)
+{
+	// the filter keeps the key, it is cleared by the next rebuild
+	if (Index.IsOrdered())
+		return Index.OrderedIndex->Remove(Key.Bytes, DataIndex);
+	return Index.Index->Remove(Key.Number, DataIndex);
+}
+
+bool FDBTable::ResolveValue(const FString& Value, bool bRefresh, int64& OutValue)
+{
+	uint32 StringIndex = bRefresh ? FileSystem->GetStaticText().FindOrCreate(Value) : FileSystem->GetStaticText().Find(Value);
+	OutValue = StringIndex;
+	return StringIndex != (uint32)-1;
+}
+
+
+FDBTableCursor::FDBTableCursor(FDBTable* InTable, int32 InBatchRows):
+	Table(InTable), BatchRows(FMath::Max(InBatchRows, 1))
+{
+	if (!Table)
+		return;
+
+	RowPos = Table->Header.DataBegin;
+	ReadBatch();
+}
+
+bool FDBTableCursor::Next()
+{
+	if (++Position < BatchNum)
+		return true;
+
+	ReadBatch();
+	return IsValid();
+}
+
+void FDBTableCursor::ReadBatch()
+{
+	BatchNum = 0;
+	Position = 0;
+
+	const auto& Header = Table->Header;
+	const uint32 RowSize = Header.RowDataOffset + sizeof(uint64);
+	int64 BatchSize = 0;
+
+	// removed rows are skipped, keep reading the directory until a row is found
+	while (BatchNum == 0 && RowPos < Header.DataEnd)
+	{
+		auto Count = FMath::Min<uint32>(BatchRows, (Header.DataEnd - RowPos) / RowSize);
+		Directory.SetNumUninitialized(Count * RowSize, false);
+		CHECK_RESULT(Table->File->ReadAt(RowPos, Directory.GetData(), Directory.Num()));
+
+		for (uint32 Index = 0; Index < Count && BatchSize < CURSOR_BATCH_SIZE; ++Index)
+		{
+			auto RowId = RowPos;
+			RowPos += RowSize;
+
+			uint64 DataPointer;
+			FMemory::Memcpy(&DataPointer, Directory.GetData() + Index * RowSize + Header.RowDataOffset, sizeof(DataPointer));
+			if (DataPointer == INVALID_DATA_POINTER)
+				continue;
+
+			if (BatchNum == Batch.Num())
+			{
+				Batch.AddDefaulted();
+				RowIds.AddDefaulted();
+			}
+
+			FBlobHeader Blob;
+			CHECK_RESULT(Table->DataFile->ReadAt(DataPointer, Blob));
+			auto& Data = Batch[BatchNum];
+			Data.SetNumUninitialized(Blob.Size, false);
+			CHECK_RESULT(Table->DataFile->ReadAt(DataPointer + sizeof(Blob), Data.GetData(), Blob.Size));
+
+			RowIds[BatchNum] = RowId;
+			BatchNum++;
+			BatchSize += Blob.Size;
+		}
+	}
+}
@@ -3,86 +3,418 @@
 #include "Index.h"
 #include "File.h"
 
+class FDBTable;
+class FDBTableCursor;
+
+struct FDBTableIndex
+{
+	// one of the two is set, composite keys go into an ordered index
+	FBaseIndex::Ptr Index;
+	FOrderedIndex::Ptr OrderedIndex;
+	FFile::Ptr File;
+	FKeyTypeSequence KeyTypes;
+	int KeyOffset;
+	// keys which may be in the index, it is checked before the index is searched
+	TSharedPtr<class FBloomFilter> Filter;
+	FFile::Ptr FilterFile;
+
+	bool IsOrdered() const { return OrderedIndex.IsValid(); }
+};
+
+// an index of a table resolved once by its name, queries with it skip the lookup by name.
+// valid while the table is open
+class FDBIndexHandle
+{
+public:
+	FDBIndexHandle() = default;
+	bool IsValid() const { return Index != nullptr; }
+
+private:
+	friend class FDBTable;
+	FDBIndexHandle(const FDBTable* InTable, const FDBTableIndex* InIndex) : Table(InTable), Index(InIndex) {}
+
+	const FDBTable* Table = nullptr;
+	const FDBTableIndex* Index = nullptr;
+};
+
 class DATABASELITE_API FDBTable
 {
+	friend class FDBTableCursor;
+	using FIndex = FDBTableIndex;
 public:
 	using RowData = TArray<uint8>;
 	using RowArray = TArray<RowData>;
+
+	struct FBulkRow
+	{
+		TMap<FString, FKeySequence> Keys;
+		RowData Data;
+	};
+
+	// read-only bytes of a row, in place in the page cache or the mapping when the row lies in one page,
+	// copied otherwise. valid until it is released, the table must not be modified meanwhile
+	class DATABASELITE_API FRowView
+	{
+	public:
+		FRowView() = default;
+		FRowView(FRowView&& Other);
+		FRowView& operator=(FRowView&& Other);
+		FRowView(const FRowView&) = delete;
+		FRowView& operator=(const FRowView&) = delete;
+		~FRowView() { Release(); }
+
+		bool IsValid() const { return bValid; }
+		const uint8* GetData() const { return Data; }
+		int32 Num() const { return Size; }
+		void Release();
+
+	private:
+		friend class FDBTable;
+		const uint8* Data = nullptr;
+		int32 Size = 0;
+		bool bValid = false;
+		const FFile* PinnedFile = nullptr;
+		uint64 PinnedPos = 0;
+		TArray<uint8, TInlineAllocator<256>> Copy;
+	};
+
+	// streams the rows of an index in key order, the table must not be modified while it is in use
+	class DATABASELITE_API FRangeCursor
+	{
+	public:
+		bool IsValid() const { return Cursor && Cursor->IsValid(); }
+		uint32 GetRowId() const { return Cursor->GetData(); }
+		bool GetRowData(RowData& Data) const;
+		bool GetRowView(FRowView& View) const;
+		void Next();
+
+	private:
+		friend class FDBTable;
+		FRangeCursor(FDBTable* InTable, const FDBTableIndex* InIndex, FIndexCursor::Ptr InCursor);
+		void SkipInvalid();
+
+		FDBTable* Table;
+		const FDBTableIndex* Index;
+		FIndexCursor::Ptr Cursor;
+	};
 public:
 	FDBTable(FFile::Ptr InFile);
 
-	void Init(const TMap<FString, FKeyTypeSequence>& IndexKeyTypes);
-	void Open();
+	// indices missing from IndexTypes are B-trees
+	void Init(const TMap<FString, FKeyTypeSequence>& IndexKeyTypes, const TMap<FString, EIndexType>& IndexTypes = {});
+	// false when the table was written by another version of the format
+	bool Open();
 	void Delete();
+	// writes the bloom filters of the indices, until then they are rebuilt when the table is opened
+	void FlushFilters();
+
+	// invalid when the table has no such index
+	FDBIndexHandle GetIndexHandle(const FString& KeyName) const;
 
 	TArray<RowData> GetRows();
+	/*
+		scans the rows on NumWorkers threads, one per core when 0. the row directory is split into ranges of pages
+		which the workers take in turn, every worker reads through a handle of its own (see FFileSystem::OpenReadHandle),
+		except with the write-ahead log and for databases served from memory, where they share one.
+		Predicate picks the rows and Consumer gets them with their row id, both are called from several threads at once
+		in no particular order. the table must not be modified during the scan, returns the number of rows consumed
+	*/
+	int32 ParallelScan(TFunctionRef<bool(uint32, const FRowView&)> Predicate, TFunctionRef<void(uint32, const FRowView&)> Consumer, int32 NumWorkers = 0);
+	// streams the rows in batches instead of loading all of them
+	FDBTableCursor CreateCursor(int32 BatchRows = 256);
 	RowArray Find(const FString& KeyName, const FKeySequence& Key);
 	bool FindOne(const FString& KeyName, const FKeySequence& Key, const TFunction<void*(int)>& Buffer);
 	bool FindOne(const FString& KeyName, const FKeySequence& Key, const TFunction<bool(const void*, int)>& Buffer);
 	bool FindOne(const FString& KeyName, const FKeySequence& Key, FString& Str);
+	bool FindOne(const FString& KeyName, const FKeySequence& Key, FRowView& View);
+	// visits the rows with the key without copying them, stops when Visitor returns false. returns the number visited
+	int32 FindViews(const FString& KeyName, const FKeySequence& Key, TFunctionRef<bool(const FRowView&)> Visitor);
+	// rows of many keys at once, the index is walked once with the sorted keys and the rows are read in file order.
+	// equal keys are searched once, Visitor gets the position of the first of them and a row and returns false to stop.
+	// returns the number of rows visited
+	int32 FindMany(const FString& KeyName, TArrayView<const FKeySequence> Keys, TFunctionRef<bool(int32, const FRowView&)> Visitor);
+	// a hash index finds nothing. for indices with a single integer key Lo and Hi are inclusive. multi-column indices are ordered,
+	// Lo and Hi may be key prefixes there, e.g. (PlayerId) to (PlayerId) gives all rows of the player by time.
+	// strings are ordered ignoring case, so a range of "foo" has the rows of "Foo" as well
+	FRangeCursor FindRange(const FString& KeyName, const FKeySequence& Lo, const FKeySequence& Hi, bool bAscending = true);
+
+	// same queries with an index resolved before, no lookup by name
+	RowArray Find(const FDBIndexHandle& Handle, const FKeySequence& Key);
+	bool FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key, const TFunction<void*(int)>& Buffer);
+	bool FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key, const TFunction<bool(const void*, int)>& Buffer);
+	bool FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key, FString& Str);
+	bool FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key, FRowView& View);
+	int32 FindViews(const FDBIndexHandle& Handle, const FKeySequence& Key, TFunctionRef<bool(const FRowView&)> Visitor);
+	int32 FindMany(const FDBIndexHandle& Handle, TArrayView<const FKeySequence> Keys, TFunctionRef<bool(int32, const FRowView&)> Visitor);
+	FRangeCursor FindRange(const FDBIndexHandle& Handle, const FKeySequence& Lo, const FKeySequence& Hi, bool bAscending = true);
 
 	template<class T>
 	bool FindOne(const FString& KeyName, const FKeySequence& Key, T& Value)
 	{
-		return FindOne(KeyName, Key, [&](int Size)->void*{
+		return FindOne(GetIndexHandle(KeyName), Key, Value);
+	}
+
+	template<class T>
+	bool FindOne(const FDBIndexHandle& Handle, const FKeySequence& Key, T& Value)
+	{
+		return FindOne(Handle, Key, [&](int Size)->void*{
 			if (Size != sizeof (T))
 				return nullptr;
 			return &Value;
 		});
 	}
 
+	// typed lookups, the key types have to be the ones of the index
+	template<class... Ts>
+	RowArray Find(const FString& KeyName, const TDBKey<Ts...>& Key)
+	{
+		return Find(GetIndexHandle(KeyName), Key);
+	}
+
+	template<class... Ts>
+	RowArray Find(const FDBIndexHandle& Handle, const TDBKey<Ts...>& Key)
+	{
+		const FIndex& Index = GetIndex(Handle, Key);
+		int64 Values[TDBKey<Ts...>::NumKeys];
+		if (!ResolveKey(Key, Values, false))
+			return RowArray();
+		return FindResolved(Index, MakeIndexKey(Index, Key, Values), Values);
+	}
+
+	template<class... Ts>
+	bool FindOne(const FString& KeyName, const TDBKey<Ts...>& Key, FRowView& View)
+	{
+		return FindOne(GetIndexHandle(KeyName), Key, View);
+	}
+
+	template<class... Ts>
+	bool FindOne(const FDBIndexHandle& Handle, const TDBKey<Ts...>& Key, FRowView& View)
+	{
+		View.Release();
+		const FIndex& Index = GetIndex(Handle, Key);
+		int64 Values[TDBKey<Ts...>::NumKeys];
+		if (!ResolveKey(Key, Values, false))
+			return false;
+		return FindOneResolved(Index, MakeIndexKey(Index, Key, Values), Values, View);
+	}
+
+	template<class... Ts>
+	bool FindOne(const FString& KeyName, const TDBKey<Ts...>& Key, FString& Str)
+	{
+		return FindOne(GetIndexHandle(KeyName), Key, Str);
+	}
+
+	template<class... Ts>
+	bool FindOne(const FDBIndexHandle& Handle, const TDBKey<Ts...>& Key, FString& Str)
+	{
+		FRowView View;
+		if (!FindOne(Handle, Key, View))
+			return false;
+		ReadString(View.GetData(), Str);
+		return true;
+	}
+
+	template<class T, class... Ts>
+	bool FindOne(const FString& KeyName, const TDBKey<Ts...>& Key, T& Value)
+	{
+		return FindOne(GetIndexHandle(KeyName), Key, Value);
+	}
+
+	template<class T, class... Ts>
+	bool FindOne(const FDBIndexHandle& Handle, const TDBKey<Ts...>& Key, T& Value)
+	{
+		FRowView View;
+		if (!FindOne(Handle, Key, View) || View.Num() != sizeof(T))
+			return false;
+		FMemory::Memcpy(&Value, View.GetData(), sizeof(T));
+		return true;
+	}
+
+	// adds a row with the key of a single index
+	template<class... Ts>
+	bool AddRow(const FString& KeyName, const TDBKey<Ts...>& Key, const void* Buffer, int Size, bool bUnique)
+	{
+		return AddRow(GetIndexHandle(KeyName), Key, Buffer, Size, bUnique);
+	}
+
+	template<class... Ts>
+	bool AddRow(const FDBIndexHandle& Handle, const TDBKey<Ts...>& Key, const void* Buffer, int Size, bool bUnique)
+	{
+		FFileSystem::FMutationScope Mutation(FileSystem);
+		const FIndex& Index = GetIndex(Handle, Key);
+		int64 Values[TDBKey<Ts...>::NumKeys];
+		CHECK_RESULT(ResolveKey(Key, Values, true));
+		return AddRowResolved(Index, MakeIndexKey(Index, Key, Values), Values, Buffer, Size, bUnique);
+	}
+
+	template<class T, class... Ts>
+	bool AddRow(const FString& KeyName, const TDBKey<Ts...>& Key, const T& Value, bool bUnique)
+	{
+		return AddRow(GetIndexHandle(KeyName), Key, &Value, sizeof(Value), bUnique);
+	}
+
+	template<class T, class... Ts>
+	bool AddRow(const FDBIndexHandle& Handle, const TDBKey<Ts...>& Key, const T& Value, bool bUnique)
+	{
+		return AddRow(Handle, Key, &Value, sizeof(Value), bUnique);
+	}
+
 	bool AddRow(const TMap<FString, FKeySequence>& Keys, const void* Buffer, int Size, bool bUnique);
 	bool AddRow(const TMap<FString, FKeySequence>& Keys,const FString& Val, bool bUnique);
+	// adds a row with the key of a single index
+	bool AddRow(const FDBIndexHandle& Handle, const FKeySequence& Key, const void* Buffer, int Size, bool bUnique);
 
 	template<class T>
 	bool AddRow(const TMap<FString, FKeySequence>& Keys, const T& Value, bool bUnique )
 	{
 		return AddRow(Keys, &Value, sizeof(Value), bUnique);
 	}
+
+	template<class T>
+	bool AddRow(const FDBIndexHandle& Handle, const FKeySequence& Key, const T& Value, bool bUnique)
+	{
+		return AddRow(Handle, Key, &Value, sizeof(Value), bUnique);
+	}
+	// builds the indices bottom-up when the table is empty, otherwise falls back to AddRow
+	bool BulkInsert(const TArray<FBulkRow>& Rows, bool bUnique, float FillFactor = 1.0f);
+
 	bool UpdateRow(const FString& KeyName, const FKeySequence& Key, const void* Buffer, int Size);
+	bool UpdateRow(const FDBIndexHandle& Handle, const FKeySequence& Key, const void* Buffer, int Size);
 	template<class T>
 	bool UpdateRow(const FString& KeyName, const FKeySequence& Key, const T& Value)
 	{
-		return UpdateRow(KeyName, Key, &Value, sizeof(Value));
+		return UpdateRow(GetIndexHandle(KeyName), Key, &Value, sizeof(Value));
+	}
+
+	template<class T>
+	bool UpdateRow(const FDBIndexHandle& Handle, const FKeySequence& Key, const T& Value)
+	{
+		return UpdateRow(Handle, Key, &Value, sizeof(Value));
 	}
 
 
 	bool RemoveRow(const FString& KeyName, const FKeySequence& Key);
+	bool RemoveRow(const FDBIndexHandle& Handle, const FKeySequence& Key);
+
+	// moves at most MaxMoves rows from the end of the data file into free blocks and gives the freed pages back,
+	// returns true when nothing is left to compact
+	bool Vacuum(int32 MaxMoves = 1024);
+	// bytes of the data file including its free blocks, Vacuum brings it down
+	uint64 GetDataSize() const { return Header.DataFileEnd; }
 private:
 	FKeySequence ReadRowKey(uint32 DataIndex,int Offset, const FKeyTypeSequence& Types);
 	bool ReadRowData(uint32 DataIndex, RowData& Data);
 	bool ReadRowData(uint32 DataIndex, const TFunction<void* (int)>& Buffer);
-	bool MoveRowData(uint32 DstDataIndex, uint32 SrcDataIndex);
+	bool ReadRowView(uint32 DataIndex, FRowView& View);
+	// the row data starting at DataPointer of the data file
+	static bool ReadBlobView(const FFile& From, uint64 DataPointer, FRowView& View);
 	bool Equal(uint32 DataIndex,int Offset, const FKeySequence& Keys, const FKeyTypeSequence& Types);
 
-	uint32 WriteRow(const TMap<FString, FKeySequence>& Keys, const void* Buffer, int Size);
-	uint32 WriteRow(const TMap<FString, FKeySequence>& Keys, uint32 Data);
-	void WriteRow(const TMap<FString, FKeySequence>& Keys,uint32 DataIndex, uint32 Data);
+	// keys of a row with their indices resolved
+	using FRowKeys = TArray<TPair<const FIndex*, const FKeySequence*>, TInlineAllocator<4>>;
+	FRowKeys ResolveKeys(const TMap<FString, FKeySequence>& Keys) const;
+	bool AddRow(const FRowKeys& Keys, const void* Buffer, int Size, bool bUnique);
+
+	uint32 WriteRow(const FRowKeys& Keys, const void* Buffer, int Size);
+	void WriteRow(const FRowKeys& Keys,uint32 DataIndex, uint64 Data);
+	// a removed row is reused before the row directory grows
+	uint32 AllocateRow();
+	void FreeRow(uint32 DataIndex);
 
 	void UpdateRow(uint32 DataIndex, const void* Buffer, int Size);
-	uint32 WriteData(const void*Buffer, int Size);
+	uint64 WriteData(const void*Buffer, int Size, uint32 Owner);
+	uint64 AllocateData(uint32 BlockSize, uint32& Capacity);
+	void FreeData(uint64 DataPointer);
+	void LinkFree(uint64 DataPointer, uint32 Capacity);
+	void UnlinkFree(uint64 DataPointer, uint32 Capacity);
 
 	bool IsRowValid(uint32 DataIndex);
 
 	void FlushHeader();
 
 	int64 ConverToNumber(const FKeySequence& Key, const FKeyTypeSequence& Types, bool bRefresh);
+
+	const FIndex& GetIndex(const FDBIndexHandle& Handle) const;
+
+	template<class... Ts>
+	const FIndex& GetIndex(const FDBIndexHandle& Handle, const TDBKey<Ts...>& Key) const
+	{
+		const FIndex& Index = GetIndex(Handle);
+		check(Key.Matches(Index.KeyTypes));
+		return Index;
+	}
+
+	// a typed key as it is stored in a row: integers as they are, strings as their static text id.
+	// false when a string has no id yet, no row can have the key then
+	template<class... Ts>
+	bool ResolveKey(const TDBKey<Ts...>& Key, int64* Values, bool bRefresh)
+	{
+		bool bResolved = true;
+		Key.ForEach([&](const auto& Value)
+			{
+				bResolved = ResolveValue(Value, bRefresh, *Values++) && bResolved;
+			});
+		return bResolved;
+	}
+
+	bool ResolveValue(int64 Value, bool bRefresh, int64& OutValue)
+	{
+		OutValue = Value;
+		return true;
+	}
+	bool ResolveValue(const FString& Value, bool bRefresh, int64& OutValue);
+
+	// what the index is searched with: the encoded key for an ordered index, the number of the key otherwise
+	struct FIndexKey
+	{
+		int64 Number = 0;
+		FEncodedKey Bytes;
+	};
+
+	FIndexKey MakeIndexKey(const FIndex& Index, const FKeySequence& Key, bool bRefresh);
+
+	// same as MakeIndexKey of the equal FKeySequence
+	template<class... Ts>
+	static FIndexKey MakeIndexKey(const FIndex& Index, const TDBKey<Ts...>& Key, const int64* Values)
+	{
+		FIndexKey Result;
+		if (Index.IsOrdered())
+			Key.ForEach([&](const auto& Value) { FIndexHelper::Encode(Value, Result.Bytes); });
+		else
+			Result.Number = TDBKey<Ts...>::NumKeys == 1 ? Values[0] : Key.Hash();
+		return Result;
+	}
+
+	static uint64 HashIndexKey(const FIndex& Index, const FIndexKey& Key);
+	// fills the filter again from the keys of the rows
+	void RebuildFilter(const FIndex& Index, uint32 Capacity);
+
+	// Callback returns true to stop, the result is whether it did
+	bool FindRowIds(const FIndex& Index, const FIndexKey& Key, const TFunction<bool(uint32)>& Callback);
+	TArray<uint32> FindRowIds(const FIndex& Index, const FIndexKey& Key);
+	void InsertRowId(const FIndex& Index, const FIndexKey& Key, uint32 DataIndex);
+	bool RemoveRowId(const FIndex& Index, const FIndexKey& Key, uint32 DataIndex);
+
+	// row data written by AddRow with a string
+	static void ReadString(const uint8* Begin, FString& Str);
+
+	bool Equal(uint32 DataIndex, int Offset, const int64* Values, const FKeyTypeSequence& Types);
+	RowArray FindResolved(const FIndex& Index, const FIndexKey& Key, const int64* Values);
+	bool FindOneResolved(const FIndex& Index, const FIndexKey& Key, const int64* Values, FRowView& View);
+	bool AddRowResolved(const FIndex& Index, const FIndexKey& Key, const int64* Values, const void* Buffer, int Size, bool bUnique);
+	void WriteRowKey(uint32 DataIndex, const FIndex& Index, const int64* Values);
 private:
+
 	FFileSystem* FileSystem;
 	FFile::Ptr File;
 	FFile::Ptr DataFile;
 
 
-	struct FIndex
-	{
-		FBaseIndex::Ptr Index;
-		FFile::Ptr File;
-		FKeyTypeSequence KeyTypes;
-		int KeyOffset;
-	};
-
+	// handles point into the map, it only changes in Init, Open and Delete
 	TMap<FString, FIndex> Indices;
 
+	// free blocks of the data file are listed per size class
+	static constexpr int32 NUM_SIZE_CLASSES = 104;
 
 	struct
 	{
@@ -93,8 +425,56 @@ private:
 		int32 NumRows = 0;
 		int32 RowDataOffset = 0;
 		PageId DataFileId;
-		uint32 FreeList ;
+		uint64 DataFileEnd = 0;
+		uint64 FreeLists[NUM_SIZE_CLASSES];
+		// removed rows, listed through their first key bytes
+		uint32 FreeRow = 0;
 	}Header;
 };
 
+// reads the rows of a table front to back in batches, memory stays bounded however large the table is.
+// the table must not be modified while it is in use
+class DATABASELITE_API FDBTableCursor
+{
+public:
+	struct FIterator
+	{
+		FDBTableCursor* Cursor;
+
+		const FDBTable::RowData& operator*() const { return Cursor->Current(); }
+		bool operator!=(const FIterator& Other) const { return Cursor != Other.Cursor; }
+		FIterator& operator++()
+		{
+			if (!Cursor->Next())
+				Cursor = nullptr;
+			return *this;
+		}
+	};
+public:
+	FDBTableCursor() = default;
+	// a null table gives an empty cursor
+	explicit FDBTableCursor(FDBTable* InTable, int32 InBatchRows = 256);
+
+	bool IsValid() const { return Position < BatchNum; }
+	const FDBTable::RowData& Current() const { return Batch[Position]; }
+	uint32 GetRowId() const { return RowIds[Position]; }
+	bool Next();
 
+	FIterator begin() { return { IsValid() ? this : nullptr }; }
+	FIterator end() { return { nullptr }; }
+
+private:
+	void ReadBatch();
+private:
+	FDBTable* Table = nullptr;
+	int32 BatchRows = 0;
+	// the next row of the row directory to read
+	uint32 RowPos = 0;
+
+	// row buffers are reused from batch to batch
+	TArray<FDBTable::RowData> Batch;
+	TArray<uint32> RowIds;
+	int32 BatchNum = 0;
+	int32 Position = 0;
+	TArray<uint8> Directory;
+};
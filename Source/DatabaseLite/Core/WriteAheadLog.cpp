@@ -0,0 +1,522 @@
+#include "WriteAheadLog.h"
+#include "Async/Async.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+
+constexpr uint32 LOG_MAGIC_NUM = 0x10661e;
+
+enum class ELogRecordType : uint32
+{
+	PageDelta,
+	Commit,
+};
+
+struct FLogRecord
+{
+	uint32 MagicNum;
+	ELogRecordType Type;
+	uint32 Page;
+	// delta: offset in the page, commit: unused
+	uint32 Offset;
+	// delta: number of bytes behind the record, commit: number of bytes of the group
+	uint32 Size;
+	// commit: crc of the group
+	uint32 Checksum;
+};
+
+
+FWriteAheadLog::FWriteAheadLog(ILowLevelFile::Ptr InBaseFile, const FString& InLogName, uint64 InCheckpointSize):
+	BaseFile(InBaseFile), LogName(InLogName), CheckpointSize(InCheckpointSize)
+{
+
+}
+
+FWriteAheadLog::~FWriteAheadLog()
+{
+	Close();
+}
+
+bool FWriteAheadLog::Open(bool bInReadOnly, bool bDiscard)
+{
+	bReadOnly = bInReadOnly;
+	const bool bExists = FPaths::FileExists(LogName);
+
+	if (bReadOnly)
+	{
+		if (!bExists)
+			return true;
+		LogFile = FGenericPlatformFile::OpenRead(LogName);
+		return LogFile && LogFile->IsValid() && Replay();
+	}
+
+	LogFile = FGenericPlatformFile::OpenWrite(LogName, !bDiscard, true);
+	if (!LogFile || !LogFile->IsValid())
+		return false;
+
+	if (bDiscard || !bExists)
+		return true;
+
+	if (!Replay())
+		return false;
+
+	// bring the database file up to date before anything else is changed
+	return Checkpoint(true);
+}
+
+bool FWriteAheadLog::Close()
+{
+	checkf(Snapshots.Num() == 0, TEXT("Snapshot is not released before closing the log."));
+	if (bReadOnly || (!LogFile && DirtyPages.Num() == 0))
+		return true;
+
+	// the log is kept when the database file can not be written, it is replayed on the next open
+	bool bResult = Commit();
+	bResult &= Checkpoint(true);
+	LogFile.Reset();
+	return bResult;
+}
+
+bool FWriteAheadLog::Commit()
+{
+	if (bReadOnly || DirtyPages.Num() == 0)
+		return true;
+	{
+		// the log could not be reopened by the last checkpoint, nothing was committed since
+		FScopeLock Lock(&LogMutex);
+		if (!LogFile && !ResetLog())
+			return false;
+	}
+
+	TArray<uint8> Buffer;
+	for (auto& Item : DirtyPages)
+	{
+		auto& Dirty = Item.Value;
+		FLogRecord Record = { LOG_MAGIC_NUM, ELogRecordType::PageDelta, Item.Key, Dirty.Begin, Dirty.End - Dirty.Begin, 0 };
+		Buffer.Append((const uint8*)&Record, sizeof(Record));
+		Buffer.Append(Dirty.Data->GetData() + Dirty.Begin, Record.Size);
+	}
+
+	FLogRecord CommitRecord = { LOG_MAGIC_NUM, ELogRecordType::Commit, 0, 0, (uint32)Buffer.Num(), FCrc::MemCrc32(Buffer.GetData(), Buffer.Num()) };
+	Buffer.Append((const uint8*)&CommitRecord, sizeof(CommitRecord));
+
+	uint64 CurrentLogSize;
+	{
+		// a failed write leaves the dirty pages in place, the next commit writes them again
+		FScopeLock Lock(&LogMutex);
+		if (!LogFile->WriteAt(LogSize, Buffer.GetData(), Buffer.Num()) || !LogFile->Flush())
+			return false;
+		LogSize += Buffer.Num();
+		CurrentLogSize = LogSize;
+
+		// published before the log is unlocked, otherwise a checkpoint in between finds nothing to keep and resets the log
+		FScopeLock PageLock(&PageMutex);
+		++LastCommit;
+		for (auto& Item : DirtyPages)
+		{
+			auto& Versions = CommittedPages.FindOrAdd(Item.Key);
+			Versions.Add({LastCommit, Item.Value.Data});
+			PruneVersions(Versions);
+		}
+	}
+	DirtyPages.Reset();
+
+	if (CurrentLogSize >= CheckpointSize * 4)
+	{
+		// the background checkpoint can not keep up, write back before the log gets any longer
+		return Checkpoint(true);
+	}
+	else if (CurrentLogSize >= CheckpointSize)
+	{
+		return Checkpoint(false);
+	}
+	return true;
+}
+
+bool FWriteAheadLog::Checkpoint(bool bWait)
+{
+	if (bReadOnly)
+		return true;
+
+	bool bResult = true;
+	if (CheckpointTask.IsValid())
+	{
+		if (!bWait && !CheckpointTask.IsReady())
+			return true;
+		bResult = CheckpointTask.Get();
+		CheckpointTask = TFuture<bool>();
+	}
+
+	if (bWait)
+	{
+		// a failed earlier checkpoint is retried by this one
+		return RunCheckpoint();
+	}
+
+	CheckpointTask = Async(EAsyncExecution::ThreadPool, [this]() {
+		return RunCheckpoint();
+	});
+	return bResult;
+}
+
+bool FWriteAheadLog::RunCheckpoint()
+{
+	TArray<TPair<uint32, FPageVersion>> Pages;
+	{
+		FScopeLock Lock(&PageMutex);
+		// snapshots read the pages they do not find in the log from the database file,
+		// so nothing newer than the oldest snapshot may land there
+		auto Limit = GetOldestSnapshot();
+		Pages.Reserve(CommittedPages.Num());
+		for (auto& Item : CommittedPages)
+		{
+			const FPageVersion* Newest = nullptr;
+			for (auto& Version : Item.Value)
+			{
+				if (Version.Commit <= Limit)
+					Newest = &Version;
+			}
+			if (Newest)
+				Pages.Emplace(Item.Key, *Newest);
+		}
+	}
+
+	// write back in file order
+	Pages.Sort([](const auto& A, const auto& B) { return A.Key < B.Key; });
+	for (auto& Item : Pages)
+	{
+		if (!BaseFile->WriteAt((uint64)Item.Key * LOG_PAGE_SIZE, Item.Value.Data->GetData(), LOG_PAGE_SIZE))
+			return false;
+	}
+	if (!BaseFile->Flush())
+		return false;
+
+	FScopeLock LogLock(&LogMutex);
+	FScopeLock Lock(&PageMutex);
+	for (auto& Item : Pages)
+	{
+		// keep the versions which have been committed in the meantime
+		auto Versions = CommittedPages.Find(Item.Key);
+		if (!Versions)
+			continue;
+		Versions->RemoveAll([&](const FPageVersion& Version) { return Version.Commit <= Item.Value.Commit; });
+		if (Versions->Num() == 0)
+			CommittedPages.Remove(Item.Key);
+	}
+
+	if (CommittedPages.Num() == 0)
+		return ResetLog();
+	return true;
+}
+
+bool FWriteAheadLog::ResetLog()
+{
+	LogFile.Reset();
+	LogFile = FGenericPlatformFile::OpenWrite(LogName, false, true);
+	LogSize = 0;
+	if (LogFile && LogFile->IsValid())
+		return true;
+	LogFile.Reset();
+	return false;
+}
+
+bool FWriteAheadLog::Replay()
+{
+	struct FDelta
+	{
+		uint32 Page;
+		uint32 Offset;
+		TArray<uint8> Data;
+	};
+
+	TArray<FDelta> Group;
+	uint32 Crc = 0;
+	uint32 GroupSize = 0;
+	uint64 Offset = 0;
+	while (true)
+	{
+		FLogRecord Record;
+		if (!LogFile->ReadAt(Offset, (uint8*)&Record, sizeof(Record)) || Record.MagicNum != LOG_MAGIC_NUM)
+			break;
+		Offset += sizeof(Record);
+
+		if (Record.Type == ELogRecordType::PageDelta)
+		{
+			if (Record.Offset + Record.Size > LOG_PAGE_SIZE)
+				break;
+
+			auto& Delta = Group.AddDefaulted_GetRef();
+			Delta.Page = Record.Page;
+			Delta.Offset = Record.Offset;
+			Delta.Data.SetNumUninitialized(Record.Size);
+			if (!LogFile->ReadAt(Offset, Delta.Data.GetData(), Record.Size))
+				break;
+			Offset += Record.Size;
+
+			Crc = FCrc::MemCrc32(&Record, sizeof(Record), Crc);
+			Crc = FCrc::MemCrc32(Delta.Data.GetData(), Record.Size, Crc);
+			GroupSize += sizeof(Record) + Record.Size;
+		}
+		else if (Record.Type == ELogRecordType::Commit)
+		{
+			// a torn group is the end of the log
+			if (Record.Size != GroupSize || Record.Checksum != Crc)
+				break;
+
+			// nobody reads while replaying, one version per page is enough
+			++LastCommit;
+			for (auto& Delta : Group)
+			{
+				auto& Versions = CommittedPages.FindOrAdd(Delta.Page);
+				if (Versions.Num() == 0)
+					Versions.Add({LastCommit, LoadPage(Delta.Page)});
+				Versions.Last().Commit = LastCommit;
+				FMemory::Memcpy(Versions.Last().Data->GetData() + Delta.Offset, Delta.Data.GetData(), Delta.Data.Num());
+			}
+
+			Group.Reset();
+			Crc = 0;
+			GroupSize = 0;
+			LogSize = Offset;
+		}
+		else
+		{
+			break;
+		}
+	}
+	return true;
+}
+
+FWriteAheadLog::FPageData FWriteAheadLog::LoadPage(uint32 Page)
+{
+	FPageData Data = MakeShared<TArray<uint8>, ESPMode::ThreadSafe>();
+	FPageData Committed;
+	if (FindCommitted(Page, Committed))
+	{
+		*Data = *Committed;
+	}
+	else
+	{
+		Data->SetNumUninitialized(LOG_PAGE_SIZE);
+		// pages behind the end of the database file only exist in the log
+		if (!BaseFile->ReadAt((uint64)Page * LOG_PAGE_SIZE, Data->GetData(), LOG_PAGE_SIZE))
+			FMemory::Memzero(Data->GetData(), LOG_PAGE_SIZE);
+	}
+	return Data;
+}
+
+bool FWriteAheadLog::FindCommitted(uint32 Page, FPageData& Data)
+{
+	FScopeLock Lock(&PageMutex);
+	auto Versions = CommittedPages.Find(Page);
+	if (!Versions || Versions->Num() == 0)
+		return false;
+	Data = Versions->Last().Data;
+	return true;
+}
+
+uint64 FWriteAheadLog::GetOldestSnapshot() const
+{
+	auto Oldest = LastCommit;
+	for (auto Snapshot : Snapshots)
+	{
+		Oldest = FMath::Min(Oldest, Snapshot);
+	}
+	return Oldest;
+}
+
+void FWriteAheadLog::PruneVersions(TArray<FPageVersion>& Versions) const
+{
+	// versions before the newest one every snapshot can see are unreachable
+	auto Oldest = GetOldestSnapshot();
+	int32 Keep = 0;
+	for (int32 Index = 0; Index < Versions.Num(); ++Index)
+	{
+		if (Versions[Index].Commit <= Oldest)
+			Keep = Index;
+	}
+	if (Keep > 0)
+		Versions.RemoveAt(0, Keep, false);
+}
+
+uint64 FWriteAheadLog::AcquireSnapshot()
+{
+	FScopeLock Lock(&PageMutex);
+	Snapshots.Add(LastCommit);
+	return LastCommit;
+}
+
+void FWriteAheadLog::ReleaseSnapshot(uint64 Snapshot)
+{
+	FScopeLock Lock(&PageMutex);
+	Snapshots.RemoveSingleSwap(Snapshot, false);
+}
+
+bool FWriteAheadLog::ReadSnapshot(uint64 Snapshot, uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	while (Size > 0)
+	{
+		auto Page = (uint32)(Offset / LOG_PAGE_SIZE);
+		auto PageOffset = (uint32)(Offset % LOG_PAGE_SIZE);
+		auto Count = FMath::Min(LOG_PAGE_SIZE - PageOffset, Size);
+
+		// a checkpoint only drops a version after writing it to the database file
+		FPageData Version;
+		{
+			FScopeLock Lock(&PageMutex);
+			if (auto Versions = CommittedPages.Find(Page))
+			{
+				for (auto& Item : *Versions)
+				{
+					if (Item.Commit <= Snapshot)
+						Version = Item.Data;
+				}
+			}
+		}
+
+		if (Version)
+		{
+			FMemory::Memcpy(Buffer, Version->GetData() + PageOffset, Count);
+		}
+		else if (!BaseFile->ReadAt(Offset, Buffer, Count))
+		{
+			return false;
+		}
+
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
+	}
+	return true;
+}
+
+bool FWriteAheadLog::Write(const uint8* Buffer, uint32 Size)
+{
+	if (!WriteAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+bool FWriteAheadLog::Read(uint8* Buffer, uint32 Size)
+{
+	if (!ReadAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+uint64 FWriteAheadLog::Tell()
+{
+	return Pos;
+}
+
+bool FWriteAheadLog::Seek(uint64 InPos)
+{
+	Pos = InPos;
+	return true;
+}
+
+bool FWriteAheadLog::IsValid()
+{
+	return BaseFile && BaseFile->IsValid() && (bReadOnly || (LogFile && LogFile->IsValid()));
+}
+
+bool FWriteAheadLog::ReadAt(uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	while (Size > 0)
+	{
+		auto Page = (uint32)(Offset / LOG_PAGE_SIZE);
+		auto PageOffset = (uint32)(Offset % LOG_PAGE_SIZE);
+		auto Count = FMath::Min(LOG_PAGE_SIZE - PageOffset, Size);
+
+		FPageData Committed;
+		if (auto Dirty = DirtyPages.Find(Page))
+		{
+			FMemory::Memcpy(Buffer, Dirty->Data->GetData() + PageOffset, Count);
+		}
+		else if (FindCommitted(Page, Committed))
+		{
+			FMemory::Memcpy(Buffer, Committed->GetData() + PageOffset, Count);
+		}
+		else if (!BaseFile->ReadAt(Offset, Buffer, Count))
+		{
+			return false;
+		}
+
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
+	}
+	return true;
+}
+
+bool FWriteAheadLog::WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size)
+{
+	if (bReadOnly)
+		return false;
+
+	while (Size > 0)
+	{
+		auto Page = (uint32)(Offset / LOG_PAGE_SIZE);
+		auto PageOffset = (uint32)(Offset % LOG_PAGE_SIZE);
+		auto Count = FMath::Min(LOG_PAGE_SIZE - PageOffset, Size);
+
+		auto Dirty = DirtyPages.Find(Page);
+		if (!Dirty)
+		{
+			// committed images are shared with the checkpoint, changes go to a private copy
+			Dirty = &DirtyPages.Add(Page, { LoadPage(Page), PageOffset, PageOffset + Count });
+		}
+		FMemory::Memcpy(Dirty->Data->GetData() + PageOffset, Buffer, Count);
+		Dirty->Begin = FMath::Min(Dirty->Begin, PageOffset);
+		Dirty->End = FMath::Max(Dirty->End, PageOffset + Count);
+
+		Offset += Count;
+		Buffer += Count;
+		Size -= Count;
+	}
+	return true;
+}
+
+bool FWriteAheadLog::Flush()
+{
+	return Commit();
+}
+
+bool FWriteAheadLog::Preallocate(uint64 Offset, uint64 Size)
+{
+	if (bReadOnly)
+		return false;
+	return BaseFile->Preallocate(Offset, Size);
+}
+
+void FWriteAheadLog::Prefetch(uint64 Offset, uint64 Size)
+{
+	// pages changed since the checkpoint are in memory anyway
+	BaseFile->Prefetch(Offset, Size);
+}
+
+
+FLogSnapshotFile::FLogSnapshotFile(FWriteAheadLog* InLog):
+	Log(InLog)
+{
+	Snapshot = Log->AcquireSnapshot();
+}
+
+FLogSnapshotFile::~FLogSnapshotFile()
+{
+	Log->ReleaseSnapshot(Snapshot);
+}
+
+bool FLogSnapshotFile::Read(uint8* Buffer, uint32 Size)
+{
+	if (!ReadAt(Pos, Buffer, Size))
+		return false;
+	Pos += Size;
+	return true;
+}
+
+bool FLogSnapshotFile::ReadAt(uint64 Offset, uint8* Buffer, uint32 Size)
+{
+	return Log->ReadSnapshot(Snapshot, Offset, Buffer, Size);
+}
@@ -0,0 +1,124 @@
+#pragma once 
+
+#include "CoreMinimal.h"
+#include "LowLevelFile.h"
+#include "Async/Future.h"
+
+/*
+	Changes are patched into in-memory page images. A commit appends the changed range of every
+	dirty page to the log and flushes it, then the images become the committed version of the page.
+	Committed pages are written back to the database file by a checkpoint, after which the log is reset.
+	Every commit gets an id, a snapshot keeps reading the page versions of the commit it was taken at,
+	so the checkpoint never writes back a version newer than the oldest snapshot.
+
+	┌──────────────────────────────────────────────────────────────────────────┐
+	│ Delta │ Bytes │ Delta │ Bytes │ ... │ Commit │ Delta │ Bytes │ ... │ Commit │
+	└──────────────────────────────────────────────────────────────────────────┘
+*/
+class FWriteAheadLog : public ILowLevelFile
+{
+public:
+	static const uint32 LOG_PAGE_SIZE = 16 * 1024;
+	using Ptr = TSharedPtr<FWriteAheadLog>;
+public:
+	FWriteAheadLog(ILowLevelFile::Ptr InBaseFile, const FString& InLogName, uint64 InCheckpointSize);
+	~FWriteAheadLog();
+
+	// loads the committed part of an existing log, bDiscard drops it instead
+	bool Open(bool bInReadOnly, bool bDiscard);
+	// commits, then writes everything back to the database file
+	bool Close();
+
+	// appends every change since the last commit to the log and makes it durable
+	bool Commit();
+	// writes the committed pages back to the database file and resets the log once nothing is left.
+	// false when writing failed, the pages stay in the log then. without bWait it reports a failed earlier checkpoint
+	bool Checkpoint(bool bWait);
+
+	// pins the last commit, every snapshot has to be released before the log is closed
+	uint64 AcquireSnapshot();
+	void ReleaseSnapshot(uint64 Snapshot);
+	// reads the database as it was at the commit, safe to call from any thread
+	bool ReadSnapshot(uint64 Snapshot, uint64 Offset, uint8* Buffer, uint32 Size);
+
+	virtual bool Write(const uint8* Buffer, uint32 Size) override;
+	virtual bool Read(uint8* Buffer, uint32 Size) override;
+	virtual uint64 Tell() override;
+	virtual bool Seek(uint64 Pos) override;
+	virtual bool IsValid() override;
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) override;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override;
+	virtual bool Flush() override;
+	// the database file grows directly, the pages only reach the log once they are written
+	virtual bool Preallocate(uint64 Offset, uint64 Size) override;
+	virtual void Prefetch(uint64 Offset, uint64 Size) override;
+
+private:
+	using FPageData = TSharedPtr<TArray<uint8>, ESPMode::ThreadSafe>;
+
+	struct FDirtyPage
+	{
+		FPageData Data;
+		uint32 Begin;
+		uint32 End;
+	};
+
+	struct FPageVersion
+	{
+		uint64 Commit;
+		FPageData Data;
+	};
+
+	FPageData LoadPage(uint32 Page);
+	bool FindCommitted(uint32 Page, FPageData& Data);
+	bool Replay();
+	bool RunCheckpoint();
+	bool ResetLog();
+	uint64 GetOldestSnapshot() const;
+	void PruneVersions(TArray<FPageVersion>& Versions) const;
+
+private:
+	ILowLevelFile::Ptr BaseFile;
+	ILowLevelFile::Ptr LogFile;
+	FString LogName;
+	uint64 CheckpointSize;
+	uint64 LogSize = 0;
+	bool bReadOnly = true;
+	uint64 Pos = 0;
+
+	// pages changed since the last commit, only touched by the writer
+	TMap<uint32, FDirtyPage> DirtyPages;
+	// committed images of the pages which are not written back yet, oldest first
+	TMap<uint32, TArray<FPageVersion>> CommittedPages;
+	uint64 LastCommit = 0;
+	// commits pinned by snapshots, one entry per snapshot
+	TArray<uint64> Snapshots;
+
+	FCriticalSection LogMutex;
+	FCriticalSection PageMutex;
+	TFuture<bool> CheckpointTask;
+};
+
+
+// read-only view of the database at the last commit, for readers on other threads
+class FLogSnapshotFile : public ILowLevelFile
+{
+public:
+	FLogSnapshotFile(FWriteAheadLog* InLog);
+	~FLogSnapshotFile();
+
+	virtual bool Write(const uint8* Buffer, uint32 Size) override { return false; }
+	virtual bool Read(uint8* Buffer, uint32 Size) override;
+	virtual uint64 Tell() override { return Pos; }
+	virtual bool Seek(uint64 InPos) override { Pos = InPos; return true; }
+	virtual bool IsValid() override { return Log != nullptr; }
+	virtual bool ReadAt(uint64 Offset, uint8* Buffer, uint32 Size) override;
+	virtual bool WriteAt(uint64 Offset, const uint8* Buffer, uint32 Size) override { return false; }
+	virtual bool Flush() override { return true; }
+	virtual void Prefetch(uint64 Offset, uint64 Size) override { Log->Prefetch(Offset, Size); }
+
+private:
+	FWriteAheadLog* Log;
+	uint64 Snapshot;
+	uint64 Pos = 0;
+};
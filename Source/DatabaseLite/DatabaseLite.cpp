@@ -1,7 +1,7 @@
 #include "DatabaseLite.h"
 #include "Range.h"
 
-DEFINE_LOG_CATEGORY_STATIC(LogDatabaseLite, Log, All);
+DEFINE_LOG_CATEGORY(LogDatabaseLite);
 
 
 const static FString NAME_STRING = TEXT("Name");
@@ -14,28 +14,91 @@ FDatabaseLite::~FDatabaseLite()
 }
 
 
-bool FDatabaseLite::Open(const FString& FileName, bool bReadOnly, ELowLevelFileType FileType)
+bool FDatabaseLite::Open(const FString& FileName, bool bReadOnly, ELowLevelFileType FileType, const FFileSystemOptions& Options)
 {
 	FileSys = MakeShared<FFileSystem>();
-	if (!FileSys->Init(FileName, bReadOnly, FileType))
+	if (!FileSys->Init(FileName, bReadOnly, FileType, Options))
 	{
 		FileSys.Reset();
 		return false;
 	}
 
-	InitInternalTable();
+	if (!InitInternalTable() || !FileSys->Commit())
+	{
+		Close();
+		return false;
+	}
 
 	return true;
 }
 
-void FDatabaseLite::Close()
+bool FDatabaseLite::Commit()
+{
+	if (!FileSys)
+		return false;
+
+	FlushFilters();
+	return FileSys->Commit();
+}
+
+bool FDatabaseLite::Checkpoint()
+{
+	if (!FileSys)
+		return false;
+
+	FlushFilters();
+	return FileSys->Checkpoint();
+}
+
+void FDatabaseLite::FlushFilters()
+{
+	FFileSystem::FMutationScope Mutation(FileSys.Get());
+	if (InternalTable)
+		InternalTable->FlushFilters();
+	for (auto& Item : Tables)
+	{
+		Item.Value->FlushFilters();
+	}
+}
+
+TSharedPtr<FDatabaseLite> FDatabaseLite::OpenSnapshot()
+{
+	check(FileSys);
+	auto Snapshot = MakeShared<FDatabaseLite>();
+	Snapshot->FileSys = MakeShared<FFileSystem>();
+	if (!Snapshot->FileSys->InitSnapshot(*FileSys))
+	{
+		UE_LOG(LogDatabaseLite, Warning, TEXT("can not open snapshot, a writable database needs the write-ahead log"));
+		return {};
+	}
+
+	if (!Snapshot->InitInternalTable())
+		return {};
+	return Snapshot;
+}
+
+FBufferPool* FDatabaseLite::GetBufferPool()
+{
+	return FileSys ? FileSys->GetBufferPool() : nullptr;
+}
+
+bool FDatabaseLite::Close()
 {
+	if (!FileSys)
+		return true;
+
+	FlushFilters();
+	NameIndex = FDBIndexHandle();
 	InternalTable.Reset();
 	Tables.Reset();
+	const bool bResult = FileSys->Close();
+	if (!bResult)
+		UE_LOG(LogDatabaseLite, Error, TEXT("can not write back the database on close, the changes since the last checkpoint may be lost"));
 	FileSys.Reset();
+	return bResult;
 }
 
-void FDatabaseLite::InitInternalTable()
+bool FDatabaseLite::InitInternalTable()
 {
 	auto Records = FileSys->OpenFile(TABLE_RECORDS_FILE);
 	if (!Records)
@@ -48,26 +111,31 @@ void FDatabaseLite::InitInternalTable()
 	else
 	{
 		InternalTable = MakeShared<FDBTable>(Records);
-		InternalTable->Open();
-
+		if (!InternalTable->Open())
+		{
+			InternalTable.Reset();
+			return false;
+		}
 	}
+	NameIndex = InternalTable->GetIndexHandle(NAME_STRING);
+	return true;
 }
 
 void FDatabaseLite::AddTableRecord(const FString& Name, PageId Id)
 {
-	check(InternalTable->Find(NAME_STRING,Name).Num() == 0);
-	CHECK_RESULT(InternalTable->AddRow({{NAME_STRING, Name}}, Id, true));
+	check(InternalTable->Find(NameIndex, TDBKey<FString>(Name)).Num() == 0);
+	CHECK_RESULT(InternalTable->AddRow(NameIndex, TDBKey<FString>(Name), Id, true));
 }
 
 void FDatabaseLite::RemoveTableRecord(const FString& Name)
 {
-	InternalTable->RemoveRow(NAME_STRING, Name);
+	InternalTable->RemoveRow(NameIndex, Name);
 
 }
 PageId FDatabaseLite::GetTableFile(const FString& Name)
 {
 	PageId Id = PAGE_ID_INVALID;
-	InternalTable->FindOne(NAME_STRING, Name, Id);
+	InternalTable->FindOne(NameIndex, TDBKey<FString>(Name), Id);
 	return Id;
 }
 
@@ -81,15 +149,16 @@ FDBTable* FDatabaseLite::GetTable(const FString& TableName)
 		return OpenTable(TableName);
 }
 
-FDBTable* FDatabaseLite::CreateTable(const FString& TableName, const TMap<FString, FKeyTypeSequence> & IndexKeyTypes)
+FDBTable* FDatabaseLite::CreateTable(const FString& TableName, const TMap<FString, FKeyTypeSequence> & IndexKeyTypes, const TMap<FString, EIndexType>& IndexTypes)
 {
 	check(!IsTableExists(TableName));
+	FFileSystem::FMutationScope Mutation(FileSys.Get());
 
 	auto TableFile = FileSys->NewFile();
 	AddTableRecord(TableName, TableFile->GetId());
 
 	auto Table = MakeShared<FDBTable>(TableFile);
-	Table->Init(IndexKeyTypes);
+	Table->Init(IndexKeyTypes, IndexTypes);
 
 	Tables.Add(TableName, Table);
 	return GetTable(TableName);
@@ -107,7 +176,11 @@ FDBTable* FDatabaseLite::OpenTable(const FString& TableName)
 	check(Tables.Find(TableName) == nullptr);
 
 	auto Table = MakeShared<FDBTable>(FileSys->OpenFile(Id));
-	Table->Open();
+	if (!Table->Open())
+	{
+		UE_LOG(LogDatabaseLite, Warning, TEXT("can not open table %s"), *TableName);
+		return nullptr;
+	}
 	Tables.Add(TableName, Table);
 	return GetTable(TableName);
 }
@@ -116,6 +189,7 @@ void FDatabaseLite::DeleteTable(const FString& TableName)
 {
 	if (!IsTableExists(TableName))
 		return;
+	FFileSystem::FMutationScope Mutation(FileSys.Get());
 	auto Table = GetTable(TableName);
 	Table->Delete();
 	Tables.Remove(TableName);
@@ -127,7 +201,7 @@ bool FDatabaseLite::IsTableExists(const FString& TableName)const
 	if (Tables.Find(TableName))
 		return true;
 	PageId Id;
-	return InternalTable->FindOne(NAME_STRING,TableName, Id) ;
+	return InternalTable->FindOne(NameIndex, TDBKey<FString>(TableName), Id);
 }
 
 FDBTable::RowArray FDatabaseLite::Query(const FString& TableName, const FString& KeyName, const FKeySequence& Keys) 
@@ -147,3 +221,39 @@ FDBTable::RowArray FDatabaseLite::GetRows(const FString& TableName)
 
 	return Table->GetRows();
 }
+
+FDBTableCursor FDatabaseLite::GetRowCursor(const FString& TableName, int32 BatchRows)
+{
+	return FDBTableCursor(GetTable(TableName), BatchRows);
+}
+
+FDBTableHandle FDatabaseLite::GetTableHandle(const FString& TableName)
+{
+	// the table is opened first if it is not yet
+	if (!GetTable(TableName))
+		return {};
+	return FDBTableHandle(Tables.FindRef(TableName));
+}
+
+FDBTable::RowArray FDatabaseLite::Query(const FDBTableHandle& Table, const FDBIndexHandle& Index, const FKeySequence& Keys)
+{
+	auto Pinned = Table.Get();
+	if (!Pinned)
+		return {};
+
+	return Pinned->Find(Index, Keys);
+}
+
+FDBTable::RowArray FDatabaseLite::GetRows(const FDBTableHandle& Table)
+{
+	auto Pinned = Table.Get();
+	if (!Pinned)
+		return {};
+
+	return Pinned->GetRows();
+}
+
+FDBTableCursor FDatabaseLite::GetRowCursor(const FDBTableHandle& Table, int32 BatchRows)
+{
+	return FDBTableCursor(Table.Get().Get(), BatchRows);
+}
@@ -5,23 +5,80 @@
 #include "Core/Index.h"
 #include "Core/File.h"
 
+// a table resolved once by its name, it turns invalid when the table is deleted or the database is closed
+class FDBTableHandle
+{
+public:
+	FDBTableHandle() = default;
+	bool IsValid() const { return Table.IsValid(); }
+	// null once the table is gone, keep the result only as long as the table is used
+	TSharedPtr<FDBTable> Get() const { return Table.Pin(); }
+	// invalid when the table or the index does not exist
+	FDBIndexHandle GetIndex(const FString& KeyName) const
+	{
+		auto Pinned = Table.Pin();
+		return Pinned ? Pinned->GetIndexHandle(KeyName) : FDBIndexHandle();
+	}
+
+private:
+	friend class FDatabaseLite;
+	explicit FDBTableHandle(const TSharedPtr<FDBTable>& InTable) : Table(InTable) {}
+
+	TWeakPtr<FDBTable> Table;
+};
+
 class DATABASELITE_API FDatabaseLite
 {
 public:
 	~FDatabaseLite();
-	bool Open(const FString& FileName, bool bReadOnly = true, ELowLevelFileType FileType = ELowLevelFileType::Cached);
-	void Close();
+	// databases of an earlier version of the format are not upgraded, Open fails for them and logs it.
+	// they have to be written again from their source data
+	bool Open(const FString& FileName, bool bReadOnly = true, ELowLevelFileType FileType = ELowLevelFileType::Cached, const FFileSystemOptions& Options = {});
+	// false when the changes could not be written back
+	bool Close();
+	// make every change so far durable, with a write-ahead log this ends the current commit group.
+	// false when the changes could not be written
+	bool Commit();
+	// commit and write everything back to the database file, a ELowLevelFileType::Loaded database does this
+	// on Close as well. false when the file could not be written
+	bool Checkpoint();
+	// read-only copy of the last commit for another thread, writers keep going without waiting for it,
+	// a writable database needs bWriteAheadLog. release it before closing this database
+	TSharedPtr<FDatabaseLite> OpenSnapshot();
+	// cache of a ELowLevelFileType::Cached database, for its hit counters and capacity
+	class FBufferPool* GetBufferPool();
 	FDBTable* GetTable(const FString& TableName) ;
-	FDBTable* CreateTable(const FString& TableName, const TMap<FString, FKeyTypeSequence> &IndexKeyTypes);
+	// indices missing from IndexTypes are B-trees, EIndexType::Hash suits indices only searched by exact keys
+	FDBTable* CreateTable(const FString& TableName, const TMap<FString, FKeyTypeSequence> &IndexKeyTypes, const TMap<FString, EIndexType>& IndexTypes = {});
 	void DeleteTable(const FString& TableName);
 	bool IsTableExists(const FString& TableName)const;
 
+	// invalid when the table does not exist
+	FDBTableHandle GetTableHandle(const FString& TableName);
+
 	FDBTable::RowArray Query(const FString& TableName, const FString& KeyName, const FKeySequence& Keys);
 	FDBTable::RowArray GetRows(const FString& TableName);
+	// rows of the table in batches, empty when the table does not exist
+	FDBTableCursor GetRowCursor(const FString& TableName, int32 BatchRows = 256);
+
+	// same queries with handles, no lookup by name
+	FDBTable::RowArray Query(const FDBTableHandle& Table, const FDBIndexHandle& Index, const FKeySequence& Keys);
+	FDBTable::RowArray GetRows(const FDBTableHandle& Table);
+	FDBTableCursor GetRowCursor(const FDBTableHandle& Table, int32 BatchRows = 256);
+
+	template<class... Ts>
+	FDBTable::RowArray Query(const FDBTableHandle& Table, const FDBIndexHandle& Index, const TDBKey<Ts...>& Key)
+	{
+		auto Pinned = Table.Get();
+		if (!Pinned)
+			return {};
+		return Pinned->Find(Index, Key);
+	}
 
 private:
 	FDBTable* OpenTable(const FString& TableName);
-	void InitInternalTable();
+	bool InitInternalTable();
+	void FlushFilters();
 	void AddTableRecord(const FString& Name, PageId Record);
 	void RemoveTableRecord(const FString& Name);
 	PageId GetTableFile(const FString& Name);
@@ -30,4 +87,5 @@ private:
 	TMap<FString, TSharedPtr<FDBTable>> Tables;
 
 	TSharedPtr<FDBTable> InternalTable;
+	FDBIndexHandle NameIndex;
 };
\ No newline at end of file
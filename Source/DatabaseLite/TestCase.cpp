@@ -1,7 +1,27 @@
 #include "DatabaseLite.h"
+#include "Core/KeyBTree.h"
+#include "Algo/Reverse.h"
+#include "Async/Async.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFilemanager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/ScopeLock.h"
 
 #include <chrono>
 
+// the whole file while it is still open for writing
+static TArray<uint8> ReadOpenFile(const FString& FileName)
+{
+	TArray<uint8> Bytes;
+	TUniquePtr<IFileHandle> Handle(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*FileName, true));
+	if (Handle)
+	{
+		Bytes.SetNumUninitialized(Handle->Size());
+		CHECK_RESULT(Handle->Read(Bytes.GetData(), Bytes.Num()));
+	}
+	return Bytes;
+}
+
 auto Test = [](){
 	{
 		
@@ -51,6 +71,698 @@ auto Test = [](){
 	return 0;
 };
 
+// the same table loaded bottom-up, queried through an index handle with boxed and with typed keys
+auto TestBulkInsert = [](){
+	constexpr int64 NumRows = 1024 * 1024;
+	FDatabaseLite DB;
+	CHECK_RESULT(DB.Open(FPaths::ProjectSavedDir() + TEXT("TestBulk.db"), false, ELowLevelFileType::Memory));
+	auto Table = DB.CreateTable(TEXT("TestTable"), { {TEXT("id"), FKeyTypeSequence{EKeyType::Integer}} });
+	{
+		TArray<FDBTable::FBulkRow> Rows;
+		Rows.SetNum(NumRows);
+		for (int64 i = 0; i < NumRows; ++i)
+		{
+			auto& Row = Rows[i];
+			Row.Keys.Add(TEXT("id"), FKeySequence(i));
+			Row.Data.Append((const uint8*)&i, sizeof(i));
+		}
+		CHECK_RESULT(Table->BulkInsert(Rows, true));
+	}
+
+	auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+	for (int64 i = 0; i < NumRows; i += 7)
+	{
+		int64 Value = -1;
+		CHECK_RESULT(Table->FindOne(IdIndex, TDBKey<int64>(i), Value));
+		check(Value == i);
+		Value = -1;
+		CHECK_RESULT(Table->FindOne(IdIndex, FKeySequence(i), Value));
+		check(Value == i);
+	}
+	int64 Value;
+	const bool bFound = Table->FindOne(IdIndex, TDBKey<int64>(NumRows), Value);
+	check(!bFound);
+
+	// rows added one by one go into the bulk loaded trees
+	CHECK_RESULT(Table->AddRow(IdIndex, TDBKey<int64>(NumRows), NumRows, true));
+	CHECK_RESULT(Table->FindOne(IdIndex, TDBKey<int64>(NumRows), Value));
+	check(Value == NumRows);
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite bulk insert suc."));
+	return 0;
+};
+
+// a crash in the middle of writing a commit group, the groups before it are replayed and the torn one is dropped
+auto TestLogTornTail = [](){
+	const FString FileName = FPaths::ProjectSavedDir() + TEXT("TestLog.db");
+	const FString LogName = FileName + TEXT(".wal");
+	IFileManager::Get().Delete(*FileName);
+	IFileManager::Get().Delete(*LogName);
+
+	FFileSystemOptions Options;
+	Options.bWriteAheadLog = true;
+	TArray<uint8> FileBytes;
+	TArray<uint8> LogBytes;
+	{
+		FDatabaseLite DB;
+		CHECK_RESULT(DB.Open(FileName, false, ELowLevelFileType::Cached, Options));
+		auto Table = DB.CreateTable(TEXT("TestTable"), { {TEXT("id"), FKeyTypeSequence{EKeyType::Integer}} });
+		auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+		for (int64 i = 0; i < 100; ++i)
+		{
+			CHECK_RESULT(Table->AddRow(IdIndex, TDBKey<int64>(i), i, true));
+		}
+		CHECK_RESULT(DB.Commit());
+		for (int64 i = 100; i < 200; ++i)
+		{
+			CHECK_RESULT(Table->AddRow(IdIndex, TDBKey<int64>(i), i, true));
+		}
+		CHECK_RESULT(DB.Commit());
+
+		// the database file is only written by checkpoints, this is what a crash leaves behind
+		FileBytes = ReadOpenFile(FileName);
+		LogBytes = ReadOpenFile(LogName);
+	}
+
+	// cut the commit record of the last group
+	check(LogBytes.Num() > 8);
+	LogBytes.SetNum(LogBytes.Num() - 8);
+	CHECK_RESULT(FFileHelper::SaveArrayToFile(FileBytes, *FileName));
+	CHECK_RESULT(FFileHelper::SaveArrayToFile(LogBytes, *LogName));
+
+	{
+		FDatabaseLite DB;
+		CHECK_RESULT(DB.Open(FileName, false, ELowLevelFileType::Cached, Options));
+		auto Table = DB.GetTable(TEXT("TestTable"));
+		check(Table);
+		auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+		for (int64 i = 0; i < 200; ++i)
+		{
+			int64 Value = -1;
+			const bool bFound = Table->FindOne(IdIndex, TDBKey<int64>(i), Value);
+			check(bFound == (i < 100) && (!bFound || Value == i));
+		}
+
+		// the log goes on behind the replayed groups
+		CHECK_RESULT(Table->AddRow(IdIndex, TDBKey<int64>(100), (int64)100, true));
+		CHECK_RESULT(DB.Commit());
+		CHECK_RESULT(DB.Close());
+	}
+	{
+		FDatabaseLite DB;
+		CHECK_RESULT(DB.Open(FileName, true, ELowLevelFileType::Cached, Options));
+		int64 Value = -1;
+		CHECK_RESULT(DB.GetTable(TEXT("TestTable"))->FindOne(TEXT("id"), TDBKey<int64>(100), Value));
+		check(Value == 100);
+	}
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite log torn tail suc."));
+	return 0;
+};
+
+// a snapshot read on another thread keeps seeing its commit while the writer commits over it
+auto TestSnapshotIsolation = [](){
+	const FString FileName = FPaths::ProjectSavedDir() + TEXT("TestSnapshot.db");
+	IFileManager::Get().Delete(*FileName);
+	IFileManager::Get().Delete(*(FileName + TEXT(".wal")));
+
+	constexpr int64 NumRows = 1000;
+	FFileSystemOptions Options;
+	Options.bWriteAheadLog = true;
+	FDatabaseLite DB;
+	CHECK_RESULT(DB.Open(FileName, false, ELowLevelFileType::Cached, Options));
+	auto Table = DB.CreateTable(TEXT("TestTable"), { {TEXT("id"), FKeyTypeSequence{EKeyType::Integer}} });
+	auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		CHECK_RESULT(Table->AddRow(IdIndex, TDBKey<int64>(i), i, true));
+	}
+	CHECK_RESULT(DB.Commit());
+
+	auto Snapshot = DB.OpenSnapshot();
+	check(Snapshot);
+	auto SnapshotTable = Snapshot->GetTable(TEXT("TestTable"));
+	check(SnapshotTable);
+	auto Reader = Async(EAsyncExecution::Thread, [SnapshotTable, NumRows]()
+		{
+			auto Index = SnapshotTable->GetIndexHandle(TEXT("id"));
+			for (int32 Round = 0; Round < 20; ++Round)
+			{
+				for (int64 i = 0; i < NumRows * 2; ++i)
+				{
+					int64 Value = -1;
+					const bool bFound = SnapshotTable->FindOne(Index, TDBKey<int64>(i), Value);
+					if (bFound != (i < NumRows) || (bFound && Value != i))
+						return false;
+				}
+			}
+			return true;
+		});
+
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		CHECK_RESULT(Table->UpdateRow(IdIndex, FKeySequence(i), i + NumRows));
+		CHECK_RESULT(Table->AddRow(IdIndex, TDBKey<int64>(i + NumRows), i, true));
+		if (i % 100 == 0)
+			CHECK_RESULT(DB.Commit());
+	}
+	CHECK_RESULT(DB.Commit());
+	check(Reader.Get());
+	Snapshot.Reset();
+
+	// a new snapshot sees the last commit
+	Snapshot = DB.OpenSnapshot();
+	check(Snapshot);
+	SnapshotTable = Snapshot->GetTable(TEXT("TestTable"));
+	for (int64 i = 0; i < NumRows * 2; ++i)
+	{
+		int64 Value = -1;
+		CHECK_RESULT(SnapshotTable->FindOne(TEXT("id"), TDBKey<int64>(i), Value));
+		check(Value == (i < NumRows ? i + NumRows : i - NumRows));
+	}
+	Snapshot.Reset();
+	CHECK_RESULT(DB.Close());
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite snapshot isolation suc."));
+	return 0;
+};
+
+// removing the front half of the rows leaves free blocks which vacuum moves the rows at the end into
+auto TestVacuum = [](){
+	constexpr int64 NumRows = 3000;
+	auto MakeRow = [](int64 Id)
+	{
+		static const int32 Sizes[] = { 40, 300, 5000 };
+		TArray<uint8> Data;
+		Data.SetNumUninitialized(Sizes[Id % 3] + Id % 7);
+		for (int32 Index = 0; Index < Data.Num(); ++Index)
+		{
+			Data[Index] = (uint8)(Id * 31 + Index);
+		}
+		return Data;
+	};
+
+	FDatabaseLite DB;
+	CHECK_RESULT(DB.Open(FPaths::ProjectSavedDir() + TEXT("TestVacuum.db"), false, ELowLevelFileType::Memory));
+	auto Table = DB.CreateTable(TEXT("TestTable"), { {TEXT("id"), FKeyTypeSequence{EKeyType::Integer}} });
+	auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		auto Data = MakeRow(i);
+		CHECK_RESULT(Table->AddRow(IdIndex, FKeySequence(i), Data.GetData(), Data.Num(), true));
+	}
+	for (int64 i = 0; i < NumRows / 2; ++i)
+	{
+		CHECK_RESULT(Table->RemoveRow(IdIndex, FKeySequence(i)));
+	}
+
+	// removed rows leave free blocks, only vacuum gives them back
+	const uint64 FullSize = Table->GetDataSize();
+	int32 Passes = 0;
+	while (!Table->Vacuum(100))
+	{
+		++Passes;
+		check(Table->GetDataSize() < FullSize);
+	}
+	check(Passes > 0);
+	const uint64 VacuumedSize = Table->GetDataSize();
+	check(VacuumedSize < FullSize);
+
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		FDBTable::FRowView View;
+		const bool bFound = Table->FindOne(IdIndex, TDBKey<int64>(i), View);
+		check(bFound == (i >= NumRows / 2));
+		if (bFound)
+		{
+			auto Data = MakeRow(i);
+			check(View.Num() == Data.Num() && FMemory::Memcmp(View.GetData(), Data.GetData(), Data.Num()) == 0);
+		}
+	}
+
+	// the blocks behind the moved rows were given back, new rows go to the end again
+	check(Table->GetDataSize() == VacuumedSize);
+	for (int64 i = NumRows / 2 - 1; i >= 0; --i)
+	{
+		auto Data = MakeRow(i);
+		CHECK_RESULT(Table->AddRow(IdIndex, FKeySequence(i), Data.GetData(), Data.Num(), true));
+	}
+	check(Table->GetDataSize() > VacuumedSize);
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		FDBTable::FRowView View;
+		CHECK_RESULT(Table->FindOne(IdIndex, TDBKey<int64>(i), View));
+		auto Data = MakeRow(i);
+		check(View.Num() == Data.Num() && FMemory::Memcmp(View.GetData(), Data.GetData(), Data.Num()) == 0);
+	}
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite vacuum suc."));
+	return 0;
+};
+
+// every key leaves the B-trees through borrows and merges until they are empty, then the same keys go in again.
+// the group index has many rows under one key, which exercises the data chains
+auto TestRemoveAll = [](){
+	constexpr int64 NumRows = 20000;
+	constexpr int64 NumGroups = 16;
+
+	FDatabaseLite DB;
+	CHECK_RESULT(DB.Open(FPaths::ProjectSavedDir() + TEXT("TestRemove.db"), false, ELowLevelFileType::Memory));
+	auto Table = DB.CreateTable(TEXT("TestTable"), {
+		{TEXT("id"), FKeyTypeSequence{EKeyType::Integer}},
+		{TEXT("group"), FKeyTypeSequence{EKeyType::Integer}} });
+	auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+	auto GroupIndex = Table->GetIndexHandle(TEXT("group"));
+	auto AddRows = [&]()
+	{
+		for (int64 i = 0; i < NumRows; ++i)
+		{
+			TMap<FString, FKeySequence> Keys;
+			Keys.Add(TEXT("id"), FKeySequence(i));
+			Keys.Add(TEXT("group"), FKeySequence(i % NumGroups));
+			CHECK_RESULT(Table->AddRow(Keys, i, false));
+		}
+	};
+	AddRows();
+
+	for (int64 i = 0; i < NumRows; i += 2)
+	{
+		CHECK_RESULT(Table->RemoveRow(IdIndex, FKeySequence(i)));
+	}
+	for (int64 Group = 0; Group < NumGroups; ++Group)
+	{
+		check(Table->Find(GroupIndex, FKeySequence(Group)).Num() == (Group % 2 ? NumRows / NumGroups : 0));
+	}
+	for (int64 i = NumRows - 1; i > 0; i -= 2)
+	{
+		CHECK_RESULT(Table->RemoveRow(IdIndex, FKeySequence(i)));
+	}
+	check(Table->GetRows().Num() == 0);
+	for (int64 i = 0; i < NumRows; i += 97)
+	{
+		check(Table->Find(IdIndex, FKeySequence(i)).Num() == 0);
+		check(!Table->RemoveRow(IdIndex, FKeySequence(i)));
+	}
+
+	AddRows();
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		int64 Value = -1;
+		CHECK_RESULT(Table->FindOne(IdIndex, TDBKey<int64>(i), Value));
+		check(Value == i);
+	}
+	for (int64 Group = 0; Group < NumGroups; ++Group)
+	{
+		check(Table->Find(GroupIndex, FKeySequence(Group)).Num() == NumRows / NumGroups);
+	}
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite remove all suc."));
+	return 0;
+};
+
+// the hash indices grow one bucket split at a time, the group index has many rows under one key and so
+// long overflow chains, which are freed again when the rows are removed. a bulk loaded index starts in the middle
+// of a level and keeps splitting when rows are added one by one
+auto TestHashIndex = [](){
+	constexpr int64 NumRows = 20000;
+	constexpr int64 NumGroups = 4;
+	const TMap<FString, FKeyTypeSequence> KeyTypes = {
+		{TEXT("id"), FKeyTypeSequence{EKeyType::Integer}},
+		{TEXT("group"), FKeyTypeSequence{EKeyType::Integer}} };
+	const TMap<FString, EIndexType> IndexTypes = { {TEXT("id"), EIndexType::Hash}, {TEXT("group"), EIndexType::Hash} };
+	auto MakeKeys = [](int64 i)
+	{
+		TMap<FString, FKeySequence> Keys;
+		Keys.Add(TEXT("id"), FKeySequence(i));
+		Keys.Add(TEXT("group"), FKeySequence(i % NumGroups));
+		return Keys;
+	};
+	auto CheckRows = [&](FDBTable* Table, int64 End, TFunctionRef<bool(int64)> IsPresent)
+	{
+		auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+		auto GroupIndex = Table->GetIndexHandle(TEXT("group"));
+		TArray<int32> GroupCounts;
+		GroupCounts.SetNumZeroed(NumGroups);
+		for (int64 i = 0; i < End; ++i)
+		{
+			int64 Value = -1;
+			const bool bFound = Table->FindOne(IdIndex, TDBKey<int64>(i), Value);
+			check(bFound == IsPresent(i) && (!bFound || Value == i));
+			GroupCounts[(int32)(i % NumGroups)] += bFound ? 1 : 0;
+		}
+		for (int64 Group = 0; Group < NumGroups; ++Group)
+		{
+			check(Table->Find(GroupIndex, FKeySequence(Group)).Num() == GroupCounts[Group]);
+		}
+	};
+
+	FDatabaseLite DB;
+	CHECK_RESULT(DB.Open(FPaths::ProjectSavedDir() + TEXT("TestHash.db"), false, ELowLevelFileType::Memory));
+	auto Table = DB.CreateTable(TEXT("TestTable"), KeyTypes, IndexTypes);
+	auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		CHECK_RESULT(Table->AddRow(MakeKeys(i), i, false));
+	}
+	CheckRows(Table, NumRows, [](int64 i) { return true; });
+
+	for (int64 i = 0; i < NumRows; i += 2)
+	{
+		CHECK_RESULT(Table->RemoveRow(IdIndex, FKeySequence(i)));
+	}
+	CheckRows(Table, NumRows, [](int64 i) { return i % 2 == 1; });
+	for (int64 i = 1; i < NumRows; i += 2)
+	{
+		CHECK_RESULT(Table->RemoveRow(IdIndex, FKeySequence(i)));
+		check(!Table->RemoveRow(IdIndex, FKeySequence(i)));
+	}
+	CheckRows(Table, NumRows, [](int64 i) { return false; });
+
+	// the emptied overflow pages were freed and are taken again
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		CHECK_RESULT(Table->AddRow(MakeKeys(i), i, false));
+	}
+	CheckRows(Table, NumRows, [](int64 i) { return true; });
+
+	// half full buckets, not a power of two of them
+	auto BulkTable = DB.CreateTable(TEXT("BulkTable"), KeyTypes, IndexTypes);
+	{
+		TArray<FDBTable::FBulkRow> Rows;
+		Rows.SetNum(NumRows);
+		for (int64 i = 0; i < NumRows; ++i)
+		{
+			Rows[i].Keys = MakeKeys(i);
+			Rows[i].Data.Append((const uint8*)&i, sizeof(i));
+		}
+		CHECK_RESULT(BulkTable->BulkInsert(Rows, false, 0.5f));
+	}
+	CheckRows(BulkTable, NumRows, [](int64 i) { return true; });
+	for (int64 i = NumRows; i < NumRows * 2; ++i)
+	{
+		CHECK_RESULT(BulkTable->AddRow(MakeKeys(i), i, false));
+	}
+	CheckRows(BulkTable, NumRows * 2, [](int64 i) { return true; });
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite hash index suc."));
+	return 0;
+};
+
+// composite keys go into the ordered key tree. a player id alone is a prefix which finds the rows of the player
+// in timestamp order both ways, with the timestamp it bounds the range. names of different lengths make the
+// nodes split at different counts of keys
+auto TestOrderedIndex = [](){
+	constexpr int64 NumPlayers = 64;
+	constexpr int64 NumRows = NumPlayers * 200;
+	// row i is the (i / NumPlayers)th score of player i % NumPlayers, its timestamp grows with i
+	auto GetPlayer = [](int64 i) { return i % NumPlayers; };
+	auto GetTime = [](int64 i) { return (i / NumPlayers) * 10; };
+	auto GetName = [](int64 Player) { return FString::Printf(TEXT("player%s%lld"), *FString::ChrN((int32)(Player % 30), 'x'), Player); };
+
+	FDatabaseLite DB;
+	CHECK_RESULT(DB.Open(FPaths::ProjectSavedDir() + TEXT("TestOrdered.db"), false, ELowLevelFileType::Memory));
+	auto Table = DB.CreateTable(TEXT("TestTable"), {
+		{TEXT("score"), FKeyTypeSequence{EKeyType::Integer, EKeyType::Integer}},
+		{TEXT("name"), FKeyTypeSequence{EKeyType::String, EKeyType::Integer}} });
+	auto ScoreIndex = Table->GetIndexHandle(TEXT("score"));
+	auto NameIndex = Table->GetIndexHandle(TEXT("name"));
+	auto MakeKey = [](FKeySequence Key, int64 Time)
+	{
+		Key.Add(Time);
+		return Key;
+	};
+	// out of order, so that entries go into the middle of the leaves
+	for (int64 Step = 0; Step < NumRows; ++Step)
+	{
+		const int64 i = Step * 7919 % NumRows;
+		TMap<FString, FKeySequence> Keys;
+		Keys.Add(TEXT("score"), MakeKey(FKeySequence(GetPlayer(i)), GetTime(i)));
+		Keys.Add(TEXT("name"), MakeKey(FKeySequence(GetName(GetPlayer(i))), GetTime(i)));
+		CHECK_RESULT(Table->AddRow(Keys, i, true));
+	}
+
+	// the rows a cursor visits, each must follow the one before in the direction of the cursor
+	auto Collect = [](FDBTable::FRangeCursor Cursor, bool bAscending)
+	{
+		TArray<int64> Rows;
+		for (; Cursor.IsValid(); Cursor.Next())
+		{
+			FDBTable::RowData Data;
+			CHECK_RESULT(Cursor.GetRowData(Data));
+			int64 Value;
+			FMemory::Memcpy(&Value, Data.GetData(), sizeof(Value));
+			check(Rows.Num() == 0 || (bAscending ? Rows.Last() < Value : Rows.Last() > Value));
+			Rows.Add(Value);
+		}
+		return Rows;
+	};
+	auto CheckPlayer = [&](int64 Player, TFunctionRef<bool(int64)> Removed)
+	{
+		TArray<int64> Expected;
+		for (int64 i = Player; i < NumRows; i += NumPlayers)
+		{
+			if (!Removed(i))
+				Expected.Add(i);
+		}
+		for (const bool bAscending : { true, false })
+		{
+			auto ByScore = Collect(Table->FindRange(ScoreIndex, FKeySequence(Player), FKeySequence(Player), bAscending), bAscending);
+			auto ByName = Collect(Table->FindRange(NameIndex, FKeySequence(GetName(Player)), FKeySequence(GetName(Player)), bAscending), bAscending);
+			if (!bAscending)
+			{
+				Algo::Reverse(ByScore);
+				Algo::Reverse(ByName);
+			}
+			check(ByScore == Expected && ByName == Expected);
+		}
+
+		// both bounds are inclusive
+		const int64 Lo = GetTime(NumRows / 4);
+		const int64 Hi = GetTime(NumRows / 2);
+		auto Bounded = Collect(Table->FindRange(ScoreIndex, MakeKey(FKeySequence(Player), Lo), MakeKey(FKeySequence(Player), Hi), true), true);
+		check(Bounded.Num() == Expected.FilterByPredicate([&](int64 i) { return GetTime(i) >= Lo && GetTime(i) <= Hi; }).Num());
+		for (auto i : Bounded)
+		{
+			check(GetPlayer(i) == Player && GetTime(i) >= Lo && GetTime(i) <= Hi);
+		}
+	};
+	for (int64 Player = 0; Player < NumPlayers; ++Player)
+	{
+		CheckPlayer(Player, [](int64 i) { return false; });
+	}
+
+	// the older half of the rows of every other player, and then every row of one player
+	auto IsRemovedLater = [&](int64 i) { return (GetPlayer(i) % 2 == 0 && i < NumRows / 2) || GetPlayer(i) == 5; };
+	for (int64 i = 0; i < NumRows; ++i)
+	{
+		if (IsRemovedLater(i))
+		{
+			CHECK_RESULT(Table->RemoveRow(ScoreIndex, MakeKey(FKeySequence(GetPlayer(i)), GetTime(i))));
+		}
+	}
+	for (int64 Player = 0; Player < NumPlayers; ++Player)
+	{
+		CheckPlayer(Player, IsRemovedLater);
+	}
+	check(!Table->FindRange(ScoreIndex, FKeySequence((int64)5), FKeySequence((int64)5)).IsValid());
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite ordered index suc."));
+	return 0;
+};
+
+// pages of a deleted file go back to the bitmap and are taken again, so the same work repeated never grows the database
+auto TestPageReuse = [](){
+	TArray<uint8> Data;
+	Data.SetNumUninitialized(FILE_PAGE_SIZE * 64);
+	for (int32 Index = 0; Index < Data.Num(); ++Index)
+	{
+		Data[Index] = (uint8)(Index * 7);
+	}
+
+	FFileSystem FileSys;
+	CHECK_RESULT(FileSys.Init(FPaths::ProjectSavedDir() + TEXT("TestPages.db"), false, ELowLevelFileType::Memory));
+	PageId FirstId = PAGE_ID_INVALID;
+	PageId ProbeId = PAGE_ID_INVALID;
+	for (int32 Round = 0; Round < 8; ++Round)
+	{
+		FFileSystem::FMutationScope Mutation(&FileSys);
+		auto File = FileSys.NewFile();
+		CHECK_RESULT(File->Write(Data.GetData(), Data.Num()));
+		// the first page behind the file, it only stays put when the recycled pages are used again
+		auto Probe = FileSys.NewFile();
+
+		TArray<uint8> Read;
+		Read.SetNumUninitialized(Data.Num());
+		CHECK_RESULT(File->ReadAt(0, Read.GetData(), Read.Num()));
+		check(Read == Data);
+
+		check(Round == 0 || (File->GetId() == FirstId && Probe->GetId() == ProbeId));
+		FirstId = File->GetId();
+		ProbeId = Probe->GetId();
+		File->Delete();
+		Probe->Delete();
+	}
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite page reuse suc."));
+	return 0;
+};
+
+// a FCachedFile holds fewer pages than are written, the evicted dirty pages and the ones left at Flush reach the file
+auto TestCachedFile = [](){
+	const FString FileName = FPaths::ProjectSavedDir() + TEXT("TestCached.bin");
+	constexpr uint32 PageSize = 16 * 1024;
+	constexpr uint32 NumPages = 300;
+	TArray<uint8> Data;
+	Data.SetNumUninitialized(PageSize * NumPages + 100);
+	for (int32 Index = 0; Index < Data.Num(); ++Index)
+	{
+		Data[Index] = (uint8)(Index * 13 + Index / PageSize);
+	}
+
+	TArray<uint8> Read;
+	Read.SetNumUninitialized(Data.Num());
+	{
+		auto File = FCachedFile::OpenWrite(FileName, false, true);
+		check(File && File->IsValid());
+		// every other page first, then the ones between, so that pages are evicted while their neighbours are dirty
+		for (uint32 Pass = 0; Pass < 2; ++Pass)
+		{
+			for (uint32 Page = Pass; Page * PageSize < (uint32)Data.Num(); Page += 2)
+			{
+				const uint32 Offset = Page * PageSize;
+				CHECK_RESULT(File->WriteAt(Offset, Data.GetData() + Offset, FMath::Min<uint32>(PageSize, Data.Num() - Offset)));
+			}
+		}
+		CHECK_RESULT(File->ReadAt(0, Read.GetData(), Read.Num()));
+		check(Read == Data);
+		CHECK_RESULT(File->Flush());
+	}
+
+	TArray<uint8> OnDisk;
+	CHECK_RESULT(FFileHelper::LoadFileToArray(OnDisk, *FileName));
+	check(OnDisk == Data);
+
+	auto File = FCachedFile::OpenRead(FileName);
+	FMemory::Memzero(Read.GetData(), Read.Num());
+	CHECK_RESULT(File->ReadAt(0, Read.GetData(), Read.Num()));
+	check(Read == Data);
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite cached file suc."));
+	return 0;
+};
+
+// the nodes of the key tree borrow and merge until only an empty root is left, the same entries added again
+// take the released pages instead of growing the file
+auto TestKeyBTreeRemove = [](){
+	constexpr int32 NumKeys = 20000;
+	auto MakeKey = [](int32 Key)
+	{
+		// keys of different lengths, so that nodes hold different numbers of them
+		FEncodedKey Bytes;
+		FIndexHelper::Encode(FString::Printf(TEXT("key%s%d"), *FString::ChrN(Key % 40, 'x'), Key), Bytes);
+		return Bytes;
+	};
+
+	FFileSystem FileSys;
+	CHECK_RESULT(FileSys.Init(FPaths::ProjectSavedDir() + TEXT("TestKeyTree.db"), false, ELowLevelFileType::Memory));
+	FFileSystem::FMutationScope Mutation(&FileSys);
+	auto File = FileSys.NewFile();
+	FKeyBTree Tree(File);
+	Tree.Init();
+	auto AddKeys = [&]()
+	{
+		for (int32 Key = 0; Key < NumKeys; ++Key)
+		{
+			Tree.Insert(MakeKey(Key), Key);
+		}
+	};
+	AddKeys();
+	const auto FullSize = File->GetSize();
+
+	// every other key first, then the rest from the back
+	for (int32 Key = 0; Key < NumKeys; Key += 2)
+	{
+		CHECK_RESULT(Tree.Remove(MakeKey(Key), Key));
+	}
+	for (int32 Key = 0; Key < NumKeys; Key += 97)
+	{
+		check(Tree.Find(MakeKey(Key)).Num() == Key % 2);
+	}
+	for (int32 Key = NumKeys - 1; Key > 0; Key -= 2)
+	{
+		CHECK_RESULT(Tree.Remove(MakeKey(Key), Key));
+		check(!Tree.Remove(MakeKey(Key), Key));
+	}
+	const uint8 Empty[] = { 0 };
+	check(!Tree.FindRange(TArrayView<const uint8>(Empty, 0), TArrayView<const uint8>(Empty, 0)).IsValid());
+
+	AddKeys();
+	check(File->GetSize() == FullSize);
+	for (int32 Key = 0; Key < NumKeys; ++Key)
+	{
+		const auto Datas = Tree.Find(MakeKey(Key));
+		check(Datas.Num() == 1 && Datas[0] == (uint32)Key);
+	}
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite key tree remove suc."));
+	return 0;
+};
+
+// the workers of ParallelScan find the same rows as GetRows, through handles of their own on disk and in a pool
+// much smaller than the table, and through the shared one in memory and with the log
+auto TestParallelScan = [](){
+	constexpr int32 NumRows = 5000;
+	auto MakeRow = [](int32 Id)
+	{
+		// some rows span pages, they are copied instead of pinned
+		TArray<uint8> Data;
+		Data.SetNumUninitialized(Id % 50 == 0 ? FILE_PAGE_SIZE + 100 : 16 + Id % 200);
+		for (int32 Index = 0; Index < Data.Num(); ++Index)
+		{
+			Data[Index] = (uint8)(Id + Index * 3);
+		}
+		return Data;
+	};
+
+	auto ScanTable = [&](ELowLevelFileType Type, bool bWriteAheadLog, const TCHAR* Name)
+	{
+		const FString FileName = FPaths::ProjectSavedDir() + Name;
+		IFileManager::Get().Delete(*FileName);
+		IFileManager::Get().Delete(*(FileName + TEXT(".wal")));
+		FFileSystemOptions Options;
+		Options.bWriteAheadLog = bWriteAheadLog;
+		Options.BufferPoolSize = 4 * FILE_PAGE_SIZE;
+
+		FDatabaseLite DB;
+		CHECK_RESULT(DB.Open(FileName, false, Type, Options));
+		auto Table = DB.CreateTable(TEXT("TestTable"), { {TEXT("id"), FKeyTypeSequence{EKeyType::Integer}} });
+		auto IdIndex = Table->GetIndexHandle(TEXT("id"));
+		for (int32 i = 0; i < NumRows; ++i)
+		{
+			auto Data = MakeRow(i);
+			CHECK_RESULT(Table->AddRow(IdIndex, FKeySequence((int64)i), Data.GetData(), Data.Num(), true));
+		}
+		for (int32 i = 0; i < NumRows; i += 7)
+		{
+			CHECK_RESULT(Table->RemoveRow(IdIndex, FKeySequence((int64)i)));
+		}
+
+		FCriticalSection Mutex;
+		TArray<TPair<uint32, FDBTable::RowData>> Scanned;
+		const int32 Count = Table->ParallelScan(
+			[](uint32 RowId, const FDBTable::FRowView& View) { return View.Num() > 0; },
+			[&](uint32 RowId, const FDBTable::FRowView& View)
+			{
+				FScopeLock Lock(&Mutex);
+				Scanned.Emplace(RowId, FDBTable::RowData(View.GetData(), View.Num()));
+			}, 4);
+		Scanned.Sort([](const auto& A, const auto& B) { return A.Key < B.Key; });
+
+		auto Rows = Table->GetRows();
+		check(Count == Scanned.Num() && Rows.Num() == Scanned.Num());
+		for (int32 Index = 0; Index < Rows.Num(); ++Index)
+		{
+			check(Rows[Index] == Scanned[Index].Value);
+		}
+	};
+	ScanTable(ELowLevelFileType::Normal, false, TEXT("TestScanNormal.db"));
+	ScanTable(ELowLevelFileType::Cached, false, TEXT("TestScanCached.db"));
+	ScanTable(ELowLevelFileType::Cached, true, TEXT("TestScanLog.db"));
+	ScanTable(ELowLevelFileType::Memory, false, TEXT("TestScanMemory.db"));
+	UE_LOG(LogTemp, Display, TEXT("test DatabaseLite parallel scan suc."));
+	return 0;
+};
+
 //#include "SQLiteDatabaseConnection.h"
 //#include "SQLiteResultSet.h"
 
@@ -133,6 +845,17 @@ TAutoConsoleVariable<int> TestCase(TEXT("ConfigTestCase"), 3, TEXT(""));
 static auto TestAutoReg = []() {
 	TestCase->SetOnChangedCallback(FConsoleVariableDelegate::CreateLambda([](auto Var) {
 			Test();
+			TestBulkInsert();
+			TestLogTornTail();
+			TestSnapshotIsolation();
+			TestVacuum();
+			TestRemoveAll();
+			TestHashIndex();
+			TestOrderedIndex();
+			TestPageReuse();
+			TestCachedFile();
+			TestKeyBTreeRemove();
+			TestParallelScan();
 			//Test2();
 		}));
 	return 0;